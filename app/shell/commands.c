@@ -9,10 +9,15 @@
 #include <framebuffer.h>
 #include <fs.h>
 #include <heap.h>
+#include <idt.h>
+#include <irqstat.h>
+#include <isr.h>
 #include <panic.h>
+#include <pmm.h>
 #include <power.h>
 #include <serial.h>
 #include <shell.h>
+#include <slab.h>
 #include <sound.h>
 #include <stdio.h>
 #include <string.h>
@@ -118,7 +123,222 @@ void cmd_meminfo(int argc, char **argv)
 {
     printf("Memory information:\n");
     printf("Used heap memory: %lu bytes (allocated: %lu bytes)\n",
-           heap_get_used_memory(), HEAP_SIZE);
+           heap_get_used_memory(), heap_get_total_memory());
+
+    pmm_stats_t stats;
+    pmm_stats(&stats);
+    printf("Physical pages: %lu total, %lu free, %lu used\n",
+           stats.total_pages, stats.free_pages, stats.used_pages);
+    printf("Physical memory free: %lu KB\n", stats.free_pages * 4);
+    printf("Pre-zeroed pages: %lu\n", stats.zeroed_pages);
+    printf("Largest free run: %lu pages (%lu KB)\n", stats.largest_free_run,
+           stats.largest_free_run * 4);
+    printf("Free blocks by order:");
+    for (int i = 0; i <= PMM_MAX_ORDER; i++) {
+        printf(" %lu", stats.free_blocks[i]);
+    }
+    putchar('\n');
+}
+
+void cmd_slabinfo(int argc, char **argv)
+{
+    printf("cache              size  inuse  slabs  order   allocs\n");
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        kmem_cache_t *cache = kmem_cache_get(i);
+        if (!cache) {
+            continue;
+        }
+        printf("%s", cache->name);
+        for (int pad = strlen(cache->name); pad < 17; pad++) {
+            putchar(' ');
+        }
+        printf("%6lu %6lu %6lu %6d %8lu\n", cache->obj_size,
+               cache->objs_in_use, cache->slab_count, cache->slab_order,
+               cache->total_allocs);
+    }
+}
+
+/**
+ * @brief Prints the profiled call sites, largest live usage first, through
+ * either printf or serial_printf.
+ */
+static void memprof_report(int (*out)(const char *restrict, ...))
+{
+    static heap_site_t sites[HEAP_PROF_MAX_SITES];
+    int count = 0;
+    for (int i = 0; i < HEAP_PROF_MAX_SITES; i++) {
+        if (heap_profile_site(i, &sites[count])) {
+            count++;
+        }
+    }
+
+    // Few enough sites that an insertion sort is fine
+    for (int i = 1; i < count; i++) {
+        heap_site_t site = sites[i];
+        int j = i;
+        while (j > 0 && sites[j - 1].live_bytes < site.live_bytes) {
+            sites[j] = sites[j - 1];
+            j--;
+        }
+        sites[j] = site;
+    }
+
+    out("caller               allocs    frees  live KB  peak KB"
+        "  cyc/alloc\n");
+    for (int i = 0; i < count; i++) {
+        heap_site_t *site = &sites[i];
+        out("0x%lx %8lu %8lu %8lu %8lu %10lu\n", site->caller, site->allocs,
+            site->frees, site->live_bytes / 1024, site->peak_bytes / 1024,
+            site->allocs ? site->cycles / site->allocs : 0);
+    }
+    if (heap_profile_dropped()) {
+        out("%lu allocations were not tracked (tables full)\n",
+            heap_profile_dropped());
+    }
+}
+
+void cmd_memprof(int argc, char **argv)
+{
+    if (argc == 2 && strcmp(argv[1], "on") == 0) {
+        heap_profile_enable(true);
+        printf("Allocation profiling enabled\n");
+    } else if (argc == 2 && strcmp(argv[1], "off") == 0) {
+        heap_profile_enable(false);
+        printf("Allocation profiling disabled\n");
+    } else if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        heap_profile_reset();
+    } else if (argc == 2 && strcmp(argv[1], "serial") == 0) {
+        memprof_report(serial_printf);
+        printf("Profile written to serial\n");
+    } else if (argc == 1) {
+        if (!heap_profile_enabled()) {
+            printf("Profiling is off, enable it with 'memprof on'\n");
+        }
+        memprof_report(printf);
+    } else {
+        printf("Usage: memprof [on|off|reset|serial]\n");
+    }
+}
+
+static const char *irqstat_vector_name(uint8_t vector)
+{
+    static char name[16];
+    if (vector < 32) {
+        return exceptions[vector];
+    }
+    switch (vector) {
+    case VECTOR_LAPIC_TIMER:
+        return "LAPIC timer";
+    case VECTOR_TLB_SHOOTDOWN:
+        return "TLB shootdown";
+    case VECTOR_RESCHEDULE:
+        return "Reschedule";
+    }
+    if (vector < VECTOR_DYNAMIC_START) {
+        snprintf(name, sizeof(name), "IRQ %d", vector - 32);
+    } else {
+        snprintf(name, sizeof(name), "Device");
+    }
+    return name;
+}
+
+/**
+ * @brief Prints per-vector handler times and the longest interrupts-off
+ * window, through either printf or serial_printf.
+ */
+static void irqstat_report(int (*out)(const char *restrict, ...))
+{
+    out("vector  name                        count   min ns   avg ns"
+        "   max ns\n");
+    for (int vector = 0; vector < IDT_ENTRIES; vector++) {
+        irqstat_vector_t stats;
+        if (!irqstat_vector(vector, &stats)) {
+            continue;
+        }
+        const char *name = irqstat_vector_name(vector);
+        out("0x%02x    %s", vector, name);
+        for (int pad = strlen(name); pad < 22; pad++) {
+            out(" ");
+        }
+        out("%10lu %8lu %8lu %8lu\n", stats.count,
+            irqstat_cycles_to_ns(stats.min_cycles),
+            irqstat_cycles_to_ns(stats.total_cycles / stats.count),
+            irqstat_cycles_to_ns(stats.max_cycles));
+    }
+
+    irqstat_irqoff_t window;
+    irqstat_irqoff(&window);
+    if (window.cycles) {
+        out("Longest interrupts-off window: %lu ns on CPU %d, from 0x%lx\n",
+            irqstat_cycles_to_ns(window.cycles), window.cpu, window.caller);
+    }
+}
+
+static void irqstat_histogram(unsigned long vector)
+{
+    irqstat_vector_t stats;
+    if (vector >= IDT_ENTRIES || !irqstat_vector(vector, &stats)) {
+        printf("No samples for that vector\n");
+        return;
+    }
+
+    printf("Handler time for vector 0x%x (%s):\n", vector,
+           irqstat_vector_name(vector));
+    for (int i = 0; i < IRQSTAT_BUCKETS; i++) {
+        if (stats.histogram[i] == 0) {
+            continue;
+        }
+        printf("%10lu+ cycles: %lu\n", 1UL << i, stats.histogram[i]);
+    }
+}
+
+void cmd_irqstat(int argc, char **argv)
+{
+    if (argc == 2 && strcmp(argv[1], "on") == 0) {
+        irqstat_enable(true);
+        printf("Interrupt timing enabled\n");
+    } else if (argc == 2 && strcmp(argv[1], "off") == 0) {
+        irqstat_enable(false);
+        printf("Interrupt timing disabled\n");
+    } else if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        irqstat_reset();
+    } else if (argc == 2 && strcmp(argv[1], "serial") == 0) {
+        irqstat_report(serial_printf);
+        printf("Statistics written to serial\n");
+    } else if (argc == 3 && strcmp(argv[1], "hist") == 0) {
+        irqstat_histogram(strtoul(argv[2], NULL, 0));
+    } else if (argc == 1) {
+        if (!irqstat_enabled()) {
+            printf("Timing is off, enable it with 'irqstat on'\n");
+        }
+        irqstat_report(printf);
+    } else {
+        printf("Usage: irqstat [on|off|reset|serial|hist <vector>]\n");
+    }
+}
+
+void cmd_heapfrag(int argc, char **argv)
+{
+    heap_frag_t stats;
+    heap_frag_stats(&stats);
+
+    printf("Free blocks by size class:\n");
+    for (int i = 0; i < HEAP_CLASSES; i++) {
+        if (stats.free_blocks[i] == 0) {
+            continue;
+        }
+        printf("%10lu+ B: %6lu blocks, %8lu KB\n",
+               1UL << (i + HEAP_MIN_CLASS_SHIFT), stats.free_blocks[i],
+               stats.free_bytes[i] / 1024);
+    }
+
+    printf("Free: %lu KB, largest block: %lu KB\n", stats.total_free / 1024,
+           stats.largest_free / 1024);
+    if (stats.total_free) {
+        // Share of free memory that can't be handed out as one allocation
+        printf("Fragmentation: %lu%%\n",
+               100 - stats.largest_free * 100 / stats.total_free);
+    }
 }
 
 void cmd_fbtest(int argc, char **argv)
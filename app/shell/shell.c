@@ -31,6 +31,10 @@ const cmd_list_t cmds[] = {
     {"sysinfo", &cmd_sysinfo},
     {"susinfo", &cmd_susinfo},
     {"meminfo", &cmd_meminfo},
+    {"slabinfo", &cmd_slabinfo},
+    {"memprof", &cmd_memprof},
+    {"heapfrag", &cmd_heapfrag},
+    {"irqstat", &cmd_irqstat},
     {"fbtest", &cmd_fbtest},
     {"memtest", &cmd_memtest},
     {"lsblk", &cmd_lsblk},
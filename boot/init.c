@@ -2,6 +2,7 @@
 #include <apic.h>
 #include <array.h>
 #include <ata.h>
+#include <clocksource.h>
 #include <cpu.h>
 #include <debug.h>
 #include <fat32.h>
@@ -20,10 +21,14 @@
 #include <process.h>
 #include <scheduler.h>
 #include <serial.h>
+#include <smp.h>
+#include <softirq.h>
 #include <stdio.h>
 #include <tty.h>
 #include <verinfo.h>
 #include <vmm.h>
+#include <wasm_runner.h>
+#include <workqueue.h>
 
 bool is_system_initialised = false;
 
@@ -48,19 +53,29 @@ boot_task_t boot_tasks[] = {
     {.msg = "Init IDT", .func = idt_init},
     {.msg = "Init PMM", .func = pmm_init},
     {.msg = "Init VMM", .func = vmm_init},
+    {.msg = "Map framebuffer write-combining", .func = fb_enable_wc},
     {.msg = "Init PIT", .func = pit_init},
     {.msg = "Init TSC", .func = tsc_init},
 #if ACPI_ENABLED
     {.msg = "Init ACPI", .func = acpi_init},
 #endif
     {.msg = "Init APIC", .func = apic_init},
+    {.msg = "Init clocksource", .func = clocksource_init},
     {.msg = "Register filesystem drivers", .func = fat32_init},
     {.msg = "Init disk drivers and filesystems", .func = fs_init},
     {.msg = "Init mouse", .func = mouse_init},
     {.msg = "Init keyboard", .func = kbd_init},
     {.msg = "Init TTY", .func = tty_init},
     {.msg = "Init scheduler", .func = scheduler_init},
+    {.msg = "Start application processors", .func = smp_init},
+    {.msg = "Start softirq threads", .func = softirq_start},
+    {.msg = "Start work queues", .func = workqueue_start_system},
+#if ACPI_ENABLED
+    {.msg = "Start ACPI workers", .func = acpi_workers_start},
+#endif
+    {.msg = "Start page zeroing thread", .func = pmm_zero_thread_start},
     {.msg = "Init process table", .func = proc_table_init},
+    {.msg = "Init WASM runner", .func = wasm_runner_init},
 };
 
 boot_task_t late_boot_tasks[] = {
@@ -3,7 +3,9 @@
 #include <acpi.h>
 #include <stdio.h>
 #include <uacpi/internal/types.h>
+#include <uacpi/acpi.h>
 #include <uacpi/namespace.h>
+#include <uacpi/resources.h>
 #include <uacpi/sleep.h>
 #include <uacpi/status.h>
 #include <uacpi/utilities.h>
@@ -211,4 +213,122 @@ void acpi_list_acpi_devices()
     uacpi_namespace_for_each_child(uacpi_namespace_root(), list_device_callback,
                                    NULL, UACPI_OBJECT_DEVICE_BIT,
                                    UACPI_MAX_DEPTH_ANY, NULL);
-}
\ No newline at end of file
+}
+typedef struct {
+    uint8_t bus;
+    uacpi_namespace_node *node;
+} pci_root_search_t;
+
+static uacpi_iteration_decision pci_root_callback(void *user,
+                                                  uacpi_namespace_node *node,
+                                                  uacpi_u32 depth)
+{
+    pci_root_search_t *search = user;
+
+    // A root bridge without _BBN decodes bus 0
+    uacpi_u64 bus = 0;
+    uacpi_eval_simple_integer(node, "_BBN", &bus);
+    if (bus == search->bus) {
+        search->node = node;
+        return UACPI_ITERATION_DECISION_BREAK;
+    }
+    return UACPI_ITERATION_DECISION_CONTINUE;
+}
+
+typedef struct {
+    uint32_t gsi;
+    uint16_t flags;
+    bool found;
+} link_irq_t;
+
+static uint16_t madt_flags(uacpi_u8 triggering, uacpi_u8 polarity)
+{
+    uint16_t flags = triggering == UACPI_TRIGGERING_LEVEL
+                         ? ACPI_MADT_TRIGGERING_LEVEL
+                         : ACPI_MADT_TRIGGERING_EDGE;
+    flags |= polarity == UACPI_POLARITY_ACTIVE_LOW
+                 ? ACPI_MADT_POLARITY_ACTIVE_LOW
+                 : ACPI_MADT_POLARITY_ACTIVE_HIGH;
+    return flags;
+}
+
+// Takes the IRQ a link device is currently set to from its _CRS
+static uacpi_iteration_decision link_irq_callback(void *user,
+                                                  uacpi_resource *resource)
+{
+    link_irq_t *link = user;
+
+    if (resource->type == UACPI_RESOURCE_TYPE_IRQ &&
+        resource->irq.num_irqs > 0) {
+        link->gsi = resource->irq.irqs[0];
+        link->flags =
+            madt_flags(resource->irq.triggering, resource->irq.polarity);
+        link->found = true;
+        return UACPI_ITERATION_DECISION_BREAK;
+    }
+    if (resource->type == UACPI_RESOURCE_TYPE_EXTENDED_IRQ &&
+        resource->extended_irq.num_irqs > 0) {
+        link->gsi = resource->extended_irq.irqs[0];
+        link->flags = madt_flags(resource->extended_irq.triggering,
+                                 resource->extended_irq.polarity);
+        link->found = true;
+        return UACPI_ITERATION_DECISION_BREAK;
+    }
+    return UACPI_ITERATION_DECISION_CONTINUE;
+}
+
+bool acpi_pci_route_irq(pci_device_t *dev, uint32_t *gsi, uint16_t *flags)
+{
+    // 1 for INTA# through 4 for INTD#, _PRT counts from 0
+    uint8_t pin = pci_read_byte(dev->bus, dev->device, dev->function, 0x3D);
+    if (pin == 0 || pin > 4) {
+        return false;
+    }
+
+    const uacpi_char *const hids[] = {ACPI_HID_PCI_HOST_BRIDGE,
+                                      ACPI_HID_PCIE_HOST_BRIDGE, UACPI_NULL};
+    pci_root_search_t search = {dev->bus, NULL};
+    uacpi_find_devices_at(uacpi_namespace_root(), hids, pci_root_callback,
+                          &search);
+    if (!search.node) {
+        log_warn("ACPI: No host bridge for PCI bus %d", dev->bus);
+        return false;
+    }
+
+    uacpi_pci_routing_table *table;
+    uacpi_status ret = uacpi_get_pci_routing_table(search.node, &table);
+    if (uacpi_unlikely_error(ret)) {
+        log_err("ACPI: Failed to get PCI routing table: %s",
+                uacpi_status_to_string(ret));
+        return false;
+    }
+
+    bool routed = false;
+    for (uacpi_size i = 0; i < table->num_entries; i++) {
+        uacpi_pci_routing_table_entry *entry = &table->entries[i];
+        // The function half of the address is always 0xFFFF, any function
+        if ((entry->address >> 16) != dev->device || entry->pin != pin - 1) {
+            continue;
+        }
+
+        if (!entry->source) {
+            // Hardwired to a GSI, which PCI defines as level, active low
+            *gsi = entry->index;
+            *flags = ACPI_MADT_TRIGGERING_LEVEL | ACPI_MADT_POLARITY_ACTIVE_LOW;
+            routed = true;
+        } else {
+            link_irq_t link = {0, 0, false};
+            uacpi_for_each_device_resource(entry->source, "_CRS",
+                                           link_irq_callback, &link);
+            if (link.found) {
+                *gsi = link.gsi;
+                *flags = link.flags;
+                routed = true;
+            }
+        }
+        break;
+    }
+
+    uacpi_free_pci_routing_table(table);
+    return routed;
+}
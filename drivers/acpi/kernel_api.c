@@ -1,4 +1,6 @@
 #include <acpi.h>
+#include <apic.h>
+#include <clocksource.h>
 #include <cpu.h>
 #include <debug.h>
 #include <heap.h>
@@ -8,12 +10,15 @@
 #include <lock.h>
 #include <panic.h>
 #include <pci.h>
-#include <pit.h>
 #include <scheduler.h>
+#include <slab.h>
 #include <string.h>
 #include <timer.h>
+#include <uacpi/acpi.h>
 #include <uacpi/kernel_api.h>
+#include <uacpi/utilities.h>
 #include <vmm.h>
+#include <workqueue.h>
 
 typedef struct {
     uacpi_interrupt_handler handler;
@@ -21,6 +26,10 @@ typedef struct {
     uacpi_u32 irq;
 } uacpi_interrupt_wrapper_t;
 
+// uACPI's own interrupts, the SCI, are level-triggered and active low
+#define UACPI_IRQ_FLAGS                                                        \
+    (ACPI_MADT_TRIGGERING_LEVEL | ACPI_MADT_POLARITY_ACTIVE_LOW)
+
 static uint64_t uacpi_interrupt_stub(uint64_t rsp, void *ctx)
 {
     uacpi_interrupt_wrapper_t *wrapper = ctx;
@@ -53,9 +62,12 @@ void *uacpi_kernel_map(uacpi_phys_addr addr, uacpi_size len)
 
 void uacpi_kernel_unmap(void *addr, uacpi_size len)
 {
-    // TODO: create VMA manager
-    (void)addr;
-    (void)len;
+    // uacpi_kernel_map() keeps the offset into the first page, so round the
+    // same way mmap_physical() did
+    uintptr_t start = (uintptr_t)addr & ~(PAGE_SIZE - 1);
+    size_t num_pages =
+        ((uintptr_t)addr + len - start + PAGE_SIZE - 1) / PAGE_SIZE;
+    vmm_free_range((void *)start, num_pages);
 }
 
 void uacpi_kernel_log(uacpi_log_level level, const uacpi_char *msg)
@@ -94,6 +106,8 @@ uacpi_status uacpi_kernel_pci_device_open(uacpi_pci_address address,
     dev->bus = address.bus;
     dev->device = address.device;
     dev->function = address.function;
+    dev->msix_table = NULL;
+    dev->msix_count = 0;
 
     *out_handle = (uacpi_handle)dev;
     return UACPI_STATUS_OK;
@@ -232,7 +246,7 @@ void uacpi_kernel_stall(uacpi_u8 usec)
 
 void uacpi_kernel_sleep(uacpi_u64 msec)
 {
-    wait_ms(msec);
+    thread_sleep_ns(msec * 1000000);
 }
 
 uacpi_handle uacpi_kernel_create_mutex(void)
@@ -284,7 +298,7 @@ void uacpi_kernel_release_mutex(uacpi_handle handle)
 uacpi_bool uacpi_kernel_wait_for_event(uacpi_handle handle, uacpi_u16 timeout)
 {
     uint32_t *counter = (uint32_t *)handle;
-    uacpi_u64 start_ticks = pit_ticks;
+    uacpi_u64 start_ns = clock_monotonic_ns();
 
     while (true) {
         uint32_t current_val = __atomic_load_n(counter, __ATOMIC_ACQUIRE);
@@ -299,7 +313,8 @@ uacpi_bool uacpi_kernel_wait_for_event(uacpi_handle handle, uacpi_u16 timeout)
             continue;
         }
 
-        if (timeout != 0xFFFF && (pit_ticks - start_ticks) > timeout) {
+        if (timeout != 0xFFFF &&
+            (clock_monotonic_ns() - start_ns) / 1000000 > timeout) {
             return UACPI_FALSE;
         }
 
@@ -344,7 +359,12 @@ uacpi_kernel_uninstall_interrupt_handler(uacpi_interrupt_handler handler,
     uacpi_interrupt_wrapper_t *wrapper = irq_handle;
     (void)handler;
 
-    irq_uninstall_handler((uint8_t)wrapper->irq, uacpi_interrupt_stub, wrapper);
+    if (wrapper->irq < 16) {
+        irq_uninstall_handler((uint8_t)wrapper->irq, uacpi_interrupt_stub,
+                              wrapper);
+    } else {
+        irq_uninstall_gsi_handler(wrapper->irq, uacpi_interrupt_stub, wrapper);
+    }
     free(wrapper);
 
     return UACPI_STATUS_OK;
@@ -371,17 +391,54 @@ void uacpi_kernel_unlock_spinlock(uacpi_handle handle, uacpi_cpu_flags flags)
     uacpi_kernel_release_mutex(handle);
 }
 
-uacpi_status uacpi_kernel_schedule_work(uacpi_work_type,
+typedef struct {
+    work_t work;
+    uacpi_work_handler handler;
+    uacpi_handle ctx;
+} uacpi_work_wrapper_t;
+
+static kmem_cache_t *uacpi_work_cache = NULL;
+
+// uACPI requires GPE handlers to run on CPU 0, one at a time
+static workqueue_t acpi_gpe_wq = {
+    .name = "acpi_gpe",
+    .idle = {NULL, NULL, {0, "workqueue"}},
+    .flushers = {NULL, NULL, {0, "workqueue_flush"}},
+};
+
+void acpi_workers_start()
+{
+    workqueue_start(&acpi_gpe_wq, 1, 0);
+}
+
+static void uacpi_work_stub(void *arg)
+{
+    uacpi_work_wrapper_t *wrapper = arg;
+    wrapper->handler(wrapper->ctx);
+    kmem_cache_free(uacpi_work_cache, wrapper);
+}
+
+uacpi_status uacpi_kernel_schedule_work(uacpi_work_type type,
                                         uacpi_work_handler handler,
                                         uacpi_handle ctx)
 {
-    thread_create(handler, ctx);
+    uacpi_work_wrapper_t *wrapper = kmem_cache_alloc(uacpi_work_cache);
+    if (!wrapper) {
+        return UACPI_STATUS_OUT_OF_MEMORY;
+    }
+
+    wrapper->handler = handler;
+    wrapper->ctx = ctx;
+    work_init(&wrapper->work, uacpi_work_stub, wrapper);
+    queue_work(type == UACPI_WORK_GPE_EXECUTION ? &acpi_gpe_wq : &system_wq,
+               &wrapper->work);
     return UACPI_STATUS_OK;
 }
 
 uacpi_status uacpi_kernel_wait_for_work_completion(void)
 {
-    wait_ms(100); // TODO: an actual implementation of this function
+    workqueue_flush(&acpi_gpe_wq);
+    workqueue_flush(&system_wq);
     return UACPI_STATUS_OK;
 }
 
@@ -389,10 +446,6 @@ uacpi_status uacpi_kernel_install_interrupt_handler(
     uacpi_u32 irq, uacpi_interrupt_handler handler, uacpi_handle ctx,
     uacpi_handle *out_irq_handle)
 {
-    if (irq > 15) {
-        return UACPI_STATUS_INVALID_ARGUMENT;
-    }
-
     uacpi_interrupt_wrapper_t *wrapper =
         malloc(sizeof(uacpi_interrupt_wrapper_t));
     if (!wrapper) {
@@ -403,7 +456,14 @@ uacpi_status uacpi_kernel_install_interrupt_handler(
     wrapper->ctx = ctx;
     wrapper->irq = irq;
 
-    irq_install_handler((uint8_t)irq, uacpi_interrupt_stub, wrapper);
+    // IRQs past the legacy ones are GSIs, which only the I/O APIC reaches
+    if (irq < 16) {
+        irq_install_handler((uint8_t)irq, uacpi_interrupt_stub, wrapper);
+    } else if (irq_install_gsi_handler(irq, UACPI_IRQ_FLAGS,
+                                       uacpi_interrupt_stub, wrapper) < 0) {
+        free(wrapper);
+        return UACPI_STATUS_INVALID_ARGUMENT;
+    }
 
     if (out_irq_handle) {
         *out_irq_handle = (uacpi_handle)wrapper;
@@ -417,6 +477,15 @@ void acpi_init()
     uacpi_status status;
     const char *err_msg = NULL;
 
+    // Work is scheduled from the SCI handler, which mustn't race another CPU
+    // to create the cache, so it exists before uACPI can ask for work
+    uacpi_work_cache = kmem_cache_create(
+        "uacpi_work", sizeof(uacpi_work_wrapper_t), 0, NULL);
+    if (!uacpi_work_cache) {
+        log_err("ACPI: Failed to create the uACPI work cache");
+        return;
+    }
+
     status = uacpi_initialize(0);
     if (status != UACPI_STATUS_OK) {
         err_msg = "Failed to initialize uACPI";
@@ -429,6 +498,16 @@ void acpi_init()
         goto uacpi_error;
     }
 
+    // _PRT describes I/O APIC routing only once the firmware is told it's
+    // in use
+    if (is_apic_enabled()) {
+        status = uacpi_set_interrupt_model(UACPI_INTERRUPT_MODEL_IOAPIC);
+        if (status != UACPI_STATUS_OK) {
+            log_warn("ACPI: Failed to select the I/O APIC model: %s",
+                     uacpi_status_to_string(status));
+        }
+    }
+
     status = uacpi_namespace_initialize();
     if (status != UACPI_STATUS_OK) {
         err_msg = "Failed to initialize uACPI namespace";
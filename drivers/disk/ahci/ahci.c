@@ -55,21 +55,16 @@ void port_rebase(hba_port_t *port, int portno)
     port->fb = (uint32_t)(uintptr_t)fb_phys;
     port->fbu = (uint32_t)((uintptr_t)fb_phys >> 32);
 
-    // Allocate memory for command tables (32 tables * 256 bytes = 8KB = 2 pages)
-    void *ct_phys_base1 = pmm_alloc_page();
-    void *ct_phys_base2 = pmm_alloc_page();
-    
+    // Allocate memory for command tables (32 tables * 256 bytes = 8KB = 2
+    // contiguous pages)
+    void *ct_phys_base = pmm_alloc_pages(1);
+
     hba_cmd_header_t *cmdheader = (hba_cmd_header_t *)cl_virt;
     for (int i = 0; i < 32; i++) {
         cmdheader[i].prdtl = 8;
-        
-        void *ct_phys;
-        if (i < 16) {
-            ct_phys = (void *)((uintptr_t)ct_phys_base1 + (i * 256));
-        } else {
-            ct_phys = (void *)((uintptr_t)ct_phys_base2 + ((i - 16) * 256));
-        }
-        
+
+        void *ct_phys = (void *)((uintptr_t)ct_phys_base + (i * 256));
+
         cmdheader[i].ctba = (uint32_t)(uintptr_t)ct_phys;
         cmdheader[i].ctbau = (uint32_t)((uintptr_t)ct_phys >> 32);
         
@@ -107,7 +102,8 @@ void ahci_init()
     uintptr_t abar_phys = pci_get_bar_address(&ahci_dev, 5);
     ahci_abar = (hba_mem_t *)mmap_physical(
         (void *)0xFFFFFFFF40000000, // A safe "MMIO" virtual range
-        (void *)abar_phys, sizeof(hba_mem_t), 0x1B);
+        (void *)abar_phys, sizeof(hba_mem_t),
+        VMM_PRESENT | VMM_WRITE | VMM_UC);
 
     if (ahci_abar == NULL) {
         log_err("AHCI: Failed to map controller memory.");
@@ -5,6 +5,7 @@
 #include <fs.h>
 #include <heap.h>
 #include <io.h>
+#include <scheduler.h>
 #include <string.h>
 
 // ATA PIO registers
@@ -61,16 +62,27 @@ static uint16_t ata_status_port[2] = {ATA_PRIMARY_STATUS, ATA_SECONDARY_STATUS};
 
 static bool ata_drives_present[4] = {false};
 
+// BSY and DRQ usually change within microseconds, so poll briefly before
+// starting to sleep between polls
+#define ATA_SPIN_POLLS 1000
+#define ATA_POLL_NS 50000
+
 static void ata_wait_busy(uint8_t drive)
 {
-    while (inb(ata_status_port[drive]) & ATA_SR_BSY)
-        ;
+    for (int i = 0; inb(ata_status_port[drive]) & ATA_SR_BSY; i++) {
+        if (i >= ATA_SPIN_POLLS) {
+            thread_sleep_ns(ATA_POLL_NS);
+        }
+    }
 }
 
 static void ata_wait_drq(uint8_t drive)
 {
-    while (!(inb(ata_status_port[drive]) & ATA_SR_DRQ))
-        ;
+    for (int i = 0; !(inb(ata_status_port[drive]) & ATA_SR_DRQ); i++) {
+        if (i >= ATA_SPIN_POLLS) {
+            thread_sleep_ns(ATA_POLL_NS);
+        }
+    }
 }
 
 void ata_init()
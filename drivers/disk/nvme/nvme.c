@@ -1,14 +1,62 @@
+#include <clocksource.h>
+#include <cpu.h>
 #include <debug.h>
-#include <heap.h>
 #include <nvme.h>
 #include <pci.h>
+#include <pmm.h>
+#include <scheduler.h>
 #include <stdio.h>
 #include <string.h>
 #include <timer.h>
 #include <vmm.h>
 
+// Most commands complete within microseconds, so completions are polled in a
+// spin first, then every NVME_POLL_NS with the thread asleep in between, for
+// up to NVME_COMMAND_TIMEOUT_NS
+#define NVME_SPIN_POLLS 1000
+#define NVME_POLL_NS 50000
+#define NVME_COMMAND_TIMEOUT_NS 500000000ULL
+
 static nvme_controller_t controller;
 
+/**
+ * @brief Allocates zeroed, physically contiguous memory for DMA.
+ *
+ * @return The HHDM virtual address of the buffer, or NULL on failure.
+ */
+static void *nvme_dma_alloc(size_t size)
+{
+    void *phys = pmm_alloc_pages(pmm_order_for_size(size));
+    if (!phys) {
+        return NULL;
+    }
+    void *virt = phys_to_virt(phys);
+    memset(virt, 0, size);
+    return virt;
+}
+
+static void nvme_dma_free(void *virt, size_t size)
+{
+    if (virt) {
+        pmm_free_pages(virt_to_phys(virt), pmm_order_for_size(size));
+    }
+}
+
+// Waits between two polls of a completion queue. Returns false once the
+// command's deadline has passed
+static bool nvme_poll_wait(uint64_t deadline, uint32_t polls)
+{
+    if (clock_monotonic_ns() >= deadline) {
+        return false;
+    }
+    if (polls < NVME_SPIN_POLLS) {
+        cpu_pause();
+    } else {
+        thread_sleep_ns(NVME_POLL_NS);
+    }
+    return true;
+}
+
 static bool nvme_submit_admin_command(nvme_cmd_t *cmd)
 {
     memcpy(&controller.admin_sq[controller.admin_sq_tail], cmd,
@@ -19,7 +67,8 @@ static bool nvme_submit_admin_command(nvme_cmd_t *cmd)
     controller.regs->doorbell[0] = controller.admin_sq_tail;
 
     // TODO: use interrupts instead of polling to wait for completion
-    for (int i = 0; i < 500; i++) {
+    uint64_t deadline = clock_monotonic_ns() + NVME_COMMAND_TIMEOUT_NS;
+    for (uint32_t polls = 0;; polls++) {
         nvme_cqe_t *cqe = &controller.admin_cq[controller.admin_cq_head];
         bool cqe_phase = (cqe->status & NVME_STATUS_P_MASK) ? 1 : 0;
 
@@ -42,7 +91,9 @@ static bool nvme_submit_admin_command(nvme_cmd_t *cmd)
 
             return true;
         }
-        wait_ms(1);
+        if (!nvme_poll_wait(deadline, polls)) {
+            break;
+        }
     }
 
     log_err("NVMe admin command timed out");
@@ -54,7 +105,7 @@ static bool nvme_identify_controller()
     log_verbose("NVMe: Identifying controller...");
 
     nvme_identify_controller_t *id_controller_data =
-        (nvme_identify_controller_t *)malloc(4096);
+        (nvme_identify_controller_t *)nvme_dma_alloc(4096);
     if (!id_controller_data) {
         log_err("Failed to allocate memory for NVMe identify data");
         return false;
@@ -63,11 +114,11 @@ static bool nvme_identify_controller()
     nvme_cmd_t cmd = {0};
     cmd.opcode = NVME_ADMIN_CMD_IDENTIFY;
     cmd.nsid = 0;
-    cmd.dptr[0] = (uint64_t)id_controller_data; // Assumes physical == virtual
+    cmd.dptr[0] = (uint64_t)virt_to_phys(id_controller_data);
     cmd.cdw10 = NVME_IDENTIFY_CONTROLLER;
 
     if (!nvme_submit_admin_command(&cmd)) {
-        free(id_controller_data);
+        nvme_dma_free(id_controller_data, 4096);
         return false;
     }
 
@@ -78,7 +129,7 @@ static bool nvme_identify_controller()
 
     log_info("NVMe: Found controller: %s (SN: %s)", model_num, serial_num);
 
-    free(id_controller_data);
+    nvme_dma_free(id_controller_data, 4096);
     return true;
 }
 
@@ -94,7 +145,8 @@ static bool nvme_submit_io_command(nvme_cmd_t *cmd)
     controller.regs->doorbell[queue_id * 2] = controller.io_sq_tail;
 
     // TODO: use interrupts instead of polling to wait for completion
-    for (int i = 0; i < 500; i++) {
+    uint64_t deadline = clock_monotonic_ns() + NVME_COMMAND_TIMEOUT_NS;
+    for (uint32_t polls = 0;; polls++) {
         nvme_cqe_t *cqe = &controller.io_cq[controller.io_cq_head];
         bool cqe_phase = (cqe->status & NVME_STATUS_P_MASK) ? 1 : 0;
 
@@ -117,7 +169,9 @@ static bool nvme_submit_io_command(nvme_cmd_t *cmd)
 
             return true;
         }
-        wait_ms(1);
+        if (!nvme_poll_wait(deadline, polls)) {
+            break;
+        }
     }
 
     log_err("NVMe I/O command timed out");
@@ -133,44 +187,35 @@ static bool nvme_setup_io_queues()
     size_t sq_size = controller.io_queue_size * sizeof(nvme_cmd_t);
     size_t cq_size = controller.io_queue_size * sizeof(nvme_cqe_t);
 
-    // NOTE: This memory MUST be physically contiguous.
-    controller.io_sq = (nvme_cmd_t *)malloc(sq_size);
-    controller.io_cq = (nvme_cqe_t *)malloc(cq_size);
+    controller.io_sq = (nvme_cmd_t *)nvme_dma_alloc(sq_size);
+    controller.io_cq = (nvme_cqe_t *)nvme_dma_alloc(cq_size);
 
     if (!controller.io_sq || !controller.io_cq) {
         log_err("NVMe: Failed to allocate I/O queues");
-        // Cleanup allocated memory
-        if (controller.io_sq) {
-            free(controller.io_sq);
-        }
-        if (controller.io_cq) {
-            free(controller.io_cq);
-        }
+        nvme_dma_free(controller.io_sq, sq_size);
+        nvme_dma_free(controller.io_cq, cq_size);
         return false;
     }
 
-    memset(controller.io_sq, 0, sq_size);
-    memset(controller.io_cq, 0, cq_size);
-
     // Create I/O Completion Queue
     nvme_cmd_t cq_cmd = {0};
     cq_cmd.opcode = NVME_ADMIN_CMD_CREATE_IO_CQ;
-    cq_cmd.dptr[0] = (uint64_t)controller.io_cq; // Assumes physical == virtual
+    cq_cmd.dptr[0] = (uint64_t)virt_to_phys(controller.io_cq);
     cq_cmd.cdw10 =
         ((controller.io_queue_size - 1) << 16) | controller.io_queue_id;
     cq_cmd.cdw11 = (1 << 0); // Physically contiguous
 
     if (!nvme_submit_admin_command(&cq_cmd)) {
         log_err("NVMe: Failed to create I/O completion queue");
-        free(controller.io_sq);
-        free(controller.io_cq);
+        nvme_dma_free(controller.io_sq, sq_size);
+        nvme_dma_free(controller.io_cq, cq_size);
         return false;
     }
 
     // Create I/O Submission Queue
     nvme_cmd_t sq_cmd = {0};
     sq_cmd.opcode = NVME_ADMIN_CMD_CREATE_IO_SQ;
-    sq_cmd.dptr[0] = (uint64_t)controller.io_sq; // Assumes physical == virtual
+    sq_cmd.dptr[0] = (uint64_t)virt_to_phys(controller.io_sq);
     sq_cmd.cdw10 =
         ((controller.io_queue_size - 1) << 16) | controller.io_queue_id;
     sq_cmd.cdw11 = (controller.io_queue_id << 16) |
@@ -178,8 +223,8 @@ static bool nvme_setup_io_queues()
 
     if (!nvme_submit_admin_command(&sq_cmd)) {
         log_err("NVMe: Failed to create I/O submission queue");
-        free(controller.io_sq);
-        free(controller.io_cq);
+        nvme_dma_free(controller.io_sq, sq_size);
+        nvme_dma_free(controller.io_cq, cq_size);
         return false;
     }
 
@@ -190,7 +235,7 @@ static void nvme_identify_namespaces(disk_driver_t *driver)
 {
     log_verbose("NVMe: Identifying namespaces...");
 
-    uint32_t *ns_list = (uint32_t *)malloc(4096);
+    uint32_t *ns_list = (uint32_t *)nvme_dma_alloc(4096);
     if (!ns_list) {
         log_err("Failed to allocate memory for NVMe namespace list");
         return;
@@ -199,11 +244,11 @@ static void nvme_identify_namespaces(disk_driver_t *driver)
     nvme_cmd_t cmd = {0};
     cmd.opcode = NVME_ADMIN_CMD_IDENTIFY;
     cmd.nsid = 0;
-    cmd.dptr[0] = (uint64_t)ns_list; // Assumes physical == virtual
+    cmd.dptr[0] = (uint64_t)virt_to_phys(ns_list);
     cmd.cdw10 = NVME_IDENTIFY_NS_LIST;
 
     if (!nvme_submit_admin_command(&cmd)) {
-        free(ns_list);
+        nvme_dma_free(ns_list, 4096);
         return;
     }
 
@@ -213,11 +258,15 @@ static void nvme_identify_namespaces(disk_driver_t *driver)
         }
         uint32_t nsid = ns_list[i];
         nvme_identify_ns_t *id_ns_data =
-            (nvme_identify_ns_t *)malloc(sizeof(nvme_identify_ns_t));
+            (nvme_identify_ns_t *)nvme_dma_alloc(sizeof(nvme_identify_ns_t));
+        if (!id_ns_data) {
+            log_err("Failed to allocate memory for NVMe namespace data");
+            break;
+        }
 
         cmd.opcode = NVME_ADMIN_CMD_IDENTIFY;
         cmd.nsid = nsid;
-        cmd.dptr[0] = (uint64_t)id_ns_data;
+        cmd.dptr[0] = (uint64_t)virt_to_phys(id_ns_data);
         cmd.cdw10 = NVME_IDENTIFY_NAMESPACE;
 
         if (nvme_submit_admin_command(&cmd)) {
@@ -228,9 +277,9 @@ static void nvme_identify_namespaces(disk_driver_t *driver)
             register_disk(driver, (void *)(uintptr_t)nsid, name,
                           id_ns_data->nsze);
         }
-        free(id_ns_data);
+        nvme_dma_free(id_ns_data, sizeof(nvme_identify_ns_t));
     }
-    free(ns_list);
+    nvme_dma_free(ns_list, 4096);
 }
 
 void nvme_init(disk_driver_t *driver)
@@ -254,7 +303,7 @@ void nvme_init(disk_driver_t *driver)
 
     size_t reg_size = 0x1000; // 4KB is standard for NVMe register sets
     controller.regs = (nvme_regs_t *)mmap_physical(
-        NULL, (void *)bar0_phys, reg_size, VMM_PRESENT | VMM_WRITE);
+        NULL, (void *)bar0_phys, reg_size, VMM_PRESENT | VMM_WRITE | VMM_UC);
 
     if (controller.regs == NULL) {
         log_err("NVMe: Failed to map controller registers to virtual memory");
@@ -282,28 +331,18 @@ void nvme_init(disk_driver_t *driver)
     size_t sq_size = controller.admin_queue_size * sizeof(nvme_cmd_t);
     size_t cq_size = controller.admin_queue_size * sizeof(nvme_cqe_t);
 
-    // NOTE: This memory MUST be physically contiguous.
-    controller.admin_sq = (nvme_cmd_t *)malloc(sq_size);
-    controller.admin_cq = (nvme_cqe_t *)malloc(cq_size);
+    controller.admin_sq = (nvme_cmd_t *)nvme_dma_alloc(sq_size);
+    controller.admin_cq = (nvme_cqe_t *)nvme_dma_alloc(cq_size);
 
     if (!controller.admin_sq || !controller.admin_cq) {
         log_err("NVMe: Failed to allocate admin queues");
-        if (controller.admin_sq) {
-            free(controller.admin_sq);
-        }
-        if (controller.admin_cq) {
-            free(controller.admin_cq);
-        }
+        nvme_dma_free(controller.admin_sq, sq_size);
+        nvme_dma_free(controller.admin_cq, cq_size);
         return;
     }
 
-    memset(controller.admin_sq, 0, sq_size);
-    memset(controller.admin_cq, 0, cq_size);
-
-    controller.regs->asq =
-        (uint64_t)controller.admin_sq; // Assumes physical == virtual
-    controller.regs->acq =
-        (uint64_t)controller.admin_cq; // Assumes physical == virtual
+    controller.regs->asq = (uint64_t)virt_to_phys(controller.admin_sq);
+    controller.regs->acq = (uint64_t)virt_to_phys(controller.admin_cq);
 
     controller.regs->aqa = ((controller.admin_queue_size - 1) << 16) |
                            (controller.admin_queue_size - 1);
@@ -329,8 +368,8 @@ void nvme_init(disk_driver_t *driver)
     // TODO: fix error here
     if (!(controller.regs->csts & CSTS_RDY)) {
         log_err("NVMe controller failed to initialise.");
-        free(controller.admin_sq);
-        free(controller.admin_cq);
+        nvme_dma_free(controller.admin_sq, sq_size);
+        nvme_dma_free(controller.admin_cq, cq_size);
         return;
     }
 
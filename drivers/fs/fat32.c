@@ -2,16 +2,22 @@
 #include <stdint.h>
 #include <ctype.h>
 
-#include <cmos.h>
 #include <debug.h>
 #include <disk.h>
 #include <fat32.h>
 #include <heap.h>
+#include <pmm.h>
 #include <string.h>
+#include <time.h>
+#include <vmm.h>
 
 #define NT_RES_LOWER_CASE_BASE 0x08
 #define NT_RES_LOWER_CASE_EXT 0x10
 
+// Largest cluster taken from a slab cache. Bigger ones would leave most of
+// even the largest slab unused, or not fit at all, so they come from the PMM
+#define FAT32_SLAB_MAX_CLUSTER (PAGE_SIZE << (KMEM_MAX_SLAB_ORDER - 2))
+
 typedef struct {
     fat32_dir_entry_t *entry;
     uint32_t cluster_lba;
@@ -28,6 +34,31 @@ typedef struct {
 
 // Forward declarations of helper functions
 static uint32_t fat32_get_cluster_lba(fat32_fs_t *fs, uint32_t cluster);
+
+static size_t fat32_cluster_bytes(fat32_fs_t *fs)
+{
+    return (size_t)fs->bytes_per_sector * fs->sectors_per_cluster;
+}
+
+// Cluster sized buffers, from the mount's cache if it has one
+static void *fat32_cluster_alloc(fat32_fs_t *fs)
+{
+    if (fs->cluster_cache) {
+        return kmem_cache_alloc(fs->cluster_cache);
+    }
+    void *phys = pmm_alloc_pages(pmm_order_for_size(fat32_cluster_bytes(fs)));
+    return phys ? phys_to_virt(phys) : NULL;
+}
+
+static void fat32_cluster_free(fat32_fs_t *fs, void *buffer)
+{
+    if (fs->cluster_cache) {
+        kmem_cache_free(fs->cluster_cache, buffer);
+    } else if (buffer) {
+        pmm_free_pages(virt_to_phys(buffer),
+                       pmm_order_for_size(fat32_cluster_bytes(fs)));
+    }
+}
 static uint32_t fat32_get_next_cluster(fat32_fs_t *fs, uint32_t current_cluster);
 static void fat32_set_next_cluster(fat32_fs_t *fs, uint32_t current_cluster,
                                    uint32_t next_cluster);
@@ -100,6 +131,28 @@ bool fat32_mount_internal(int disk_id, uint32_t lba_start, uint32_t num_sectors,
     fs->fat_start = fs->lba_start + fs->reserved_sector_count;
     fs->data_start = fs->fat_start + (fs->num_fats * fs->fat_size_32);
 
+    // Both are created here, before the mount is visible to anything else
+    fs->sector_cache =
+        kmem_cache_create("fat32_sector", fs->bytes_per_sector, 0, NULL);
+    fs->cluster_cache = NULL;
+    bool cluster_slab = fat32_cluster_bytes(fs) <= FAT32_SLAB_MAX_CLUSTER;
+    if (cluster_slab) {
+        fs->cluster_cache = kmem_cache_create(
+            "fat32_cluster", fat32_cluster_bytes(fs), 0, NULL);
+    }
+    if (!fs->sector_cache || (cluster_slab && !fs->cluster_cache)) {
+        log_err("Failed to create FAT32 buffer caches");
+        if (fs->sector_cache) {
+            kmem_cache_destroy(fs->sector_cache);
+        }
+        if (fs->cluster_cache) {
+            kmem_cache_destroy(fs->cluster_cache);
+        }
+        free(vbr_data);
+        free(fs);
+        return false;
+    }
+
     mount->fs_data = fs;
     mount->root_cluster = fs->root_cluster;
 
@@ -113,7 +166,12 @@ bool fat32_mount_internal(int disk_id, uint32_t lba_start, uint32_t num_sectors,
 bool fat32_unmount_internal(vfs_mount_t *mount)
 {
     if (mount->fs_data) {
-        free(mount->fs_data);
+        fat32_fs_t *fs = (fat32_fs_t *)mount->fs_data;
+        kmem_cache_destroy(fs->sector_cache);
+        if (fs->cluster_cache) {
+            kmem_cache_destroy(fs->cluster_cache);
+        }
+        free(fs);
         mount->fs_data = NULL;
         return true;
     }
@@ -131,19 +189,19 @@ static uint32_t fat32_get_next_cluster(fat32_fs_t *fs, uint32_t current_cluster)
     uint32_t fat_sector = fs->fat_start + (fat_offset / fs->bytes_per_sector);
     uint32_t entry_offset = fat_offset % fs->bytes_per_sector;
 
-    uint8_t *fat_sector_data = (uint8_t *)malloc(fs->bytes_per_sector);
+    uint8_t *fat_sector_data = (uint8_t *)kmem_cache_alloc(fs->sector_cache);
     if (!fat_sector_data) {
         return 0;
     }
 
     if (!disk_read(fs->disk_id, fat_sector, 1, fat_sector_data)) {
-        free(fat_sector_data);
+        kmem_cache_free(fs->sector_cache, fat_sector_data);
         return 0;
     }
 
     uint32_t next_cluster =
         *((uint32_t *)&fat_sector_data[entry_offset]) & 0x0FFFFFFF;
-    free(fat_sector_data);
+    kmem_cache_free(fs->sector_cache, fat_sector_data);
 
     return next_cluster;
 }
@@ -155,25 +213,25 @@ static void fat32_set_next_cluster(fat32_fs_t *fs, uint32_t current_cluster,
     uint32_t fat_sector = fs->fat_start + (fat_offset / fs->bytes_per_sector);
     uint32_t entry_offset = fat_offset % fs->bytes_per_sector;
 
-    uint8_t *fat_sector_data = (uint8_t *)malloc(fs->bytes_per_sector);
+    uint8_t *fat_sector_data = (uint8_t *)kmem_cache_alloc(fs->sector_cache);
     if (!fat_sector_data) {
         return;
     }
 
     if (!disk_read(fs->disk_id, fat_sector, 1, fat_sector_data)) {
-        free(fat_sector_data);
+        kmem_cache_free(fs->sector_cache, fat_sector_data);
         return;
     }
 
     *((uint32_t *)&fat_sector_data[entry_offset]) = next_cluster;
 
     disk_write(fs->disk_id, fat_sector, 1, fat_sector_data);
-    free(fat_sector_data);
+    kmem_cache_free(fs->sector_cache, fat_sector_data);
 }
 
 static uint32_t fat32_find_free_cluster(fat32_fs_t *fs)
 {
-    uint8_t *fat_sector_data = (uint8_t *)malloc(fs->bytes_per_sector);
+    uint8_t *fat_sector_data = (uint8_t *)kmem_cache_alloc(fs->sector_cache);
     if (!fat_sector_data) {
         return 0;
     }
@@ -183,7 +241,7 @@ static uint32_t fat32_find_free_cluster(fat32_fs_t *fs)
         uint32_t current_fat_lba = fs->fat_start + fat_sector_idx;
 
         if (!disk_read(fs->disk_id, current_fat_lba, 1, fat_sector_data)) {
-            free(fat_sector_data);
+            kmem_cache_free(fs->sector_cache, fat_sector_data);
             return 0;
         }
 
@@ -196,13 +254,13 @@ static uint32_t fat32_find_free_cluster(fat32_fs_t *fs)
                 if (free_cluster < 2) {
                     continue;
                 }
-                free(fat_sector_data);
+                kmem_cache_free(fs->sector_cache, fat_sector_data);
                 return free_cluster;
             }
         }
     }
 
-    free(fat_sector_data);
+    kmem_cache_free(fs->sector_cache, fat_sector_data);
     return 0;
 }
 
@@ -246,8 +304,7 @@ static bool fat32_iterate_directory(fat32_fs_t *fs, uint32_t start_cluster,
                                     dir_entry_callback_t callback,
                                     void *user_data)
 {
-    uint8_t *cluster_data =
-        (uint8_t *)malloc(fs->bytes_per_sector * fs->sectors_per_cluster);
+    uint8_t *cluster_data = (uint8_t *)fat32_cluster_alloc(fs);
     if (!cluster_data) {
         return false;
     }
@@ -257,7 +314,7 @@ static bool fat32_iterate_directory(fat32_fs_t *fs, uint32_t start_cluster,
         uint32_t cluster_lba = fat32_get_cluster_lba(fs, current_cluster);
         if (!disk_read(fs->disk_id, cluster_lba, fs->sectors_per_cluster,
                        cluster_data)) {
-            free(cluster_data);
+            fat32_cluster_free(fs, cluster_data);
             return false;
         }
 
@@ -268,12 +325,12 @@ static bool fat32_iterate_directory(fat32_fs_t *fs, uint32_t start_cluster,
              i++) {
             if (entry[i].filename[0] == 0x00) { // end of directory
                 bool ret = callback(&entry[i], cluster_lba, i, user_data);
-                free(cluster_data);
+                fat32_cluster_free(fs, cluster_data);
                 return ret;
             }
 
             if (callback(&entry[i], cluster_lba, i, user_data)) {
-                free(cluster_data);
+                fat32_cluster_free(fs, cluster_data);
                 return true;
             }
         }
@@ -281,7 +338,7 @@ static bool fat32_iterate_directory(fat32_fs_t *fs, uint32_t start_cluster,
         current_cluster = fat32_get_next_cluster(fs, current_cluster);
     }
 
-    free(cluster_data);
+    fat32_cluster_free(fs, cluster_data);
     return false;
 }
 
@@ -595,8 +652,7 @@ bool fat32_write_file_internal(vfs_mount_t *mount, uint32_t parent_cluster,
     memcpy(new_entry.filename, name_8_3, 8);
     memcpy(new_entry.ext, name_8_3 + 8, 3);
 
-    datetime_t datetime;
-    cmos_get_datetime(&datetime);
+    datetime_t datetime = get_datetime();
 
     if (base_is_lower)
         new_entry.nt_res |= NT_RES_LOWER_CASE_BASE;
@@ -643,25 +699,25 @@ bool fat32_write_file_internal(vfs_mount_t *mount, uint32_t parent_cluster,
         if (data_offset + bytes_to_write > size)
             bytes_to_write = size - data_offset;
 
-        uint8_t *write_buffer = (uint8_t *)malloc(fs->bytes_per_sector * fs->sectors_per_cluster);
+        uint8_t *write_buffer = (uint8_t *)fat32_cluster_alloc(fs);
         if (!write_buffer)
             return false;
         memset(write_buffer, 0, fs->bytes_per_sector * fs->sectors_per_cluster);
         memcpy(write_buffer, data + data_offset, bytes_to_write);
 
         disk_write(fs->disk_id, cluster_lba, fs->sectors_per_cluster, write_buffer);
-        free(write_buffer);
+        fat32_cluster_free(fs, write_buffer);
         data_offset += bytes_to_write;
         current_data_cluster = fat32_get_next_cluster(fs, current_data_cluster);
     }
 
-    uint8_t *sector_buffer = (uint8_t *)malloc(fs->bytes_per_sector);
+    uint8_t *sector_buffer = (uint8_t *)kmem_cache_alloc(fs->sector_cache);
     if (!sector_buffer)
         return false;
     disk_read(fs->disk_id, entry_lba, 1, sector_buffer);
     memcpy(sector_buffer + entry_idx_in_sector, &new_entry, sizeof(fat32_dir_entry_t));
     disk_write(fs->disk_id, entry_lba, 1, sector_buffer);
-    free(sector_buffer);
+    kmem_cache_free(fs->sector_cache, sector_buffer);
 
     return true;
 }
@@ -683,7 +739,7 @@ bool fat32_delete_file_internal(vfs_mount_t *mount, uint32_t cluster,
 
     entry_to_delete->filename[0] = 0xE5;
 
-    uint8_t *sector_buffer = (uint8_t *)malloc(fs->bytes_per_sector);
+    uint8_t *sector_buffer = (uint8_t *)kmem_cache_alloc(fs->sector_cache);
     if (!sector_buffer)
         return false;
     disk_read(fs->disk_id, entry_lba, 1, sector_buffer);
@@ -691,7 +747,7 @@ bool fat32_delete_file_internal(vfs_mount_t *mount, uint32_t cluster,
                                fs->bytes_per_sector,
            entry_to_delete, sizeof(fat32_dir_entry_t));
     disk_write(fs->disk_id, entry_lba, 1, sector_buffer);
-    free(sector_buffer);
+    kmem_cache_free(fs->sector_cache, sector_buffer);
 
     uint32_t cluster_to_free = (entry_to_delete->first_cluster_high << 16) |
                                entry_to_delete->first_cluster_low;
@@ -725,7 +781,7 @@ uint8_t *fat32_read_file_internal(vfs_mount_t *mount, uint32_t cluster,
     uint32_t current_cluster = (file_entry->first_cluster_high << 16) |
                                file_entry->first_cluster_low;
     uint32_t bytes_read = 0;
-    uint8_t *buffer = (uint8_t *)malloc(fs->bytes_per_sector * fs->sectors_per_cluster);
+    uint8_t *buffer = (uint8_t *)fat32_cluster_alloc(fs);
 
     while (bytes_read < *size) {
         uint32_t cluster_lba = fat32_get_cluster_lba(fs, current_cluster);
@@ -739,7 +795,7 @@ uint8_t *fat32_read_file_internal(vfs_mount_t *mount, uint32_t cluster,
         current_cluster = fat32_get_next_cluster(fs, current_cluster);
     }
     file_content[*size] = '\0';
-    free(buffer);
+    fat32_cluster_free(fs, buffer);
     free(file_entry);
     return file_content;
 }
@@ -771,8 +827,7 @@ bool fat32_create_directory_internal(vfs_mount_t *mount, uint32_t cluster,
     memcpy(new_entry.filename, name_8_3, 8);
     memcpy(new_entry.ext, name_8_3 + 8, 3);
 
-    datetime_t dt;
-    cmos_get_datetime(&dt);
+    datetime_t dt = get_datetime();
     if (lower)
         new_entry.nt_res |= NT_RES_LOWER_CASE_BASE;
     new_entry.attributes = FAT32_ATTRIBUTE_DIRECTORY;
@@ -783,14 +838,14 @@ bool fat32_create_directory_internal(vfs_mount_t *mount, uint32_t cluster,
     new_entry.first_cluster_low = (uint16_t)(new_cluster & 0xFFFF);
     new_entry.first_cluster_high = (uint16_t)((new_cluster >> 16) & 0xFFFF);
 
-    uint8_t *sector = (uint8_t *)malloc(fs->bytes_per_sector);
+    uint8_t *sector = (uint8_t *)kmem_cache_alloc(fs->sector_cache);
     uint32_t lba = find_data.cluster_lba + (find_data.entry_idx * sizeof(fat32_dir_entry_t)) / fs->bytes_per_sector;
     disk_read(fs->disk_id, lba, 1, sector);
     memcpy(sector + (find_data.entry_idx * sizeof(fat32_dir_entry_t)) % fs->bytes_per_sector, &new_entry, sizeof(fat32_dir_entry_t));
     disk_write(fs->disk_id, lba, 1, sector);
-    free(sector);
+    kmem_cache_free(fs->sector_cache, sector);
 
-    uint8_t *dir_data = (uint8_t *)malloc(fs->bytes_per_sector * fs->sectors_per_cluster);
+    uint8_t *dir_data = (uint8_t *)fat32_cluster_alloc(fs);
     memset(dir_data, 0, fs->bytes_per_sector * fs->sectors_per_cluster);
     fat32_dir_entry_t *dot = (fat32_dir_entry_t *)dir_data;
     fat32_dir_entry_t *dotdot = (fat32_dir_entry_t *)(dir_data + sizeof(fat32_dir_entry_t));
@@ -807,7 +862,7 @@ bool fat32_create_directory_internal(vfs_mount_t *mount, uint32_t cluster,
     dotdot->first_cluster_high = (uint16_t)((parent >> 16) & 0xFFFF);
 
     disk_write(fs->disk_id, fat32_get_cluster_lba(fs, new_cluster), fs->sectors_per_cluster, dir_data);
-    free(dir_data);
+    fat32_cluster_free(fs, dir_data);
 
     return true;
 }
@@ -842,11 +897,11 @@ bool fat32_delete_directory_internal(vfs_mount_t *mount, uint32_t cluster,
 
     entry->filename[0] = 0xE5;
     uint32_t lba = find_data.cluster_lba + (find_data.entry_idx * sizeof(fat32_dir_entry_t)) / fs->bytes_per_sector;
-    uint8_t *sector = (uint8_t *)malloc(fs->bytes_per_sector);
+    uint8_t *sector = (uint8_t *)kmem_cache_alloc(fs->sector_cache);
     disk_read(fs->disk_id, lba, 1, sector);
     memcpy(sector + (find_data.entry_idx * sizeof(fat32_dir_entry_t)) % fs->bytes_per_sector, entry, sizeof(fat32_dir_entry_t));
     disk_write(fs->disk_id, lba, 1, sector);
-    free(sector);
+    kmem_cache_free(fs->sector_cache, sector);
 
     uint32_t to_free = dir_cluster;
     while (to_free >= 2 && (to_free & 0x0FFFFFFF) < 0x0FFFFF8) {
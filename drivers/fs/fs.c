@@ -2,7 +2,7 @@
 #include <disk.h>
 #include <fat32.h>
 #include <fs.h>
-#include <heap.h>
+#include <slab.h>
 #include <string.h>
 
 #define MAX_DRIVERS 10
@@ -10,6 +10,7 @@
 static fs_driver_t *drivers[MAX_DRIVERS];
 static int driver_count = 0;
 static vfs_mount_t *current_mount = NULL;
+static kmem_cache_t *mount_cache;
 
 void fs_register_driver(fs_driver_t *driver)
 {
@@ -32,7 +33,7 @@ bool vfs_mount(int disk_id, uint32_t lba_start, uint32_t num_sectors)
     }
 
     for (int i = 0; i < driver_count; i++) {
-        vfs_mount_t *mount = (vfs_mount_t *)malloc(sizeof(vfs_mount_t));
+        vfs_mount_t *mount = (vfs_mount_t *)kmem_cache_alloc(mount_cache);
         memset(mount, 0, sizeof(vfs_mount_t));
         mount->driver = drivers[i];
         mount->disk_id = disk_id;
@@ -45,7 +46,7 @@ bool vfs_mount(int disk_id, uint32_t lba_start, uint32_t num_sectors)
                      drivers[i]->name, disk_id, lba_start);
             return true;
         }
-        free(mount);
+        kmem_cache_free(mount_cache, mount);
     }
 
     return false;
@@ -58,7 +59,7 @@ bool vfs_unmount()
     }
 
     if (current_mount->driver->unmount(current_mount)) {
-        free(current_mount);
+        kmem_cache_free(mount_cache, current_mount);
         current_mount = NULL;
         return true;
     }
@@ -68,6 +69,7 @@ bool vfs_unmount()
 
 void fs_init()
 {
+    mount_cache = kmem_cache_create("vfs_mount", sizeof(vfs_mount_t), 0, NULL);
     disk_init();
     fat32_init();
 }
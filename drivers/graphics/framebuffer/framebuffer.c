@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <timer.h>
+#include <vmm.h>
 
 #define DEFAULT_TITLE_HEIGHT 3
 #define OPTIMISE_FB false
@@ -82,6 +83,23 @@ void fb_init()
     printf("\n");
 }
 
+void fb_enable_wc()
+{
+    // Change the existing HHDM mapping in place rather than adding a second
+    // mapping, since aliases with different memory types are not allowed
+    size_t size = fb->pitch * fb->height;
+    uintptr_t start = (uintptr_t)fb->address & ~(PAGE_SIZE - 1);
+    size_t num_pages =
+        ((uintptr_t)fb->address + size - start + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    if (!vmm_protect_range((void *)start, num_pages,
+                           VMM_PRESENT | VMM_WRITE | VMM_WC)) {
+        log_warn("Failed to map the framebuffer write-combining");
+        return;
+    }
+    log_verbose("Framebuffer mapped write-combining (%d pages)", num_pages);
+}
+
 struct limine_framebuffer *get_fb_data()
 {
     return fb;
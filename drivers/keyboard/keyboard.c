@@ -7,12 +7,15 @@
 #include <interrupts.h>
 #include <io.h>
 #include <keyboard.h>
+#include <lock.h>
 #include <panic.h>
 #include <pit.h>
 #include <power.h>
+#include <softirq.h>
 #include <stdio.h>
 #include <timer.h>
 #include <tty.h>
+#include <workqueue.h>
 
 static volatile char last_char = 0;
 static volatile char last_scancode = 0;
@@ -22,9 +25,31 @@ bool keyboard_logging_enabled;
 
 key_t last_key = {0, 0};
 
+// Setting the LEDs waits on the controller, too slow for the IRQ handler
+static work_t led_work;
+
+// Scancodes read by the IRQ handler, waiting for the input softirq
+#define SCANCODE_RING_SIZE 64
+static uint8_t scancode_ring[SCANCODE_RING_SIZE];
+static uint32_t scancode_head = 0;
+static uint32_t scancode_tail = 0;
+// Set while a CPU is draining the ring, under scancode_lock
+static bool scancode_draining = false;
+static spinlock_t scancode_lock = {0, "kbd_scancodes"};
+
+static void keyboard_softirq();
+
+static void led_work_func(void *arg)
+{
+    (void)arg;
+    kbd_update_leds();
+}
+
 void kbd_init()
 {
     kbd_buffer_init();
+    work_init(&led_work, led_work_func, NULL);
+    softirq_register(SOFTIRQ_INPUT, keyboard_softirq);
     keyboard_logging_enabled = KBD_LOG_DEFAULT;
     log_verbose("Keyboard logging is %s",
                 keyboard_logging_enabled ? "enabled" : "disabled");
@@ -105,10 +130,9 @@ void wait_for_kbd()
     }
 }
 
-uint64_t keyboard_handler(uint64_t rsp)
+// Bottom half: modifier tracking, TTY input and the debug keys
+static void kbd_process_scancode(uint8_t key)
 {
-    uint8_t key = get_key();
-
     if (key & 0x80) {
         // key release
         key -= 0x80; // convert to press scancode
@@ -129,7 +153,7 @@ uint64_t keyboard_handler(uint64_t rsp)
         switch (key) {
         case KEY_CAPSLOCK:
             kbd_modifiers.caps_lock = !kbd_modifiers.caps_lock;
-            kbd_update_leds();
+            queue_work(&system_wq, &led_work);
             break;
         case KEY_SHIFT_LEFT:
         case KEY_SHIFT_RIGHT:
@@ -194,7 +218,47 @@ uint64_t keyboard_handler(uint64_t rsp)
             break;
         }
     }
+}
+
+static void keyboard_softirq()
+{
+    // If the IRQ moves, ksoftirqd on two CPUs could drain at once and process
+    // scancodes out of order. Only one drains, and it also takes whatever
+    // arrives meanwhile, as the ring is only given up once it is empty
+    uint64_t flags = spinlock_acquire_irqsave(&scancode_lock);
+    if (scancode_draining) {
+        spinlock_release_irqrestore(&scancode_lock, flags);
+        return;
+    }
+    scancode_draining = true;
+
+    while (scancode_head != scancode_tail) {
+        uint8_t key = scancode_ring[scancode_tail % SCANCODE_RING_SIZE];
+        scancode_tail++;
+        spinlock_release_irqrestore(&scancode_lock, flags);
+
+        kbd_process_scancode(key);
+        flags = spinlock_acquire_irqsave(&scancode_lock);
+    }
+
+    scancode_draining = false;
+    spinlock_release_irqrestore(&scancode_lock, flags);
+}
+
+uint64_t keyboard_handler(uint64_t rsp)
+{
+    // Reading the scancode acknowledges the controller, the rest waits for
+    // the softirq
+    uint8_t key = get_key();
+
+    spinlock_acquire(&scancode_lock);
+    if (scancode_head - scancode_tail < SCANCODE_RING_SIZE) {
+        scancode_ring[scancode_head % SCANCODE_RING_SIZE] = key;
+        scancode_head++;
+    }
+    spinlock_release(&scancode_lock);
 
+    softirq_raise(SOFTIRQ_INPUT);
     return rsp;
 }
 
@@ -0,0 +1,143 @@
+#include <anon.h>
+#include <debug.h>
+#include <lock.h>
+#include <pmm.h>
+#include <vmm.h>
+
+// Page fault error code: set when the page was present (a protection fault)
+#define PF_PRESENT (1 << 0)
+
+static anon_region_t regions[ANON_MAX_REGIONS];
+static spinlock_t anon_lock = {0, "anon"};
+
+static anon_region_t *region_alloc(uintptr_t start, size_t size,
+                                   uint32_t flags, bool owns_range)
+{
+    uint64_t irq_flags = spinlock_acquire_irqsave(&anon_lock);
+    for (int i = 0; i < ANON_MAX_REGIONS; i++) {
+        if (!regions[i].active) {
+            anon_region_t *region = &regions[i];
+            region->active = true;
+            region->start = start;
+            region->end = start + size;
+            region->flags = flags;
+            region->owns_range = owns_range;
+            spinlock_release_irqrestore(&anon_lock, irq_flags);
+            return region;
+        }
+    }
+    spinlock_release_irqrestore(&anon_lock, irq_flags);
+
+    log_err("anon: Region table full");
+    return NULL;
+}
+
+anon_region_t *anon_create(size_t size, uint32_t flags)
+{
+    size_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    void *virt = vmm_alloc_range(num_pages);
+    if (!virt) {
+        log_err("anon: No address space for %lu pages", num_pages);
+        return NULL;
+    }
+
+    anon_region_t *region =
+        region_alloc((uintptr_t)virt, num_pages * PAGE_SIZE, flags, true);
+    if (!region) {
+        vmm_free_range(virt, num_pages);
+    }
+    return region;
+}
+
+anon_region_t *anon_create_at(void *virt_addr, size_t size, uint32_t flags)
+{
+    uintptr_t start = (uintptr_t)virt_addr & ~(PAGE_SIZE - 1);
+    size_t num_pages =
+        ((uintptr_t)virt_addr + size - start + PAGE_SIZE - 1) / PAGE_SIZE;
+    return region_alloc(start, num_pages * PAGE_SIZE, flags, false);
+}
+
+void anon_destroy(anon_region_t *region)
+{
+    size_t num_pages = (region->end - region->start) / PAGE_SIZE;
+
+    // The unmap waits for TLB shootdowns, so it can't run under anon_lock
+    vmm_release_range((void *)region->start, num_pages);
+
+    uint64_t irq_flags = spinlock_acquire_irqsave(&anon_lock);
+    region->active = false;
+    spinlock_release_irqrestore(&anon_lock, irq_flags);
+
+    if (region->owns_range) {
+        vmm_free_range((void *)region->start, num_pages);
+    }
+}
+
+void anon_discard(anon_region_t *region, void *addr, size_t size)
+{
+    uintptr_t start = ((uintptr_t)addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)addr + size) & ~(PAGE_SIZE - 1);
+    if (start < region->start) {
+        start = region->start;
+    }
+    if (end > region->end) {
+        end = region->end;
+    }
+    if (start >= end) {
+        return;
+    }
+
+    vmm_release_range((void *)start, (end - start) / PAGE_SIZE);
+}
+
+bool anon_contains(anon_region_t *region, void *addr)
+{
+    return (uintptr_t)addr >= region->start && (uintptr_t)addr < region->end;
+}
+
+bool anon_handle_fault(uintptr_t addr, uint64_t error_code)
+{
+    if (error_code & PF_PRESENT) {
+        return false;
+    }
+
+    uint64_t irq_flags = spinlock_acquire_irqsave(&anon_lock);
+
+    anon_region_t *region = NULL;
+    for (int i = 0; i < ANON_MAX_REGIONS; i++) {
+        if (regions[i].active && addr >= regions[i].start &&
+            addr < regions[i].end) {
+            region = &regions[i];
+            break;
+        }
+    }
+
+    if (!region) {
+        spinlock_release_irqrestore(&anon_lock, irq_flags);
+        return false;
+    }
+
+    uintptr_t page = addr & ~(PAGE_SIZE - 1);
+
+    // Another CPU may have faulted the same page in already
+    if (vmm_get_phys((void *)page)) {
+        spinlock_release_irqrestore(&anon_lock, irq_flags);
+        return true;
+    }
+
+    void *phys = pmm_alloc_zeroed_page();
+    if (!phys) {
+        spinlock_release_irqrestore(&anon_lock, irq_flags);
+        log_err("anon: Out of memory committing 0x%lx", page);
+        return false;
+    }
+
+    if (!vmm_map_range((void *)page, phys, 1, region->flags)) {
+        pmm_free_page(phys);
+        spinlock_release_irqrestore(&anon_lock, irq_flags);
+        return false;
+    }
+
+    spinlock_release_irqrestore(&anon_lock, irq_flags);
+    return true;
+}
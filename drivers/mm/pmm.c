@@ -1,30 +1,196 @@
 #include <debug.h>
 #include <limine.h>
+#include <lock.h>
 #include <panic.h>
 #include <pmm.h>
+#include <scheduler.h>
 #include <stdbool.h>
 #include <string.h>
+#include <waitqueue.h>
 
 #define PAGE_SIZE 4096
 
-static uint8_t *bitmap;
+// Pages the zeroing thread clears per turn before yielding the CPU again
+#define ZERO_BATCH 8
+
+// The zeroing thread sleeps once the pool is full, and is woken again when
+// it drops below this
+#define ZERO_LOW_WATER (PMM_ZERO_POOL_SIZE / 4)
+
+// Below this many free frames the last pages are left for real allocations
+#define ZERO_MIN_FREE (PMM_ZERO_POOL_SIZE * 4)
+
+// Marks a frame that is not the head of a free buddy block
+#define ORDER_NONE 0xFF
+
+// Free blocks are linked through their own first bytes via the HHDM
+typedef struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+// One bit per frame (set = allocated), plus a summary level with one bit per
+// bitmap word that is set while that word still has a free frame in it
+static uint64_t *bitmap;
+static uint64_t *summary;
+static uint64_t bitmap_words;
+static uint8_t *block_order;
 static uint64_t total_pages;
 static uint64_t free_pages;
-static uint64_t last_index = 0;
+static uint64_t hhdm_offset;
+
+static free_block_t *free_lists[PMM_MAX_ORDER + 1];
+static uint64_t free_counts[PMM_MAX_ORDER + 1];
+static spinlock_t pmm_lock = {0, "pmm"};
+
+// Frames that have already been cleared, ready for pmm_alloc_zeroed_page().
+// The frames can't hold a free list themselves without being dirtied, so
+// they are kept on a fixed stack of physical addresses.
+static uint64_t zero_pool[PMM_ZERO_POOL_SIZE];
+static uint64_t zero_pool_count;
+static spinlock_t zero_pool_lock = {0, "pmm_zero_pool"};
+// Where the zeroing thread waits while it has nothing to do
+static waitqueue_t zero_wq = {NULL, NULL, {0, "pmm_zero_wait"}};
+
+static void summary_update(uint64_t word)
+{
+    if (bitmap[word] == ~0ULL) {
+        summary[word / 64] &= ~(1ULL << (word % 64));
+    } else {
+        summary[word / 64] |= 1ULL << (word % 64);
+    }
+}
+
+// Mask of the bits [start, start + count) within a single word
+static uint64_t word_mask(uint64_t start, uint64_t count)
+{
+    uint64_t bit = start % 64;
+    if (count >= 64) {
+        return ~0ULL << bit;
+    }
+    return ((1ULL << count) - 1) << bit;
+}
+
+static void bitmap_set_range(uint64_t start, uint64_t count)
+{
+    while (count > 0) {
+        uint64_t chunk = 64 - start % 64;
+        if (chunk > count) {
+            chunk = count;
+        }
+        bitmap[start / 64] |= word_mask(start, chunk);
+        summary_update(start / 64);
+        start += chunk;
+        count -= chunk;
+    }
+}
+
+static void bitmap_clear_range(uint64_t start, uint64_t count)
+{
+    while (count > 0) {
+        uint64_t chunk = 64 - start % 64;
+        if (chunk > count) {
+            chunk = count;
+        }
+        bitmap[start / 64] &= ~word_mask(start, chunk);
+        summary_update(start / 64);
+        start += chunk;
+        count -= chunk;
+    }
+}
+
+// Returns the index of the first free frame in [start, start + count), or
+// UINT64_MAX if every frame in the range is allocated
+static uint64_t bitmap_find_clear(uint64_t start, uint64_t count)
+{
+    while (count > 0) {
+        uint64_t chunk = 64 - start % 64;
+        if (chunk > count) {
+            chunk = count;
+        }
+        uint64_t free_bits = ~bitmap[start / 64] & word_mask(start, chunk);
+        if (free_bits) {
+            return (start & ~63ULL) + __builtin_ctzll(free_bits);
+        }
+        start += chunk;
+        count -= chunk;
+    }
+    return UINT64_MAX;
+}
 
-static void bitmap_set(uint64_t index)
+static free_block_t *index_to_block(uint64_t index)
 {
-    bitmap[index / 8] |= (1 << (index % 8));
+    return (free_block_t *)(index * PAGE_SIZE + hhdm_offset);
 }
 
-static void bitmap_clear(uint64_t index)
+static uint64_t block_to_index(free_block_t *block)
 {
-    bitmap[index / 8] &= ~(1 << (index % 8));
+    return ((uint64_t)block - hhdm_offset) / PAGE_SIZE;
 }
 
-static bool bitmap_test(uint64_t index)
+static void free_list_push(uint64_t index, uint8_t order)
 {
-    return (bitmap[index / 8] >> (index % 8)) & 1;
+    free_block_t *block = index_to_block(index);
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (free_lists[order]) {
+        free_lists[order]->prev = block;
+    }
+    free_lists[order] = block;
+    free_counts[order]++;
+    block_order[index] = order;
+}
+
+static void free_list_remove(uint64_t index, uint8_t order)
+{
+    free_block_t *block = index_to_block(index);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    free_counts[order]--;
+    block_order[index] = ORDER_NONE;
+}
+
+/**
+ * @brief Returns a block to the free lists, merging it with its buddy for as
+ * long as the buddy is also free and of the same order.
+ */
+static void buddy_release(uint64_t index, uint8_t order)
+{
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = index ^ (1ULL << order);
+        if (buddy >= total_pages || block_order[buddy] != order) {
+            break;
+        }
+        free_list_remove(buddy, order);
+        index &= ~(1ULL << order);
+        order++;
+    }
+    free_list_push(index, order);
+}
+
+/**
+ * @brief Adds the frames [start, end) to the allocator as the largest
+ * naturally aligned blocks that fit.
+ */
+static void release_range(uint64_t start, uint64_t end)
+{
+    while (start < end) {
+        uint8_t order = PMM_MAX_ORDER;
+        while (order > 0 && ((start & ((1ULL << order) - 1)) != 0 ||
+                             start + (1ULL << order) > end)) {
+            order--;
+        }
+        bitmap_clear_range(start, 1ULL << order);
+        free_pages += 1ULL << order;
+        buddy_release(start, order);
+        start += 1ULL << order;
+    }
 }
 
 void pmm_init()
@@ -38,10 +204,14 @@ void pmm_init()
     if (hhdm == NULL) {
         panic("PMM: Limine HHDM response is NULL");
     }
+    hhdm_offset = hhdm->offset;
 
     uint64_t highest_address = 0;
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE) {
+            continue;
+        }
         uint64_t top = entry->base + entry->length;
         if (top > highest_address) {
             highest_address = top;
@@ -49,73 +219,339 @@ void pmm_init()
     }
 
     total_pages = highest_address / PAGE_SIZE;
-    uint64_t bitmap_size = (total_pages + 7) / 8;
+    bitmap_words = (total_pages + 63) / 64;
+    uint64_t summary_words = (bitmap_words + 63) / 64;
+    uint64_t bitmap_size = bitmap_words * sizeof(uint64_t);
+    uint64_t summary_size = summary_words * sizeof(uint64_t);
+    uint64_t meta_size = bitmap_size + summary_size + total_pages;
+    uint64_t meta_pages = (meta_size + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    // Find a place for the bitmap
+    // Find a place for the bitmap and the per-frame order table
+    uint64_t meta_phys = 0;
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= bitmap_size) {
-            bitmap = (uint8_t *)(entry->base + hhdm->offset);
-            // Mark all as used initially
-            memset(bitmap, 0xFF, bitmap_size);
+        if (entry->type == LIMINE_MEMMAP_USABLE && entry->base != 0 &&
+            entry->length >= meta_pages * PAGE_SIZE) {
+            meta_phys = entry->base;
             break;
         }
     }
 
-    if (bitmap == NULL) {
+    if (meta_phys == 0) {
         panic("PMM: Could not find a suitable location for the bitmap");
     }
 
-    // Mark usable regions as free
+    bitmap = (uint64_t *)(meta_phys + hhdm_offset);
+    summary = (uint64_t *)((uint8_t *)bitmap + bitmap_size);
+    block_order = (uint8_t *)summary + summary_size;
+
+    // Mark all as used initially, including the padding bits past the end
+    memset(bitmap, 0xFF, bitmap_size);
+    memset(summary, 0, summary_size);
+    memset(block_order, ORDER_NONE, total_pages);
+
+    // Hand usable regions to the buddy allocator, skipping the metadata pages
+    // and the first page so 0 is never returned as a valid address
     free_pages = 0;
+    uint64_t meta_start = meta_phys / PAGE_SIZE;
+    uint64_t meta_end = meta_start + meta_pages;
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry *entry = memmap->entries[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            for (uint64_t j = 0; j < entry->length; j += PAGE_SIZE) {
-                bitmap_clear((entry->base + j) / PAGE_SIZE);
-                free_pages++;
-            }
+        if (entry->type != LIMINE_MEMMAP_USABLE) {
+            continue;
         }
-    }
 
-    // Mark bitmap pages as used
-    uint64_t bitmap_phys = (uint64_t)bitmap - hhdm->offset;
-    for (uint64_t i = 0; i < (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE; i++) {
-        bitmap_set(bitmap_phys / PAGE_SIZE + i);
-        free_pages--;
-    }
+        uint64_t start = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t end = (entry->base + entry->length) / PAGE_SIZE;
+        if (start == 0) {
+            start = 1;
+        }
 
-    // Also mark first page as used to avoid returning 0 as a valid address
-    if (!bitmap_test(0)) {
-        bitmap_set(0);
-        free_pages--;
+        if (meta_start >= start && meta_start < end) {
+            release_range(start, meta_start);
+            release_range(meta_end, end);
+        } else {
+            release_range(start, end);
+        }
     }
 
     log_info("PMM: Initialized with %d MB total, %d free pages",
              highest_address / 1024 / 1024, free_pages);
 }
 
+uint8_t pmm_order_for_size(size_t size)
+{
+    uint8_t order = 0;
+    while (((size_t)PAGE_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+void *pmm_alloc_pages(uint8_t order)
+{
+    if (order > PMM_MAX_ORDER) {
+        log_err("PMM: Allocation order %d exceeds maximum of %d", order,
+                PMM_MAX_ORDER);
+        return NULL;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&pmm_lock);
+
+    uint8_t current = order;
+    while (current <= PMM_MAX_ORDER && free_lists[current] == NULL) {
+        current++;
+    }
+
+    if (current > PMM_MAX_ORDER) {
+        spinlock_release_irqrestore(&pmm_lock, flags);
+        log_warn("PMM: Out of memory! (order %d)", order);
+        return NULL;
+    }
+
+    uint64_t index = block_to_index(free_lists[current]);
+    free_list_remove(index, current);
+
+    // Split the block, returning the upper halves to the smaller lists
+    while (current > order) {
+        current--;
+        free_list_push(index + (1ULL << current), current);
+    }
+
+    bitmap_set_range(index, 1ULL << order);
+    free_pages -= 1ULL << order;
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
+    return (void *)(index * PAGE_SIZE);
+}
+
+void pmm_free_pages(void *page_addr, uint8_t order)
+{
+    uint64_t index = (uint64_t)page_addr / PAGE_SIZE;
+    if (order > PMM_MAX_ORDER || index + (1ULL << order) > total_pages ||
+        (index & ((1ULL << order) - 1)) != 0) {
+        log_err("PMM: Invalid free of 0x%lx (order %d)", page_addr, order);
+        return;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&pmm_lock);
+
+    uint64_t already_free = bitmap_find_clear(index, 1ULL << order);
+    if (already_free != UINT64_MAX) {
+        spinlock_release_irqrestore(&pmm_lock, flags);
+        log_err("PMM: Double free of page 0x%lx", already_free * PAGE_SIZE);
+        return;
+    }
+
+    bitmap_clear_range(index, 1ULL << order);
+    free_pages += 1ULL << order;
+    buddy_release(index, order);
+
+    spinlock_release_irqrestore(&pmm_lock, flags);
+}
+
+static void *zero_pool_pop()
+{
+    uint64_t flags = spinlock_acquire_irqsave(&zero_pool_lock);
+    void *page = NULL;
+    if (zero_pool_count > 0) {
+        page = (void *)zero_pool[--zero_pool_count];
+    }
+    bool low = zero_pool_count < ZERO_LOW_WATER;
+    spinlock_release_irqrestore(&zero_pool_lock, flags);
+
+    if (low) {
+        waitqueue_wake_one(&zero_wq);
+    }
+    return page;
+}
+
+// Whether the zeroing thread has pool space to fill and memory to fill it
+static bool zero_pool_wants_refill(uint64_t threshold)
+{
+    return zero_pool_count < threshold && free_pages > ZERO_MIN_FREE;
+}
+
 void *pmm_alloc_page()
 {
-    for (uint64_t i = 0; i < total_pages; i++) {
-        uint64_t index = (last_index + i) % total_pages;
-        if (!bitmap_test(index)) {
-            bitmap_set(index);
-            last_index = index;
-            free_pages--;
-            return (void *)(index * PAGE_SIZE);
+    void *page = pmm_alloc_pages(0);
+    if (!page) {
+        // Zeroed frames are still free memory, just prepared in advance
+        page = zero_pool_pop();
+    }
+    return page;
+}
+
+void *pmm_alloc_zeroed_page()
+{
+    void *page = zero_pool_pop();
+    if (page) {
+        return page;
+    }
+
+    page = pmm_alloc_pages(0);
+    if (page) {
+        memset((void *)((uint64_t)page + hhdm_offset), 0, PAGE_SIZE);
+    }
+    return page;
+}
+
+/**
+ * @brief Clears a frame with non-temporal stores, so zeroing the pool doesn't
+ * evict the working set of whatever runs next. Needs an sfence before the
+ * frame is handed out.
+ */
+static void zero_page_nt(void *phys)
+{
+    uint64_t *words = (uint64_t *)((uint64_t)phys + hhdm_offset);
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+        __asm__ volatile("movnti %1, 0(%0)\n"
+                         "movnti %1, 8(%0)\n"
+                         "movnti %1, 16(%0)\n"
+                         "movnti %1, 24(%0)\n"
+                         :
+                         : "r"(words + i), "r"(0ULL)
+                         : "memory");
+    }
+}
+
+/**
+ * @brief Tops the zero pool up a batch at a time, yielding in between so it
+ * only really runs when nothing else wants the CPU. Once the pool is full,
+ * or memory is short, it sleeps until an allocation takes the pool below
+ * ZERO_LOW_WATER.
+ */
+static void zero_thread(void *arg)
+{
+    (void)arg;
+
+    while (true) {
+        void *batch[ZERO_BATCH];
+        int count = 0;
+
+        // Leave the last pages for real allocations rather than the pool
+        while (count < ZERO_BATCH &&
+               zero_pool_wants_refill(PMM_ZERO_POOL_SIZE - count)) {
+            void *page = pmm_alloc_pages(0);
+            if (!page) {
+                break;
+            }
+            zero_page_nt(page);
+            batch[count++] = page;
+        }
+
+        if (count > 0) {
+            __asm__ volatile("sfence" ::: "memory");
+
+            uint64_t flags = spinlock_acquire_irqsave(&zero_pool_lock);
+            int i = 0;
+            while (i < count && zero_pool_count < PMM_ZERO_POOL_SIZE) {
+                zero_pool[zero_pool_count++] = (uint64_t)batch[i++];
+            }
+            spinlock_release_irqrestore(&zero_pool_lock, flags);
+
+            // Only possible if the pool filled up some other way meanwhile
+            while (i < count) {
+                pmm_free_pages(batch[i++], 0);
+            }
+            scheduler_yield();
+            continue;
+        }
+
+        // Checked under the queue's lock, so a wakeup from zero_pool_pop()
+        // can't slip in before the thread is queued
+        uint64_t flags = spinlock_acquire_irqsave(&zero_wq.lock);
+        if (zero_pool_wants_refill(ZERO_LOW_WATER)) {
+            spinlock_release_irqrestore(&zero_wq.lock, flags);
+            continue;
         }
+        waitqueue_sleep_locked(&zero_wq, flags);
     }
+}
 
-    log_warn("PMM: Out of memory!");
-    return NULL;
+void pmm_zero_thread_start()
+{
+    // Pinned, so stealing doesn't drag it around to whichever CPU is idle
+    thread_t *thread = thread_create_on_cpu(zero_thread, NULL, 0);
+    if (!thread) {
+        log_err("PMM: Failed to start the page zeroing thread");
+        return;
+    }
+
+    // Zeroing is only ever worth doing when nothing else wants the CPU
+    thread_set_priority(thread->id, SCHED_PRIORITY_LOWEST);
 }
 
 void pmm_free_page(void *page_addr)
 {
-    uint64_t index = (uint64_t)page_addr / PAGE_SIZE;
-    if (bitmap_test(index)) {
-        bitmap_clear(index);
-        free_pages++;
+    pmm_free_pages(page_addr, 0);
+}
+
+/**
+ * @brief Finds the longest run of free frames, skipping fully allocated
+ * stretches of the bitmap through the summary level.
+ */
+static uint64_t largest_free_run()
+{
+    uint64_t best = 0;
+    uint64_t run = 0;
+
+    for (uint64_t word = 0; word < bitmap_words;) {
+        if (word % 64 == 0 && summary[word / 64] == 0) {
+            // 64 words (4096 frames) with nothing free in them
+            if (run > best) {
+                best = run;
+            }
+            run = 0;
+            word += 64;
+            continue;
+        }
+
+        uint64_t free_bits = ~bitmap[word++];
+        if (free_bits == ~0ULL) {
+            run += 64;
+            continue;
+        }
+
+        uint64_t bit = 0;
+        while (bit < 64) {
+            uint64_t rest = free_bits >> bit;
+            if (rest & 1) {
+                uint64_t len = __builtin_ctzll(~rest);
+                run += len;
+                bit += len;
+            } else {
+                if (run > best) {
+                    best = run;
+                }
+                run = 0;
+                if (rest == 0) {
+                    break;
+                }
+                bit += __builtin_ctzll(rest);
+            }
+        }
+    }
+
+    return run > best ? run : best;
+}
+
+void pmm_stats(pmm_stats_t *stats)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&pmm_lock);
+    // Nothing takes the PMM lock while holding the pool's, so nesting them
+    // this way round is safe
+    spinlock_acquire(&zero_pool_lock);
+
+    stats->total_pages = total_pages;
+    stats->free_pages = free_pages;
+    stats->zeroed_pages = zero_pool_count;
+    stats->used_pages = total_pages - free_pages - zero_pool_count;
+    stats->largest_free_run = largest_free_run();
+    for (int i = 0; i <= PMM_MAX_ORDER; i++) {
+        stats->free_blocks[i] = free_counts[i];
     }
+
+    spinlock_release(&zero_pool_lock);
+    spinlock_release_irqrestore(&pmm_lock, flags);
 }
@@ -0,0 +1,278 @@
+#include <debug.h>
+#include <pmm.h>
+#include <slab.h>
+#include <string.h>
+#include <vmm.h>
+
+// Header at the start of every slab, followed by the objects
+struct slab {
+    struct slab *next;
+    struct slab *prev;
+    kmem_cache_t *cache;
+    void *free_list;
+    uint32_t in_use;
+};
+
+static kmem_cache_t caches[KMEM_MAX_CACHES];
+static spinlock_t caches_lock = {0, "kmem_caches"};
+
+static size_t align_up(size_t value, size_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+static void slab_list_push(slab_t **head, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_remove(slab_t **head, slab_t *slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static void **obj_link(kmem_cache_t *cache, void *obj)
+{
+    return (void **)((uint8_t *)obj + cache->link_offset);
+}
+
+static size_t slab_bytes(kmem_cache_t *cache)
+{
+    return (size_t)PAGE_SIZE << cache->slab_order;
+}
+
+/**
+ * @brief Picks the smallest slab order that wastes no more than an eighth of
+ * the slab, falling back to the largest order that fits an object at all.
+ */
+static bool choose_slab_order(kmem_cache_t *cache)
+{
+    for (uint8_t order = 0; order <= KMEM_MAX_SLAB_ORDER; order++) {
+        size_t bytes = (size_t)PAGE_SIZE << order;
+        if (cache->first_obj_offset + cache->stride > bytes) {
+            continue;
+        }
+
+        size_t count = (bytes - cache->first_obj_offset) / cache->stride;
+        size_t waste =
+            bytes - cache->first_obj_offset - count * cache->stride;
+        cache->slab_order = order;
+        cache->objs_per_slab = count;
+        if (waste <= bytes / 8) {
+            return true;
+        }
+    }
+    return cache->objs_per_slab > 0;
+}
+
+static slab_t *slab_create(kmem_cache_t *cache)
+{
+    void *phys = pmm_alloc_pages(cache->slab_order);
+    if (!phys) {
+        return NULL;
+    }
+
+    slab_t *slab = phys_to_virt(phys);
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+
+    // Build the free list back to front so objects are handed out in
+    // address order
+    uint8_t *base = (uint8_t *)slab + cache->first_obj_offset;
+    for (uint32_t i = cache->objs_per_slab; i > 0; i--) {
+        void *obj = base + (i - 1) * cache->stride;
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *obj_link(cache, obj) = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    cache->slab_count++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t *cache, slab_t *slab)
+{
+    cache->slab_count--;
+    pmm_free_pages(virt_to_phys(slab), cache->slab_order);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *obj))
+{
+    if (align == 0) {
+        align = sizeof(void *);
+    }
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&caches_lock);
+    kmem_cache_t *cache = NULL;
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (!caches[i].active) {
+            cache = &caches[i];
+            memset(cache, 0, sizeof(kmem_cache_t));
+            cache->active = true;
+            break;
+        }
+    }
+    spinlock_release_irqrestore(&caches_lock, flags);
+
+    if (!cache) {
+        log_err("kmem: Cache table full, cannot create '%s'", name);
+        return NULL;
+    }
+
+    strncpy(cache->name, name, KMEM_NAME_LEN - 1);
+    cache->obj_size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->lock.name = cache->name;
+
+    // Constructed objects must keep their contents while free, so the free
+    // list link goes after the object instead of over its first word
+    if (ctor) {
+        cache->link_offset = align_up(size, sizeof(void *));
+        cache->stride =
+            align_up(cache->link_offset + sizeof(void *), align);
+    } else {
+        cache->link_offset = 0;
+        cache->stride = align_up(size, align);
+    }
+    cache->first_obj_offset = align_up(sizeof(slab_t), align);
+
+    if (!choose_slab_order(cache)) {
+        log_err("kmem: Object size %lu too large for cache '%s'", size, name);
+        cache->active = false;
+        return NULL;
+    }
+
+    log_verbose("kmem: Created cache '%s' (%lu byte objects, %d per slab, "
+                "order %d)",
+                cache->name, size, cache->objs_per_slab, cache->slab_order);
+    return cache;
+}
+
+void kmem_cache_destroy(kmem_cache_t *cache)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&cache->lock);
+
+    if (cache->objs_in_use) {
+        log_warn("kmem: Destroying cache '%s' with %lu objects in use",
+                 cache->name, cache->objs_in_use);
+    }
+
+    slab_t **lists[] = {&cache->partial, &cache->full, &cache->empty};
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        while (*lists[i]) {
+            slab_t *slab = *lists[i];
+            slab_list_remove(lists[i], slab);
+            slab_destroy(cache, slab);
+        }
+    }
+    cache->active = false;
+
+    spinlock_release_irqrestore(&cache->lock, flags);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&cache->lock);
+
+    slab_t *slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+        } else {
+            slab = slab_create(cache);
+            if (!slab) {
+                spinlock_release_irqrestore(&cache->lock, flags);
+                log_err("kmem: Out of memory growing cache '%s'",
+                        cache->name);
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void *obj = slab->free_list;
+    slab->free_list = *obj_link(cache, obj);
+    slab->in_use++;
+
+    if (!slab->free_list) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->objs_in_use++;
+    cache->total_allocs++;
+
+    spinlock_release_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    if (!obj) {
+        return;
+    }
+
+    // Slabs are naturally aligned PMM blocks, so the header is found by
+    // rounding the object address down
+    slab_t *slab = (slab_t *)((uintptr_t)obj & ~(slab_bytes(cache) - 1));
+    if (slab->cache != cache) {
+        log_err("kmem: Object 0x%lx does not belong to cache '%s'", obj,
+                cache->name);
+        return;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&cache->lock);
+
+    bool was_full = slab->free_list == NULL;
+    *obj_link(cache, obj) = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+
+    if (slab->in_use == 0) {
+        slab_list_remove(was_full ? &cache->full : &cache->partial, slab);
+        // Keep one empty slab around so a cache sitting at a slab boundary
+        // doesn't keep going back to the PMM
+        if (cache->empty) {
+            slab_destroy(cache, slab);
+        } else {
+            slab_list_push(&cache->empty, slab);
+        }
+    } else if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    cache->objs_in_use--;
+    cache->total_frees++;
+
+    spinlock_release_irqrestore(&cache->lock, flags);
+}
+
+kmem_cache_t *kmem_cache_get(int index)
+{
+    if (index < 0 || index >= KMEM_MAX_CACHES || !caches[index].active) {
+        return NULL;
+    }
+    return &caches[index];
+}
@@ -4,12 +4,42 @@
 #include <debug.h>
 #include <heap.h>
 #include <limine.h>
+#include <lock.h>
 #include <panic.h>
 #include <pmm.h>
+#include <slab.h>
+#include <smp.h>
 #include <string.h>
 
+// Page size bit in PDPT and PD entries
+#define VMM_HUGE (1 << 7)
+
+// The PAT bit of a 4 KiB entry. In large page entries bit 7 is the page size,
+// so the PAT bit moves to 12
+#define PTE_PAT (1ULL << 7)
+#define PTE_LARGE_PAT (1ULL << 12)
+
+// Physical address bits of an entry
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
 // Page Map Level 4 Table (PML4T)
 static uint64_t *pml4 = NULL;
+static spinlock_t pml4_lock = {0, "pml4"};
+
+// Whether the CPU supports 1 GiB pages in the PDPT
+static bool gb_pages = false;
+
+// Free virtual ranges in the dynamic window, sorted by address with
+// neighbouring ranges always merged
+typedef struct vma_range {
+    uintptr_t start;
+    uintptr_t end;
+    struct vma_range *next;
+} vma_range_t;
+
+static vma_range_t *free_ranges = NULL;
+static kmem_cache_t *vma_cache;
+static spinlock_t vma_lock = {0, "vma"};
 
 // Helper function to get the HHDM offset
 static uint64_t get_hhdm_offset()
@@ -34,41 +64,55 @@ void *virt_to_phys(void *virt_addr)
     return (void *)((uintptr_t)virt_addr - get_hhdm_offset());
 }
 
-void *vmm_get_phys(void *virt_addr)
+static uint64_t *entry_table(uint64_t entry)
 {
-    uintptr_t virt = (uintptr_t)virt_addr;
-    size_t pml4_index = (virt >> 39) & 0x1FF;
-    size_t pdpt_index = (virt >> 30) & 0x1FF;
-    size_t pd_index = (virt >> 21) & 0x1FF;
-    size_t pt_index = (virt >> 12) & 0x1FF;
-
-    if (!(pml4[pml4_index] & VMM_PRESENT)) {
-        return NULL;
-    }
-    uint64_t *pdpt =
-        (uint64_t *)phys_to_virt((void *)(pml4[pml4_index] & ~0xFFF));
+    return (uint64_t *)phys_to_virt((void *)(entry & PTE_ADDR_MASK));
+}
 
-    if (!(pdpt[pdpt_index] & VMM_PRESENT)) {
-        return NULL;
-    }
-    uint64_t *pd =
-        (uint64_t *)phys_to_virt((void *)(pdpt[pdpt_index] & ~0xFFF));
+// Index into the table at `level` (0 = PT, 1 = PD, 2 = PDPT, 3 = PML4)
+static size_t table_index(uintptr_t virt, int level)
+{
+    return (virt >> (12 + 9 * level)) & 0x1FF;
+}
 
-    if (!(pd[pd_index] & VMM_PRESENT)) {
-        return NULL;
-    }
+// Size of the memory one entry at `level` maps
+static uint64_t level_size(int level)
+{
+    return 1ULL << (12 + 9 * level);
+}
 
-    // Check if it's a 2MB page (HUGE PAGE)
-    if (pd[pd_index] & (1 << 7)) {
-        return (void *)((pd[pd_index] & ~0x1FFFFF) | (virt & 0x1FFFFF));
+/**
+ * @brief Finds the entry that maps an address, which is either a PTE or a
+ * large page entry, or the first non-present entry on the way down.
+ *
+ * @param level Set to the level of the returned entry.
+ */
+static uint64_t *lookup_entry(uintptr_t virt, int *level)
+{
+    uint64_t *table = pml4;
+    for (int l = 3;; l--) {
+        uint64_t *entry = &table[table_index(virt, l)];
+        if (l == 0 || !(*entry & VMM_PRESENT) ||
+            (l < 3 && (*entry & VMM_HUGE))) {
+            *level = l;
+            return entry;
+        }
+        table = entry_table(*entry);
     }
+}
 
-    uint64_t *pt = (uint64_t *)phys_to_virt((void *)(pd[pd_index] & ~0xFFF));
-    if (!(pt[pt_index] & VMM_PRESENT)) {
+void *vmm_get_phys(void *virt_addr)
+{
+    uintptr_t virt = (uintptr_t)virt_addr;
+    int level;
+    uint64_t *entry = lookup_entry(virt, &level);
+    if (!(*entry & VMM_PRESENT)) {
         return NULL;
     }
 
-    return (void *)((pt[pt_index] & ~0xFFF) | (virt & 0xFFF));
+    uint64_t offset_mask = level_size(level) - 1;
+    return (void *)((*entry & PTE_ADDR_MASK & ~offset_mask) |
+                    (virt & offset_mask));
 }
 
 /**
@@ -83,21 +127,20 @@ void *vmm_get_phys(void *virt_addr)
 static uint64_t *get_next_table(uint64_t *entry, bool allocate)
 {
     if (*entry & VMM_PRESENT) {
-        return (uint64_t *)phys_to_virt((void *)(*entry & ~0xFFF));
+        return entry_table(*entry);
     }
 
     if (!allocate) {
         return NULL;
     }
 
-    void *new_table_phys = pmm_alloc_page();
+    void *new_table_phys = pmm_alloc_zeroed_page();
     if (!new_table_phys) {
         log_err("VMM: Failed to allocate physical page for table.");
         return NULL;
     }
 
     uint64_t *new_table_virt = (uint64_t *)phys_to_virt(new_table_phys);
-    memset(new_table_virt, 0, PAGE_SIZE);
 
     *entry = (uintptr_t)new_table_phys | VMM_PRESENT | VMM_WRITE | VMM_USER;
 
@@ -105,50 +148,512 @@ static uint64_t *get_next_table(uint64_t *entry, bool allocate)
 }
 
 /**
- * @brief Maps a single page.
+ * @brief Replaces a large page entry with a table of smaller entries that
+ * map the same memory with the same flags.
  *
- * @param pml4_table The base of the PML4 table.
- * @param virt_addr The virtual address to map.
- * @param phys_addr The physical address to map to.
- * @param flags The flags for the page table entry.
- * @return true on success, false on failure.
+ * The translation doesn't change, so no TLB flush is needed until one of the
+ * new entries is modified.
  */
-static bool map_page(uint64_t *pml4_table, void *virt_addr, void *phys_addr,
-                     uint32_t flags)
+static bool split_large_page(uint64_t *entry, int level)
 {
-    uintptr_t virt = (uintptr_t)virt_addr;
+    void *table_phys = pmm_alloc_page();
+    if (!table_phys) {
+        log_err("VMM: Failed to allocate page table for split");
+        return false;
+    }
 
-    size_t pml4_index = (virt >> 39) & 0x1FF;
-    size_t pdpt_index = (virt >> 30) & 0x1FF;
-    size_t pd_index = (virt >> 21) & 0x1FF;
-    size_t pt_index = (virt >> 12) & 0x1FF;
+    uint64_t *table = phys_to_virt(table_phys);
+    uint64_t base = *entry & PTE_ADDR_MASK & ~(level_size(level) - 1);
+    uint64_t flags = (*entry & ~PTE_ADDR_MASK) | (*entry & PTE_LARGE_PAT);
+    if (level == 1) {
+        // Bit 7 of a PTE is the PAT bit rather than the page size bit
+        flags &= ~(uint64_t)VMM_HUGE & ~PTE_LARGE_PAT;
+        if (*entry & PTE_LARGE_PAT) {
+            flags |= PTE_PAT;
+        }
+    }
 
-    uint64_t *pdpt = get_next_table(&pml4_table[pml4_index], true);
-    if (!pdpt) {
-        return false;
+    for (int i = 0; i < 512; i++) {
+        table[i] = (base + i * level_size(level - 1)) | flags;
     }
 
-    uint64_t *pd = get_next_table(&pdpt[pdpt_index], true);
-    if (!pd) {
-        return false;
+    *entry = (uintptr_t)table_phys | VMM_PRESENT | VMM_WRITE | VMM_USER;
+    return true;
+}
+
+/**
+ * @brief Gets the entry for an address at the given level, creating page
+ * tables and splitting large pages on the way down as needed.
+ */
+static uint64_t *get_entry(uintptr_t virt, int level)
+{
+    uint64_t *table = pml4;
+    for (int l = 3; l > level; l--) {
+        uint64_t *entry = &table[table_index(virt, l)];
+        if (l < 3 && (*entry & VMM_PRESENT) && (*entry & VMM_HUGE) &&
+            !split_large_page(entry, l)) {
+            return NULL;
+        }
+        table = get_next_table(entry, true);
+        if (!table) {
+            return NULL;
+        }
     }
+    return &table[table_index(virt, level)];
+}
 
-    uint64_t *pt = get_next_table(&pd[pd_index], true);
-    if (!pt) {
-        return false;
+/**
+ * @brief Converts flags in the 4 KiB PTE layout to a large page entry.
+ */
+static uint64_t large_flags(uint64_t flags)
+{
+    if (flags & PTE_PAT) {
+        flags = (flags & ~PTE_PAT) | PTE_LARGE_PAT;
     }
+    return flags | VMM_HUGE;
+}
 
-    pt[pt_index] = (uintptr_t)phys_addr | flags;
+static bool table_empty(uint64_t *table)
+{
+    for (int i = 0; i < 512; i++) {
+        if (table[i] & VMM_PRESENT) {
+            return false;
+        }
+    }
     return true;
 }
 
+// Frames unmap_range() has taken out of the page tables, and tables
+// vmm_map_range() has replaced with a large page. They are only freed after
+// every CPU has dropped its TLB entries for them, or another CPU could still
+// write to a frame that has been handed out again.
+#define UNMAP_BATCH 64
+
+typedef struct unmap_batch {
+    // Entry that mapped the frames, or the physical address of a page table
+    uint64_t entries[UNMAP_BATCH];
+    int8_t levels[UNMAP_BATCH];
+    int count;
+} unmap_batch_t;
+
+static void batch_add(unmap_batch_t *batch, uint64_t entry, int level)
+{
+    batch->entries[batch->count] = entry;
+    batch->levels[batch->count] = level;
+    batch->count++;
+}
+
+/**
+ * @brief Frees the page tables covering an address once they no longer map
+ * anything, working up from the deepest table to the PDPT. The tables go
+ * into `batch`.
+ */
+static void release_empty_tables(uintptr_t virt, unmap_batch_t *batch)
+{
+    // entries[l] is the entry in the table at level l + 1 pointing down
+    uint64_t *entries[3] = {NULL, NULL, NULL};
+    uint64_t *table = pml4;
+    for (int l = 3; l > 0; l--) {
+        uint64_t *entry = &table[table_index(virt, l)];
+        if (!(*entry & VMM_PRESENT) || (l < 3 && (*entry & VMM_HUGE))) {
+            break;
+        }
+        entries[l - 1] = entry;
+        table = entry_table(*entry);
+    }
+
+    for (int l = 0; l < 3; l++) {
+        if (!entries[l]) {
+            continue;
+        }
+        uint64_t *child = entry_table(*entries[l]);
+        if (!table_empty(child)) {
+            return;
+        }
+        *entries[l] = 0;
+        batch_add(batch, (uint64_t)virt_to_phys(child), 0);
+    }
+}
+
+/**
+ * @brief Returns the frames behind an entry of the given level to the PMM.
+ */
+static void free_entry_frames(uint64_t entry, int level)
+{
+    uint64_t size = level_size(level);
+    uint64_t phys = entry & PTE_ADDR_MASK & ~(size - 1);
+    uint64_t chunk = (uint64_t)PAGE_SIZE << PMM_MAX_ORDER;
+    if (chunk > size) {
+        chunk = size;
+    }
+    uint8_t order = pmm_order_for_size(chunk);
+    for (uint64_t offset = 0; offset < size; offset += chunk) {
+        pmm_free_pages((void *)(phys + offset), order);
+    }
+}
+
+/**
+ * @brief Shoots down [start, end) on the other CPUs, then frees the frames
+ * collected while unmapping it.
+ */
+static void batch_flush(unmap_batch_t *batch, uintptr_t start, uintptr_t end)
+{
+    smp_tlb_shootdown(start, (end - start) / PAGE_SIZE);
+    for (int i = 0; i < batch->count; i++) {
+        free_entry_frames(batch->entries[i], batch->levels[i]);
+    }
+    batch->count = 0;
+}
+
+static void unmap_range(void *virt_addr, size_t num_pages, bool free_frames)
+{
+    uintptr_t virt = (uintptr_t)virt_addr & ~(PAGE_SIZE - 1);
+    uintptr_t end = virt + num_pages * PAGE_SIZE;
+    uintptr_t flushed = virt;
+    unmap_batch_t batch;
+    batch.count = 0;
+    uint64_t flags = spinlock_acquire_irqsave(&pml4_lock);
+
+    while (virt < end) {
+        // Room for one mapping and the three tables above it. The shootdown
+        // waits for the other CPUs, which may be spinning on pml4_lock with
+        // interrupts disabled, so it runs without the lock
+        if (batch.count > UNMAP_BATCH - 4) {
+            spinlock_release_irqrestore(&pml4_lock, flags);
+            batch_flush(&batch, flushed, virt);
+            flushed = virt;
+            flags = spinlock_acquire_irqsave(&pml4_lock);
+        }
+
+        int level;
+        uint64_t *entry = lookup_entry(virt, &level);
+        uint64_t size = level_size(level);
+
+        if (!(*entry & VMM_PRESENT)) {
+            // Nothing mapped here, skip everything this entry would cover
+            uintptr_t next = (virt & ~(size - 1)) + size;
+            if (next < virt) {
+                break;
+            }
+            virt = next;
+            continue;
+        }
+
+        if (level > 0 && ((virt & (size - 1)) || end - virt < size)) {
+            // Only part of a large page is being unmapped
+            if (!split_large_page(entry, level)) {
+                break;
+            }
+            continue;
+        }
+
+        uint64_t old = *entry;
+        *entry = 0;
+        asm volatile("invlpg (%0)" ::"r"(virt) : "memory");
+        if (free_frames) {
+            batch_add(&batch, old, level);
+        }
+        virt += size;
+
+        // Check the tables once per page table, after its last page in the
+        // range has been cleared
+        if ((virt & (PAGE_SIZE_2M - 1)) == 0 || virt >= end) {
+            release_empty_tables(virt - size, &batch);
+        }
+    }
+
+    spinlock_release_irqrestore(&pml4_lock, flags);
+
+    // A range that is only unmapped can't be mapped again until this
+    // returns, but freed frames and tables must wait for the shootdown
+    batch_flush(&batch, flushed, end);
+}
+
+void vmm_unmap_range(void *virt_addr, size_t num_pages)
+{
+    unmap_range(virt_addr, num_pages, false);
+}
+
+void vmm_release_range(void *virt_addr, size_t num_pages)
+{
+    unmap_range(virt_addr, num_pages, true);
+}
+
+/**
+ * @brief Picks the largest page size that can map `virt` to `phys` with
+ * `num_pages` pages left to map.
+ */
+static int mapping_level(uintptr_t virt, uintptr_t phys, size_t num_pages)
+{
+    for (int level = gb_pages ? 2 : 1; level > 0; level--) {
+        uint64_t size = level_size(level);
+        if (((virt | phys) & (size - 1)) != 0 ||
+            num_pages < size / PAGE_SIZE) {
+            continue;
+        }
+
+        // Don't replace a table that still maps something
+        int found;
+        uint64_t *entry = lookup_entry(virt, &found);
+        if (found >= level) {
+            return level;
+        }
+        entry = pml4;
+        for (int l = 3; l >= level; l--) {
+            entry = &entry[table_index(virt, l)];
+            if (l > level) {
+                entry = entry_table(*entry);
+            }
+        }
+        if (table_empty(entry_table(*entry))) {
+            return level;
+        }
+    }
+    return 0;
+}
+
+bool vmm_map_range(void *virt_addr, void *phys_addr, size_t num_pages,
+                   uint32_t flags)
+{
+    uintptr_t virt = (uintptr_t)virt_addr & ~(PAGE_SIZE - 1);
+    uintptr_t phys = (uintptr_t)phys_addr & ~(PAGE_SIZE - 1);
+    uintptr_t flushed = virt;
+    unmap_batch_t batch;
+    batch.count = 0;
+    uint64_t irq_flags = spinlock_acquire_irqsave(&pml4_lock);
+
+    size_t done = 0;
+    while (done < num_pages) {
+        uintptr_t current_virt = virt + done * PAGE_SIZE;
+        uintptr_t current_phys = phys + done * PAGE_SIZE;
+
+        // Runs without the lock, as in unmap_range()
+        if (batch.count == UNMAP_BATCH) {
+            spinlock_release_irqrestore(&pml4_lock, irq_flags);
+            batch_flush(&batch, flushed, current_virt);
+            flushed = current_virt;
+            irq_flags = spinlock_acquire_irqsave(&pml4_lock);
+        }
+
+        int level = mapping_level(current_virt, current_phys, num_pages - done);
+        uint64_t *entry = get_entry(current_virt, level);
+        if (!entry) {
+            spinlock_release_irqrestore(&pml4_lock, irq_flags);
+            log_err("VMM: Failed to map page at virt 0x%lx", current_virt);
+            if (batch.count) {
+                batch_flush(&batch, flushed, current_virt);
+            }
+            vmm_unmap_range((void *)virt, done);
+            return false;
+        }
+
+        if (level > 0 && (*entry & VMM_PRESENT) && !(*entry & VMM_HUGE)) {
+            // An empty table left behind by an earlier mapping. Other CPUs
+            // may still have it in their paging-structure caches, so it is
+            // only freed after the shootdown
+            batch_add(&batch, (uint64_t)virt_to_phys(entry_table(*entry)), 0);
+        }
+
+        *entry = current_phys | (level > 0 ? large_flags(flags) : flags);
+        asm volatile("invlpg (%0)" ::"r"(current_virt) : "memory");
+        done += level_size(level) / PAGE_SIZE;
+    }
+
+    spinlock_release_irqrestore(&pml4_lock, irq_flags);
+    if (batch.count) {
+        batch_flush(&batch, flushed, virt + done * PAGE_SIZE);
+    }
+    return true;
+}
+
+bool vmm_protect_range(void *virt_addr, size_t num_pages, uint32_t flags)
+{
+    uintptr_t virt = (uintptr_t)virt_addr & ~(PAGE_SIZE - 1);
+    uintptr_t end = virt + num_pages * PAGE_SIZE;
+    uint64_t irq_flags = spinlock_acquire_irqsave(&pml4_lock);
+
+    while (virt < end) {
+        int level;
+        uint64_t *entry = lookup_entry(virt, &level);
+        uint64_t size = level_size(level);
+
+        if (!(*entry & VMM_PRESENT)) {
+            uintptr_t next = (virt & ~(size - 1)) + size;
+            if (next < virt) {
+                break;
+            }
+            virt = next;
+            continue;
+        }
+
+        if (level > 0 && ((virt & (size - 1)) || end - virt < size)) {
+            if (!split_large_page(entry, level)) {
+                spinlock_release_irqrestore(&pml4_lock, irq_flags);
+                return false;
+            }
+            continue;
+        }
+
+        uint64_t phys = *entry & PTE_ADDR_MASK & ~(size - 1);
+        *entry = phys | (level > 0 ? large_flags(flags) : flags);
+        asm volatile("invlpg (%0)" ::"r"(virt) : "memory");
+        virt += size;
+    }
+
+    spinlock_release_irqrestore(&pml4_lock, irq_flags);
+    smp_tlb_shootdown((uintptr_t)virt_addr & ~(PAGE_SIZE - 1), num_pages);
+    return true;
+}
+
+void *vmm_alloc_range_aligned(size_t num_pages, uint64_t align)
+{
+    size_t size = num_pages * PAGE_SIZE;
+    uint64_t flags = spinlock_acquire_irqsave(&vma_lock);
+
+    // First fit, so the low end of the window is reused and the free list
+    // stays short
+    vma_range_t *prev = NULL;
+    for (vma_range_t *range = free_ranges; range;
+         prev = range, range = range->next) {
+        uintptr_t start = (range->start + align - 1) & ~(align - 1);
+        if (start < range->start || start >= range->end ||
+            range->end - start < size) {
+            continue;
+        }
+
+        if (start > range->start) {
+            // The gap below the aligned start stays free
+            vma_range_t *head = kmem_cache_alloc(vma_cache);
+            if (!head) {
+                break;
+            }
+            head->start = range->start;
+            head->end = start;
+            head->next = range;
+            if (prev) {
+                prev->next = head;
+            } else {
+                free_ranges = head;
+            }
+            prev = head;
+            range->start = start;
+        }
+
+        range->start += size;
+        if (range->start == range->end) {
+            if (prev) {
+                prev->next = range->next;
+            } else {
+                free_ranges = range->next;
+            }
+            kmem_cache_free(vma_cache, range);
+        }
+
+        spinlock_release_irqrestore(&vma_lock, flags);
+        return (void *)start;
+    }
+
+    spinlock_release_irqrestore(&vma_lock, flags);
+    return NULL;
+}
+
+void *vmm_alloc_range(size_t num_pages)
+{
+    return vmm_alloc_range_aligned(num_pages, PAGE_SIZE);
+}
+
+/**
+ * @brief Picks the alignment for a new virtual range mapping `num_pages` from
+ * `phys`: the largest page size both the physical address and the size allow,
+ * so vmm_map_range() can use large pages.
+ */
+static uint64_t mapping_align(uintptr_t phys, size_t num_pages)
+{
+    for (int level = gb_pages ? 2 : 1; level > 0; level--) {
+        uint64_t size = level_size(level);
+        if ((phys & (size - 1)) == 0 && num_pages >= size / PAGE_SIZE) {
+            return size;
+        }
+    }
+    return PAGE_SIZE;
+}
+
+void vmm_free_range(void *virt_addr, size_t num_pages)
+{
+    uintptr_t start = (uintptr_t)virt_addr & ~(PAGE_SIZE - 1);
+    uintptr_t end = start + num_pages * PAGE_SIZE;
+    if (num_pages == 0) {
+        return;
+    }
+    if (start < KERNEL_DYNAMIC_START || end - 1 > KERNEL_DYNAMIC_END) {
+        log_err("VMM: Freeing range 0x%lx outside the dynamic window", start);
+        return;
+    }
+
+    vmm_unmap_range((void *)start, num_pages);
+
+    uint64_t flags = spinlock_acquire_irqsave(&vma_lock);
+
+    vma_range_t *prev = NULL;
+    vma_range_t *next = free_ranges;
+    while (next && next->start < start) {
+        prev = next;
+        next = next->next;
+    }
+
+    if ((prev && prev->end > start) || (next && next->start < end)) {
+        spinlock_release_irqrestore(&vma_lock, flags);
+        log_err("VMM: Double free of virtual range 0x%lx", start);
+        return;
+    }
+
+    if (prev && prev->end == start) {
+        prev->end = end;
+        if (next && next->start == end) {
+            prev->end = next->end;
+            prev->next = next->next;
+            kmem_cache_free(vma_cache, next);
+        }
+    } else if (next && next->start == end) {
+        next->start = start;
+    } else {
+        vma_range_t *range = kmem_cache_alloc(vma_cache);
+        if (!range) {
+            // The range is lost, but it is still safely unmapped
+            spinlock_release_irqrestore(&vma_lock, flags);
+            return;
+        }
+        range->start = start;
+        range->end = end;
+        range->next = next;
+        if (prev) {
+            prev->next = range;
+        } else {
+            free_ranges = range;
+        }
+    }
+
+    spinlock_release_irqrestore(&vma_lock, flags);
+}
+
 void vmm_init()
 {
     // Get the current PML4 table from CR3
     cr3_t cr3 = get_cr3();
     pml4 = phys_to_virt((void *)cr3);
+    gb_pages = is_1g_pages_supported();
+
+    vma_cache = kmem_cache_create("vma_range", sizeof(vma_range_t), 0, NULL);
+    free_ranges = kmem_cache_alloc(vma_cache);
+    if (!free_ranges) {
+        panic("VMM: Failed to allocate the dynamic address range");
+    }
+    free_ranges->start = KERNEL_DYNAMIC_START;
+    free_ranges->end = KERNEL_DYNAMIC_END + 1;
+    free_ranges->next = NULL;
 
-    log_info("VMM: Initialized with PML4 at phys 0x%x, virt 0x%x", cr3, pml4);
+    log_info("VMM: Initialized with PML4 at phys 0x%x, virt 0x%x%s", cr3, pml4,
+             gb_pages ? " (1 GiB pages)" : "");
 }
 
 void *mmap_physical(void *virt_addr, void *phys_addr, size_t size,
@@ -166,9 +671,12 @@ void *mmap_physical(void *virt_addr, void *phys_addr, size_t size,
 
     uintptr_t virt_aligned;
     if (virt_addr == NULL) {
-        // Find free virtual memory area
-        // Implement a VMM function to find available space
-        virt_aligned = (uintptr_t)find_free_virt_pages(num_pages);
+        uint64_t align = mapping_align(phys_aligned, num_pages);
+        virt_aligned = (uintptr_t)vmm_alloc_range_aligned(num_pages, align);
+        if (virt_aligned == 0 && align > PAGE_SIZE) {
+            // Too fragmented for an aligned range, small pages will do
+            virt_aligned = (uintptr_t)vmm_alloc_range(num_pages);
+        }
         if (virt_aligned == 0) {
             log_err("VMM: Failed to allocate virtual address space");
             return NULL;
@@ -181,48 +689,15 @@ void *mmap_physical(void *virt_addr, void *phys_addr, size_t size,
     log_verbose("VMM: Mapping %d pages from phys 0x%x to virt 0x%x", num_pages,
                 phys_aligned, virt_aligned);
 
-    for (size_t i = 0; i < num_pages; i++) {
-        void *current_phys = (void *)(phys_aligned + i * PAGE_SIZE);
-        void *current_virt = (void *)(virt_aligned + i * PAGE_SIZE);
-        if (!map_page(pml4, current_virt, current_phys, flags)) {
-            log_err("VMM: Failed to map page at virt 0x%x", current_virt);
-            return NULL;
+    if (!vmm_map_range((void *)virt_aligned, (void *)phys_aligned, num_pages,
+                       flags)) {
+        if (virt_addr == NULL) {
+            vmm_free_range((void *)virt_aligned, num_pages);
         }
-    }
-
-    // Invalidate TLB for the changed virtual addresses
-    for (size_t i = 0; i < num_pages; i++) {
-        asm volatile(
-            "invlpg (%0)" ::"r"((void *)(virt_aligned + i * PAGE_SIZE)));
+        return NULL;
     }
 
     // Return the virtual address (either original or allocated)
     uintptr_t offset = phys_start - phys_aligned;
     return (void *)(virt_aligned + offset);
 }
-
-void *find_free_virt_pages(size_t num_pages)
-{
-    // Simple linear search for free virtual address space starting after the
-    // HHDM This is a basic implementation and should be replaced by a proper
-    // VMA manager
-    static uintptr_t search_start = 0xFFFF800000000000;
-    uintptr_t current_addr = search_start;
-
-    while (current_addr < 0xFFFFFFFFFFFFFFFF) {
-        bool area_free = true;
-        for (size_t i = 0; i < num_pages; i++) {
-            if (vmm_get_phys((void *)(current_addr + i * PAGE_SIZE)) != NULL) {
-                area_free = false;
-                current_addr += (i + 1) * PAGE_SIZE;
-                break;
-            }
-        }
-
-        if (area_free) {
-            return (void *)current_addr;
-        }
-    }
-
-    return NULL;
-}
\ No newline at end of file
@@ -1,6 +1,9 @@
+#include <acpi.h>
+#include <apic.h>
 #include <debug.h>
 #include <io.h>
 #include <pci.h>
+#include <vmm.h>
 
 static uint32_t pci_get_config_address(uint8_t bus, uint8_t device,
                                        uint8_t function, uint8_t offset)
@@ -130,6 +133,204 @@ uint64_t pci_get_bar_address(pci_device_t *dev, uint8_t bar_num)
     }
 }
 
+uint8_t pci_find_capability(pci_device_t *dev, uint8_t cap_id)
+{
+    uint16_t status =
+        pci_read_word(dev->bus, dev->device, dev->function, PCI_STATUS);
+    if (!(status & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+
+    uint8_t offset =
+        pci_read_byte(dev->bus, dev->device, dev->function, PCI_CAP_PTR) & 0xFC;
+    // A malformed list could loop, and there's only room for 48 entries
+    for (int i = 0; offset && i < 48; i++) {
+        uint16_t header =
+            pci_read_word(dev->bus, dev->device, dev->function, offset);
+        if ((header & 0xFF) == cap_id) {
+            return offset;
+        }
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+static void pci_disable_intx(pci_device_t *dev)
+{
+    uint16_t command =
+        pci_read_word(dev->bus, dev->device, dev->function, PCI_COMMAND);
+    pci_write_word(dev->bus, dev->device, dev->function, PCI_COMMAND,
+                   command | PCI_COMMAND_INTX_DISABLE);
+}
+
+static uint32_t msi_address(uint32_t apic_id)
+{
+    return MSI_ADDRESS_BASE | ((apic_id & 0xFF) << MSI_ADDRESS_DEST_SHIFT);
+}
+
+bool pci_enable_msi(pci_device_t *dev, uint8_t vector, uint32_t apic_id)
+{
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+    if (!cap) {
+        return false;
+    }
+
+    uint16_t control = pci_read_word(dev->bus, dev->device, dev->function,
+                                     cap + PCI_MSI_CONTROL);
+    pci_write_dword(dev->bus, dev->device, dev->function,
+                    cap + PCI_MSI_ADDR_LOW, msi_address(apic_id));
+    if (control & PCI_MSI_CONTROL_64BIT) {
+        pci_write_dword(dev->bus, dev->device, dev->function,
+                        cap + PCI_MSI_ADDR_HIGH, 0);
+        pci_write_word(dev->bus, dev->device, dev->function,
+                       cap + PCI_MSI_DATA_64, vector);
+    } else {
+        pci_write_word(dev->bus, dev->device, dev->function,
+                       cap + PCI_MSI_DATA_32, vector);
+    }
+
+    // A single message, so the device can't alter the low bits of the vector
+    control &= ~PCI_MSI_CONTROL_MME_MASK;
+    control |= PCI_MSI_CONTROL_ENABLE;
+    pci_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_CONTROL,
+                   control);
+
+    pci_disable_intx(dev);
+    return true;
+}
+
+int pci_install_intx_handler(pci_device_t *dev,
+                             uint64_t (*handler)(uint64_t, void *), void *ctx,
+                             uint32_t *gsi)
+{
+    uint32_t routed_gsi;
+    uint16_t flags;
+    if (!acpi_pci_route_irq(dev, &routed_gsi, &flags)) {
+        log_warn("PCI: No INTx route for %02x:%02x.%x", dev->bus, dev->device,
+                 dev->function);
+        return -1;
+    }
+
+    int vector = irq_install_gsi_handler(routed_gsi, flags, handler, ctx);
+    if (vector < 0) {
+        return -1;
+    }
+
+    uint16_t command =
+        pci_read_word(dev->bus, dev->device, dev->function, PCI_COMMAND);
+    pci_write_word(dev->bus, dev->device, dev->function, PCI_COMMAND,
+                   command & ~PCI_COMMAND_INTX_DISABLE);
+    if (gsi) {
+        *gsi = routed_gsi;
+    }
+    return vector;
+}
+
+uint16_t pci_msix_count(pci_device_t *dev)
+{
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    if (!cap) {
+        return 0;
+    }
+
+    uint16_t control = pci_read_word(dev->bus, dev->device, dev->function,
+                                     cap + PCI_MSIX_CONTROL);
+    return (control & PCI_MSIX_CONTROL_SIZE_MASK) + 1;
+}
+
+static volatile uint8_t *pci_map_msix_table(pci_device_t *dev, uint8_t cap,
+                                            uint16_t count)
+{
+    if (dev->msix_table) {
+        return dev->msix_table;
+    }
+
+    uint32_t table = pci_read_dword(dev->bus, dev->device, dev->function,
+                                    cap + PCI_MSIX_TABLE);
+    uint64_t bar = pci_get_bar_address(dev, table & PCI_MSIX_TABLE_BIR_MASK);
+    if (!bar) {
+        log_err("PCI: MSI-X table is in an unimplemented BAR");
+        return NULL;
+    }
+
+    uint64_t phys = bar + (table & ~PCI_MSIX_TABLE_BIR_MASK);
+    uint64_t page = phys & ~(uint64_t)(PAGE_SIZE - 1);
+    size_t size = (phys - page) + (size_t)count * PCI_MSIX_ENTRY_SIZE;
+    uint8_t *virt = mmap_physical(NULL, (void *)page, size,
+                                  VMM_PRESENT | VMM_WRITE | VMM_UC);
+    if (!virt) {
+        log_err("PCI: Failed to map MSI-X table");
+        return NULL;
+    }
+
+    dev->msix_table = virt + (phys - page);
+    dev->msix_count = count;
+    return dev->msix_table;
+}
+
+bool pci_enable_msix(pci_device_t *dev, uint16_t entry, uint8_t vector,
+                     uint32_t apic_id)
+{
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    if (!cap) {
+        return false;
+    }
+
+    uint16_t control = pci_read_word(dev->bus, dev->device, dev->function,
+                                     cap + PCI_MSIX_CONTROL);
+    uint16_t count = (control & PCI_MSIX_CONTROL_SIZE_MASK) + 1;
+    if (entry >= count) {
+        return false;
+    }
+
+    volatile uint8_t *table = pci_map_msix_table(dev, cap, count);
+    if (!table) {
+        return false;
+    }
+
+    // Entries can only be written safely with MSI-X on and the function
+    // masked, or with the entry itself masked
+    if (!(control & PCI_MSIX_CONTROL_ENABLE)) {
+        control |= PCI_MSIX_CONTROL_ENABLE | PCI_MSIX_CONTROL_MASK_ALL;
+        pci_write_word(dev->bus, dev->device, dev->function,
+                       cap + PCI_MSIX_CONTROL, control);
+        pci_disable_intx(dev);
+    }
+
+    volatile uint32_t *slot =
+        (volatile uint32_t *)(table + (size_t)entry * PCI_MSIX_ENTRY_SIZE);
+    slot[PCI_MSIX_ENTRY_CONTROL / 4] |= PCI_MSIX_ENTRY_MASKED;
+    slot[PCI_MSIX_ENTRY_ADDR_LOW / 4] = msi_address(apic_id);
+    slot[PCI_MSIX_ENTRY_ADDR_HIGH / 4] = 0;
+    slot[PCI_MSIX_ENTRY_DATA / 4] = vector;
+    slot[PCI_MSIX_ENTRY_CONTROL / 4] &= ~PCI_MSIX_ENTRY_MASKED;
+
+    if (control & PCI_MSIX_CONTROL_MASK_ALL) {
+        control &= ~PCI_MSIX_CONTROL_MASK_ALL;
+        pci_write_word(dev->bus, dev->device, dev->function,
+                       cap + PCI_MSIX_CONTROL, control);
+    }
+    return true;
+}
+
+bool pci_msix_mask(pci_device_t *dev, uint16_t entry, bool masked)
+{
+    if (!dev->msix_table || entry >= dev->msix_count) {
+        return false;
+    }
+
+    volatile uint32_t *control =
+        (volatile uint32_t *)(dev->msix_table +
+                              (size_t)entry * PCI_MSIX_ENTRY_SIZE +
+                              PCI_MSIX_ENTRY_CONTROL);
+    if (masked) {
+        *control |= PCI_MSIX_ENTRY_MASKED;
+    } else {
+        *control &= ~PCI_MSIX_ENTRY_MASKED;
+    }
+    return true;
+}
+
 void pci_scan_bus()
 {
     log_info("PCI: Scanning bus...");
@@ -1,10 +1,10 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <clocksource.h>
 #include <fs.h>
 #include <heap.h>
 #include <keyboard.h>
-#include <pit.h>
 #include <process.h>
 #include <scheduler.h>
 #include <framebuffer.h>
@@ -111,7 +111,13 @@ m3ApiRawFunction(wasm_api_putchar)
 m3ApiRawFunction(wasm_api_get_ticks)
 {
     m3ApiReturnType(uint64_t)
-    m3ApiReturn(pit_ticks);
+    m3ApiReturn(clock_monotonic_ns() / 1000000);
+}
+
+m3ApiRawFunction(wasm_api_get_time_ns)
+{
+    m3ApiReturnType(uint64_t)
+    m3ApiReturn(clock_monotonic_ns());
 }
 
 m3ApiRawFunction(wasm_api_exit)
@@ -641,8 +647,14 @@ m3ApiRawFunction(wasm_api_waitpid)
     proc_entry_t *e = proc_get(pid);
     if (!e)
         m3ApiReturn(-1);
-    while (e->state != PROC_EXITED)
-        waitqueue_sleep(&e->exit_wq);
+    // Checked under the queue's lock, so the exit can't slip in between the
+    // check and the sleep
+    uint64_t flags = spinlock_acquire_irqsave(&e->exit_wq.lock);
+    while (e->state != PROC_EXITED) {
+        waitqueue_sleep_locked(&e->exit_wq, flags);
+        flags = spinlock_acquire_irqsave(&e->exit_wq.lock);
+    }
+    spinlock_release_irqrestore(&e->exit_wq.lock, flags);
     int32_t code = e->exit_code;
     proc_free(pid);
     m3ApiReturn(code);
@@ -667,6 +679,29 @@ m3ApiRawFunction(wasm_api_getpid)
     m3ApiReturn(proc->pid);
 }
 
+m3ApiRawFunction(wasm_api_set_priority)
+{
+    m3ApiReturnType(int32_t)
+    m3ApiGetArg(int32_t, pid)
+    m3ApiGetArg(int32_t, priority)
+
+    // Programs may only lower priorities, so a busy loop can't starve the
+    // shell
+    if (priority < SCHED_PRIORITY_DEFAULT || priority > SCHED_PRIORITY_LOWEST)
+        m3ApiReturn(-1);
+
+    // Only the caller itself, as pid 0 or its own pid, or one of its children
+    wasm_process_t *proc = WASM_PROC(_ctx);
+    proc_entry_t *e = proc_get(pid == 0 ? proc->pid : pid);
+    if (!e || e->state != PROC_RUNNING)
+        m3ApiReturn(-1);
+    if (e->pid != proc->pid && e->parent_pid != proc->pid)
+        m3ApiReturn(-1);
+    if (!thread_set_priority(e->thread_id, (uint8_t)priority))
+        m3ApiReturn(-1);
+    m3ApiReturn(0);
+}
+
 /* --- Pipe & Redirection APIs --- */
 
 m3ApiRawFunction(wasm_api_dup2)
@@ -936,6 +971,7 @@ void wasm_link_api(IM3Module module, wasm_process_t *proc)
     m3_LinkRawFunctionEx(module, "env", "print", "v(*i)", &wasm_api_print, proc);
     m3_LinkRawFunctionEx(module, "env", "putchar", "v(i)", &wasm_api_putchar, proc);
     m3_LinkRawFunctionEx(module, "env", "get_ticks", "I()", &wasm_api_get_ticks, proc);
+    m3_LinkRawFunctionEx(module, "env", "get_time_ns", "I()", &wasm_api_get_time_ns, proc);
     m3_LinkRawFunctionEx(module, "env", "exit", "v(i)", &wasm_api_exit, proc);
     m3_LinkRawFunctionEx(module, "env", "get_argc", "i()", &wasm_api_get_argc, proc);
     m3_LinkRawFunctionEx(module, "env", "get_argv", "i(i*i)", &wasm_api_get_argv, proc);
@@ -955,6 +991,7 @@ void wasm_link_api(IM3Module module, wasm_process_t *proc)
     m3_LinkRawFunctionEx(module, "env", "waitpid", "i(i)", &wasm_api_waitpid, proc);
     m3_LinkRawFunctionEx(module, "env", "kill", "i(i)", &wasm_api_kill, proc);
     m3_LinkRawFunctionEx(module, "env", "getpid", "i()", &wasm_api_getpid, proc);
+    m3_LinkRawFunctionEx(module, "env", "set_priority", "i(ii)", &wasm_api_set_priority, proc);
     m3_LinkRawFunctionEx(module, "env", "dup2", "i(ii)", &wasm_api_dup2, proc);
     m3_LinkRawFunctionEx(module, "env", "pipe", "i(*)", &wasm_api_pipe, proc);
     m3_LinkRawFunctionEx(module, "env", "pipe_create", "i()", &wasm_api_pipe_create, proc);
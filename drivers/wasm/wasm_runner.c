@@ -5,6 +5,7 @@
 #include <pipe.h>
 #include <process.h>
 #include <scheduler.h>
+#include <slab.h>
 #include <stdio.h>
 #include <string.h>
 #include <tty.h>
@@ -23,6 +24,17 @@ typedef struct {
     int fd_setup_count;
 } spawn_args_t;
 
+static kmem_cache_t *spawn_args_cache;
+
+void wasm_runner_init(void)
+{
+    // Created at boot, as two CPUs spawning at once could both create it
+    spawn_args_cache =
+        kmem_cache_create("spawn_args", sizeof(spawn_args_t), 0, NULL);
+    if (!spawn_args_cache)
+        log_err("WASM: Failed to create the spawn argument cache");
+}
+
 static void apply_fd_setup(wasm_process_t *proc, fd_setup_entry_t *setups, int count)
 {
     for (int i = 0; i < count; i++) {
@@ -252,7 +264,7 @@ static void wasm_spawn_entry(void *arg)
             proc_set_foreground(entry->parent_pid);
     }
 
-    free(args);
+    kmem_cache_free(spawn_args_cache, args);
 }
 
 static int32_t spawn_common(const char *path, int argc, char **argv,
@@ -263,7 +275,11 @@ static int32_t spawn_common(const char *path, int argc, char **argv,
     if (pid < 0)
         return -1;
 
-    spawn_args_t *args = malloc(sizeof(spawn_args_t));
+    spawn_args_t *args = kmem_cache_alloc(spawn_args_cache);
+    if (!args) {
+        proc_free(pid);
+        return -1;
+    }
     strncpy(args->path, path, sizeof(args->path) - 1);
     args->path[sizeof(args->path) - 1] = '\0';
     args->argc = argc < WASM_MAX_ARGC ? argc : WASM_MAX_ARGC;
@@ -285,10 +301,23 @@ static int32_t spawn_common(const char *path, int argc, char **argv,
         }
     }
 
-    thread_t *t = thread_create(wasm_spawn_entry, args);
+    // The thread can exit before thread_spawn() returns, so the ID is taken
+    // from the spawn rather than the thread
+    uint64_t tid;
     proc_entry_t *entry = proc_get(pid);
+    if (!thread_spawn(wasm_spawn_entry, args, &tid)) {
+        for (int i = 0; i < args->fd_setup_count; i++) {
+            if (args->fd_setup[i].type == FD_SETUP_PIPE_READ)
+                pipe_unref_read(args->fd_setup[i].pipe_id);
+            else if (args->fd_setup[i].type == FD_SETUP_PIPE_WRITE)
+                pipe_unref_write(args->fd_setup[i].pipe_id);
+        }
+        kmem_cache_free(spawn_args_cache, args);
+        proc_free(pid);
+        return -1;
+    }
     if (entry)
-        entry->thread_id = t->id;
+        entry->thread_id = tid;
     if (set_foreground)
         proc_set_foreground(pid);
 
@@ -1,3 +1,6 @@
+#include <stdbool.h>
+
+#include <pci.h>
 #include <uacpi/internal/types.h>
 #include <uacpi/uacpi.h>
 
@@ -20,10 +23,20 @@
 #define ACPI_HID_HPET "PNP0103"
 #define ACPI_HID_AC_ADAPTER "ACPI0003"
 #define ACPI_HID_PROCESSOR_CONTAINER "ACPI0010"
+#define ACPI_HID_PCI_HOST_BRIDGE "PNP0A03"
+#define ACPI_HID_PCIE_HOST_BRIDGE "PNP0A08"
 
 // Run uACPI initialisation functions
 void acpi_init();
 
+// Start the worker that runs uACPI's GPE handlers, pinned to CPU 0
+void acpi_workers_start();
+
+// Find the GSI a PCI device's INTx pin is wired to, from the _PRT of its host
+// bridge. `flags` gets MADT-style polarity and trigger flags. Only devices
+// on a host bridge's own bus are handled, not ones behind PCI bridges.
+bool acpi_pci_route_irq(pci_device_t *dev, uint32_t *gsi, uint16_t *flags);
+
 uacpi_status acpi_poweroff();
 uacpi_status acpi_reboot();
 uacpi_status acpi_suspend();
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ANON_MAX_REGIONS 64
+
+// Anonymous regions reserve virtual space up front and only get zeroed
+// frames mapped in when a page is first touched.
+//
+// Nothing running on a kernel stack may live in a region: a fault on the
+// stack itself can't be delivered without a separate exception stack.
+typedef struct anon_region {
+    bool active;
+    uintptr_t start;
+    uintptr_t end;
+    uint32_t flags;
+    // Whether the virtual range came from vmm_alloc_range()
+    bool owns_range;
+} anon_region_t;
+
+/**
+ * @brief Reserves a demand-zero region in the kernel dynamic window.
+ *
+ * @param size Size of the region in bytes, rounded up to whole pages.
+ * @param flags Page flags used when pages are faulted in.
+ * @return The region, or NULL if the region table or address space is full.
+ */
+anon_region_t *anon_create(size_t size, uint32_t flags);
+
+/**
+ * @brief Turns a fixed, otherwise unused virtual range into a demand-zero
+ * region.
+ */
+anon_region_t *anon_create_at(void *virt_addr, size_t size, uint32_t flags);
+
+/**
+ * @brief Unmaps a region, freeing every committed frame and the address
+ * space.
+ */
+void anon_destroy(anon_region_t *region);
+
+/**
+ * @brief Drops the pages fully inside [addr, addr + size), so they read as
+ * zero again and their frames go back to the PMM.
+ */
+void anon_discard(anon_region_t *region, void *addr, size_t size);
+
+/**
+ * @brief Checks whether an address belongs to the region.
+ */
+bool anon_contains(anon_region_t *region, void *addr);
+
+/**
+ * @brief Commits a zeroed page for a not-present fault inside a region.
+ *
+ * @param addr The faulting address from CR2.
+ * @param error_code The page fault error code.
+ * @return true if the fault was handled and the access can be retried.
+ */
+bool anon_handle_fault(uintptr_t addr, uint64_t error_code);
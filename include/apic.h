@@ -34,11 +34,55 @@
 #define IOAPICARB 0x02
 #define IOREDTBL 0x10
 
+// Redirection entry bits, low dword
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+#define IOAPIC_MAX 8
+// GSIs that can be routed to dynamic vectors at once
+#define IOAPIC_MAX_GSI_VECTORS 64
+
 void apic_init();
 void lapic_eoi();
 uint32_t lapic_read(uint32_t reg);
 void lapic_write(uint32_t reg, uint32_t data);
+uint32_t lapic_get_id();
+
+// Enables the LAPIC of the calling CPU
+void lapic_init_cpu();
+
+// Sends a fixed interrupt to the CPU with the given LAPIC ID
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
+
+// Measures the LAPIC timer against the TSC. Runs once, on the boot CPU.
+void lapic_timer_calibrate();
+
+// Sets up the one-shot scheduler timer on the calling CPU. There is no
+// periodic tick: the scheduler arms the timer for its next event.
+void lapic_timer_start();
+
+// Fires the calling CPU's timer once, `ns` nanoseconds from now
+void lapic_timer_arm(uint64_t ns);
+void lapic_timer_stop();
+bool lapic_timer_active();
+uint64_t lapic_timer_handler(uint64_t rsp);
+
+// Routes a GSI to `vector` on the CPU with LAPIC ID `apic_id`, on whichever
+// I/O APIC serves it. `flags` are MADT polarity and trigger flags.
+bool ioapic_set_gsi(uint32_t gsi, uint32_t apic_id, uint8_t vector, uint16_t flags);
+bool ioapic_mask_gsi(uint32_t gsi, bool masked);
+
+// GSI a legacy ISA IRQ arrives on, after interrupt source overrides
+uint32_t irq_to_gsi(uint8_t irq);
+
+// Sends a GSI, or a legacy IRQ, to the first online CPU in `cpu_mask`,
+// bit n being logical CPU n. Fails if none of them is online.
+bool gsi_set_affinity(uint32_t gsi, uint64_t cpu_mask);
+bool irq_set_affinity(uint8_t irq, uint64_t cpu_mask);
 
-void ioapic_write(uintptr_t base, uint8_t reg, uint32_t data);
-uint32_t ioapic_read(uintptr_t base, uint8_t reg);
-void ioapic_set_irq(uint8_t irq, uint64_t apic_id, uint8_t vector);
+// Gives a GSI beyond the legacy IRQs, such as a PCI INTx line, a dynamic
+// vector and adds a handler to it. GSIs are spread over the online CPUs and
+// shared ones keep their vector. Returns the vector, or -1.
+int irq_install_gsi_handler(uint32_t gsi, uint16_t flags, uint64_t (*handler)(uint64_t, void *), void *ctx);
+void irq_uninstall_gsi_handler(uint32_t gsi, uint64_t (*handler)(uint64_t, void *), void *ctx);
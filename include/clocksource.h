@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// A free-running counter time can be read from
+typedef struct clocksource {
+    const char *name;
+    // Higher is better. Sources that fail their probe aren't rated at all
+    int rating;
+    uint64_t (*read)();
+    uint64_t freq_hz;
+    // Counted by an interrupt handler, so it only advances while interrupts
+    // are enabled
+    bool ticks;
+    // Filled in by clocksource_init(), see cycles_to_ns()
+    uint64_t mult;
+    uint32_t shift;
+} clocksource_t;
+
+/**
+ * @brief Probes the TSC, HPET and PIT and switches to the highest rated one
+ * that works, then reads the CMOS clock once to anchor clock_realtime_ns().
+ * Must run after tsc_init() and acpi_init().
+ *
+ * Before this the PIT is used, so the clock only has ms resolution.
+ */
+void clocksource_init();
+
+/**
+ * @brief Gets the source clock_monotonic_ns() currently reads.
+ */
+const clocksource_t *clocksource_current();
+
+/**
+ * @brief Gets nanoseconds since boot. Never goes backwards, not even across
+ * the switch to a better source in clocksource_init().
+ */
+uint64_t clock_monotonic_ns();
+
+/**
+ * @brief Gets nanoseconds since the Unix epoch, in UTC. Only as accurate as
+ * the CMOS clock at boot, which counts whole seconds.
+ *
+ * @return 0 until clocksource_init() has read the CMOS clock.
+ */
+uint64_t clock_realtime_ns();
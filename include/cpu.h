@@ -7,6 +7,23 @@
 #define CPUID_LEAF_VENDOR_ID 0
 #define CPUID_LEAF_APIC 1
 
+// Page attribute table MSR
+#define MSR_PAT 0x277
+
+// Base of the GS segment, which points at the per-CPU area
+#define MSR_GS_BASE 0xC0000101
+
+// TSC value at which the LAPIC timer fires in TSC-deadline mode
+#define MSR_TSC_DEADLINE 0x6E0
+
+// PAT memory types
+#define PAT_UC 0x00
+#define PAT_WC 0x01
+#define PAT_WT 0x04
+#define PAT_WP 0x05
+#define PAT_WB 0x06
+#define PAT_UC_MINUS 0x07
+
 // Vendor strings from CPUs.
 #define CPUID_VENDOR_AMD "AuthenticAMD"
 #define CPUID_VENDOR_AMD_OLD "AMDisbetter!"
@@ -157,10 +174,13 @@ char get_cpu_vendor();
 void idle();
 bool is_pe_enabled();
 void cpu_init();
+void cpu_init_ap();
 void enable_mce();
+void pat_init();
 void sse_init();
 void tsc_init();
 uint64_t get_ts();
+uint64_t get_tsc_freq();
 void enable_a20();
 cr0_t get_cr0();
 cr2_t get_cr2();
@@ -173,5 +193,9 @@ void set_cr3(cr3_t cr3);
 void set_cr4(cr4_t cr4);
 void set_rflags(rflags_t rflags);
 bool is_apic_enabled();
+bool is_1g_pages_supported();
+bool is_tsc_deadline_supported();
+// The TSC runs at a constant rate in every P-, C- and T-state
+bool is_tsc_invariant();
 static void set_cpu_vendor_id(char *buffer);
 static void set_cpu_model_name(char *buffer);
\ No newline at end of file
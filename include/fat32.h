@@ -1,6 +1,7 @@
 #pragma once
 
 #include <fs.h>
+#include <slab.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -50,6 +51,10 @@ typedef struct {
     uint32_t fat_size_32;
     uint32_t fat_start;
     uint32_t data_start;
+    // Per-mount caches for sector and cluster sized I/O buffers. Clusters too
+    // large for a slab have no cache and come from the PMM instead
+    kmem_cache_t *sector_cache;
+    kmem_cache_t *cluster_cache;
 } fat32_fs_t;
 
 typedef struct {
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <isr.h>
+
+struct cpu;
+struct thread;
+
+// XCR0 state components
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+#define XCR0_OPMASK (1ULL << 5)
+#define XCR0_ZMM_HI256 (1ULL << 6)
+#define XCR0_HI16_ZMM (1ULL << 7)
+#define XCR0_AVX512 (XCR0_OPMASK | XCR0_ZMM_HI256 | XCR0_HI16_ZMM)
+
+/**
+ * @brief Picks the state components to enable and the size of a saved
+ * state, then enables them on the boot CPU. Must run before
+ * scheduler_init().
+ */
+void fpu_init();
+
+/**
+ * @brief Enables the same state components on an application processor.
+ */
+void fpu_init_cpu();
+
+/**
+ * @brief Gets the size of a thread's saved FPU state. Save areas must be
+ * 64-byte aligned.
+ */
+size_t fpu_state_size();
+
+/**
+ * @brief Fills a save area with the state a new thread starts with.
+ */
+void fpu_state_init(void *state);
+
+/**
+ * @brief Device-not-available (#NM) handler. Loads the running thread's
+ * state the first time it uses the FPU since it was switched to.
+ */
+void fpu_nm_handler(interrupt_frame_t *frame);
+
+/**
+ * @brief Makes interrupt and exception handlers trap on FPU use, so the
+ * interrupted thread's registers are saved before a handler touches them.
+ * Called on entry to the outermost handler.
+ */
+void fpu_irq_enter(struct cpu *cpu);
+
+/**
+ * @brief Makes the thread being returned to trap on FPU use if the registers
+ * don't hold its state. Called on exit from the outermost handler.
+ */
+void fpu_irq_exit(struct cpu *cpu);
+
+/**
+ * @brief Prepares the FPU for a voluntary switch to `next`, which doesn't
+ * go through fpu_irq_exit(). Interrupts are disabled.
+ */
+void fpu_switch(struct cpu *cpu, struct thread *next);
@@ -37,6 +37,9 @@ extern fb_viewport_t fb_viewport;
 
 // Initialise the framebuffer
 void fb_init();
+
+// Remap the framebuffer as write-combining, once the VMM is up
+void fb_enable_wc();
 struct limine_framebuffer *get_fb_data();
 
 // Beep
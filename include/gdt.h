@@ -4,7 +4,17 @@
 
 #define GDT_CODE_SEGMENT 0x08
 #define GDT_DATA_SEGMENT 0x10
-#define GDT_ENTRIES 3
+#define GDT_TSS_SEGMENT 0x18
+// Null, code, data, and the two halves of the 16-byte TSS descriptor
+#define GDT_ENTRIES 5
+
+// Interrupt stack table slots. Faults that can happen with a broken kernel
+// stack get a known good stack of their own.
+#define IST_DOUBLE_FAULT 1
+#define IST_NMI 2
+#define IST_MACHINE_CHECK 3
+#define IST_COUNT 3
+#define IST_STACK_SIZE 8192 // 8 KB
 
 typedef struct {
     uint16_t limit_low;
@@ -20,8 +30,34 @@ typedef struct {
     uint64_t base;
 } __attribute__((packed)) gdtr_t;
 
-extern gdt_entry_t gdt[GDT_ENTRIES];
-extern gdtr_t gdtr;
+typedef struct {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed)) tss_t;
+
+struct cpu;
 
+/**
+ * @brief Sets up the GDT and TSS of the boot CPU and points GS at its per-CPU
+ * area.
+ */
 void gdt_init();
-extern void gdt_flush();
\ No newline at end of file
+
+/**
+ * @brief Allocates an application processor's interrupt stacks. Runs on the
+ * boot CPU before the AP is started, so the AP doesn't allocate before its
+ * IDT is loaded.
+ */
+void gdt_alloc_ist_stacks(struct cpu *cpu);
+
+/**
+ * @brief Builds and loads a CPU's own GDT and TSS, then sets its GS base.
+ *
+ * Must run on the CPU being set up, after its interrupt stacks exist.
+ */
+void gdt_load_cpu(struct cpu *cpu);
@@ -1,9 +1,99 @@
+#pragma once
+
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
+// Size of the static region the heap starts out with, before the PMM and VMM
+// are available to grow it
 #define HEAP_SIZE 1024 * 1024 * 16 // 16 MB
 
+// Virtual window the heap grows into once the seed region is full. The whole
+// window is a demand-zero region, so pages are only committed when touched
+#define HEAP_GROW_START 0xFFFFC00000000000
+#define HEAP_GROW_END 0xFFFFC0FFFFFFFFFF
+
+// Granularity the heap grows by
+#define HEAP_GROW_MIN (2 * 1024 * 1024) // 2 MB
+
+// calloc() of at least this many bytes in the growth window drops whole pages
+// instead of clearing them, since they fault back in zeroed
+#define HEAP_CALLOC_DISCARD (16 * 1024) // 16 KB
+
+// Free lists are segregated by power of two: class i holds blocks of
+// 2^(i + HEAP_MIN_CLASS_SHIFT) bytes up to the next power of two, and the
+// last class holds everything larger
+#define HEAP_CLASSES 24
+#define HEAP_MIN_CLASS_SHIFT 5
+
+// Limits of the allocation profiler
+#define HEAP_PROF_MAX_SITES 128
+#define HEAP_PROF_MAX_LIVE 8192 // Must be a power of two
+
+// Allocation statistics for one call site
+typedef struct {
+    uintptr_t caller;
+    uint64_t allocs;
+    uint64_t frees;
+    // Total bytes ever allocated from this site
+    uint64_t bytes;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+    // TSC cycles spent inside malloc() on behalf of this site
+    uint64_t cycles;
+} heap_site_t;
+
+typedef struct {
+    uint64_t free_blocks[HEAP_CLASSES];
+    uint64_t free_bytes[HEAP_CLASSES];
+    uint64_t total_free;
+    uint64_t largest_free;
+} heap_frag_t;
+
 void *malloc(size_t size);
 void free(void *ptr);
 void *realloc(void *ptr, size_t size);
 void heap_init();
-size_t heap_get_used_memory();
\ No newline at end of file
+size_t heap_get_used_memory();
+
+/**
+ * @brief Gets the number of bytes currently managed by the heap, including
+ * the seed region and every page it has grown by.
+ */
+size_t heap_get_total_memory();
+
+/**
+ * @brief Turns allocation tracking on or off.
+ *
+ * While enabled, every allocation is charged to the address malloc(),
+ * calloc() or realloc() was called from. Blocks allocated while tracking was
+ * off are ignored when freed.
+ */
+void heap_profile_enable(bool enable);
+
+bool heap_profile_enabled();
+
+/**
+ * @brief Clears all call sites and forgets every tracked allocation.
+ */
+void heap_profile_reset();
+
+/**
+ * @brief Copies the statistics of one call site slot.
+ *
+ * @param index Slot index, from 0 to HEAP_PROF_MAX_SITES - 1.
+ * @param site Filled with the slot's statistics.
+ * @return false if the slot is unused.
+ */
+bool heap_profile_site(int index, heap_site_t *site);
+
+/**
+ * @brief Gets the number of allocations that went untracked because the
+ * site or live block table was full.
+ */
+uint64_t heap_profile_dropped();
+
+/**
+ * @brief Builds a histogram of free block sizes by size class.
+ */
+void heap_frag_stats(heap_frag_t *stats);
@@ -4,6 +4,19 @@
 
 #define IDT_ENTRIES 256
 
+// Vectors handed out to devices with irq_alloc_vector(), above the legacy
+// IRQs at 0x20-0x2F
+#define VECTOR_DYNAMIC_START 0x30
+#define VECTOR_DYNAMIC_END 0xEF
+#define VECTOR_DYNAMIC_COUNT (VECTOR_DYNAMIC_END - VECTOR_DYNAMIC_START + 1)
+
+// Fixed vectors, kept above the range device interrupts are given
+#define VECTOR_LAPIC_TIMER 0xF0
+#define VECTOR_TLB_SHOOTDOWN 0xF2
+#define VECTOR_CPU_STOP 0xF3
+#define VECTOR_RESCHEDULE 0xF4
+#define VECTOR_SPURIOUS 0xFF
+
 typedef struct {
     uint16_t isr_low;
     uint16_t kernel_cs;
@@ -23,4 +36,6 @@ extern idt_entry_t idt[IDT_ENTRIES];
 extern idtr_t idtr;
 
 void idt_init();
-void idt_load();
\ No newline at end of file
+void idt_load();
+void idt_set_descriptor(uint8_t vector, void *isr, uint8_t flags);
+void idt_set_ist(uint8_t vector, uint8_t ist);
\ No newline at end of file
@@ -16,6 +16,39 @@ void irq_install_handler(uint8_t irq, uint64_t (*handler)(uint64_t, void *),
 void irq_uninstall_handler(uint8_t irq, uint64_t (*handler)(uint64_t, void *),
                            void *ctx);
 uint64_t irq_dispatch(uint64_t rsp, uint8_t irq);
+
+/**
+ * @brief Reserves a vector in VECTOR_DYNAMIC_START-VECTOR_DYNAMIC_END for a
+ * device, e.g. one using MSI. Returns -1 if all are taken.
+ */
+int irq_alloc_vector();
+
+/**
+ * @brief Releases a vector from irq_alloc_vector() along with its handlers.
+ */
+void irq_free_vector(uint8_t vector);
+
+/**
+ * @brief Adds a handler to the chain run for an allocated vector. Unlike
+ * legacy IRQs nothing is unmasked, the device raises the interrupt itself.
+ */
+bool vector_install_handler(uint8_t vector,
+                            uint64_t (*handler)(uint64_t, void *), void *ctx);
+// Returns false if the handler wasn't installed on the vector. Like
+// irq_uninstall_handler() and irq_free_vector() it waits for handlers running
+// on other CPUs, so must not be called from a handler on the same chain
+bool vector_uninstall_handler(uint8_t vector,
+                              uint64_t (*handler)(uint64_t, void *), void *ctx);
+bool vector_has_handlers(uint8_t vector);
+uint64_t vector_dispatch(uint64_t rsp, uint8_t vector);
+
+/**
+ * @brief Bookkeeping around every interrupt and exception handler, called by
+ * the entry stubs with the IDT vector. irq_exit() runs on the stack of the
+ * thread being returned to, which may not be the interrupted one.
+ */
+void irq_enter(uint8_t vector);
+void irq_exit();
 void register_exceptions();
 
 void interrupt_send_eoi(uint8_t irq);
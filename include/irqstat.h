@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct cpu;
+
+// Handler durations are bucketed by log2 of their TSC cycles, the last bucket
+// holding everything longer
+#define IRQSTAT_BUCKETS 24
+// Deepest handler nesting that is timed, deeper handlers are not counted
+#define IRQSTAT_MAX_NESTING 4
+
+// Statistics for one IDT vector, all times in TSC cycles
+typedef struct {
+    uint64_t count;
+    uint64_t total_cycles;
+    uint64_t min_cycles;
+    uint64_t max_cycles;
+    uint64_t histogram[IRQSTAT_BUCKETS];
+} irqstat_vector_t;
+
+// Longest stretch any CPU spent with interrupts disabled
+typedef struct {
+    uint64_t cycles;
+    // Address disable_interrupts() or spinlock_acquire_irqsave() was called
+    // from
+    uintptr_t caller;
+    uint32_t cpu;
+} irqstat_irqoff_t;
+
+/**
+ * @brief Turns interrupt latency tracking on or off. While off the hooks
+ * below only check a flag.
+ */
+void irqstat_enable(bool enable);
+
+bool irqstat_enabled();
+
+/**
+ * @brief Clears every vector's statistics and the longest interrupts-off
+ * window.
+ */
+void irqstat_reset();
+
+/**
+ * @brief Copies the statistics of one vector.
+ * @return false if no handler for the vector was timed.
+ */
+bool irqstat_vector(uint8_t vector, irqstat_vector_t *stats);
+
+void irqstat_irqoff(irqstat_irqoff_t *window);
+
+/**
+ * @brief Converts TSC cycles to nanoseconds, or returns them unchanged if
+ * the TSC frequency isn't known.
+ */
+uint64_t irqstat_cycles_to_ns(uint64_t cycles);
+
+// Handler timing, called from irq_enter() and irq_exit() with the depth the
+// handler runs at
+void irqstat_handler_start(struct cpu *cpu, uint32_t depth, uint8_t vector);
+void irqstat_handler_end(struct cpu *cpu, uint32_t depth);
+
+// Interrupts-off windows. begin is called when interrupts go from enabled to
+// disabled, end just before they are enabled again or the CPU switches to
+// another thread.
+void irqstat_irqoff_begin(uintptr_t caller);
+void irqstat_irqoff_end();
@@ -34,6 +34,14 @@ extern void isr_unhandled();
 extern void isr_security_protection();
 extern void isr_pit();
 extern void isr_keyboard();
+extern void isr_lapic_timer();
+extern void isr_tlb_shootdown();
+extern void isr_reschedule();
+extern void isr_cpu_stop();
+extern void isr_spurious();
+
+// Entry stubs for VECTOR_DYNAMIC_START onwards, one per vector
+extern void *const isr_vector_stubs[];
 
 static const char *exceptions[] = {
     "Divide Error",
@@ -70,6 +78,7 @@ static const char *exceptions[] = {
     "Reserved",
 };
 
+uint64_t tlb_shootdown_handler(uint64_t rsp);
 void page_fault_handler(interrupt_frame_t *frame);
 void double_fault_handler(interrupt_frame_t *frame);
 void gpf_handler(interrupt_frame_t *frame);
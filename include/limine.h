@@ -6,5 +6,6 @@ extern volatile struct limine_framebuffer_request framebuffer_request;
 extern volatile struct limine_rsdp_request rsdp_request;
 extern volatile struct limine_hhdm_request hhdm_request;
 extern volatile struct limine_memmap_request memmap_request;
+extern volatile struct limine_mp_request mp_request;
 
 void limine_init();
\ No newline at end of file
@@ -1,7 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef struct {
     volatile int lock;
     char *name;
 } spinlock_t;
 
 void spinlock_acquire(spinlock_t *lp);
-void spinlock_release(spinlock_t *lp);
\ No newline at end of file
+void spinlock_release(spinlock_t *lp);
+
+// Takes the lock only if it is free, returning whether it was taken
+bool spinlock_try_acquire(spinlock_t *lp);
+
+// Disables interrupts before taking the lock and returns the previous RFLAGS,
+// so the lock can be used from both thread and interrupt context
+uint64_t spinlock_acquire_irqsave(spinlock_t *lp);
+void spinlock_release_irqrestore(spinlock_t *lp, uint64_t flags);
@@ -1,10 +1,55 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define PCI_CONFIG_ADDRESS 0xCF8
 #define PCI_CONFIG_DATA 0xCFC
 
+// Configuration space registers
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_CAP_PTR 0x34
+
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAP_LIST (1 << 4)
+
+// Capability IDs
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_MSIX 0x11
+
+// MSI capability, offsets from its start
+#define PCI_MSI_CONTROL 0x02
+#define PCI_MSI_ADDR_LOW 0x04
+#define PCI_MSI_ADDR_HIGH 0x08
+#define PCI_MSI_DATA_32 0x08
+#define PCI_MSI_DATA_64 0x0C
+
+#define PCI_MSI_CONTROL_ENABLE (1 << 0)
+#define PCI_MSI_CONTROL_MME_MASK (7 << 4)
+#define PCI_MSI_CONTROL_64BIT (1 << 7)
+
+// MSI-X capability, offsets from its start
+#define PCI_MSIX_CONTROL 0x02
+#define PCI_MSIX_TABLE 0x04
+
+#define PCI_MSIX_CONTROL_SIZE_MASK 0x7FF
+#define PCI_MSIX_CONTROL_MASK_ALL (1 << 14)
+#define PCI_MSIX_CONTROL_ENABLE (1 << 15)
+#define PCI_MSIX_TABLE_BIR_MASK 0x7
+
+// MSI-X table entry layout
+#define PCI_MSIX_ENTRY_SIZE 16
+#define PCI_MSIX_ENTRY_ADDR_LOW 0x0
+#define PCI_MSIX_ENTRY_ADDR_HIGH 0x4
+#define PCI_MSIX_ENTRY_DATA 0x8
+#define PCI_MSIX_ENTRY_CONTROL 0xC
+#define PCI_MSIX_ENTRY_MASKED (1 << 0)
+
+// Message address for a fixed, physical-destination interrupt
+#define MSI_ADDRESS_BASE 0xFEE00000
+#define MSI_ADDRESS_DEST_SHIFT 12
+
 typedef struct {
     uint16_t vendor_id;
     uint16_t device_id;
@@ -15,6 +60,10 @@ typedef struct {
     uint8_t bus;
     uint8_t device;
     uint8_t function;
+    // Mapped MSI-X table and its number of entries, set up by the first
+    // pci_enable_msix()
+    volatile uint8_t *msix_table;
+    uint16_t msix_count;
 } pci_device_t;
 uint8_t pci_read_byte(uint8_t bus, uint8_t device, uint8_t function,
                       uint8_t offset);
@@ -36,4 +85,49 @@ pci_device_t pci_get_device(uint8_t class_code, uint8_t subclass,
 
 uint64_t pci_get_bar_address(pci_device_t *dev, uint8_t bar_num);
 
+/**
+ * @brief Walks the device's capability list.
+ * @return Config space offset of the first capability with ID `cap_id`, or 0
+ * if the device doesn't have one.
+ */
+uint8_t pci_find_capability(pci_device_t *dev, uint8_t cap_id);
+
+/**
+ * @brief Routes the device's MSI to `vector` on the CPU with LAPIC ID
+ * `apic_id`, and turns off its legacy INTx interrupt. Only one message is
+ * enabled.
+ * @return false if the device has no MSI capability.
+ */
+bool pci_enable_msi(pci_device_t *dev, uint8_t vector, uint32_t apic_id);
+
+/**
+ * @brief Routes the device's legacy INTx pin, through its host bridge's _PRT,
+ * to a dynamic vector and adds a handler to it. For devices without MSI.
+ * `gsi`, if not NULL, gets the GSI to pass to irq_uninstall_gsi_handler().
+ * @return The vector, or -1 if the pin can't be routed.
+ */
+int pci_install_intx_handler(pci_device_t *dev,
+                             uint64_t (*handler)(uint64_t, void *), void *ctx,
+                             uint32_t *gsi);
+
+/**
+ * @brief Number of entries in the device's MSI-X table, 0 without MSI-X.
+ */
+uint16_t pci_msix_count(pci_device_t *dev);
+
+/**
+ * @brief Routes MSI-X table entry `entry` to `vector` on the CPU with LAPIC ID
+ * `apic_id` and unmasks it. The first call enables MSI-X and turns off the
+ * legacy INTx interrupt, so each entry must be set before the device uses it.
+ * @return false if the device has no MSI-X capability or no such entry.
+ */
+bool pci_enable_msix(pci_device_t *dev, uint16_t entry, uint8_t vector,
+                     uint32_t apic_id);
+
+/**
+ * @brief Masks or unmasks a single MSI-X table entry.
+ * @return false if MSI-X isn't enabled or there is no such entry.
+ */
+bool pci_msix_mask(pci_device_t *dev, uint16_t entry, bool masked);
+
 void pci_scan_bus();
\ No newline at end of file
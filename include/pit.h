@@ -2,6 +2,8 @@
 #include <stdint.h>
 
 #define PIT_BASE_FREQUENCY 1193182
+// Rate of the channel 0 interrupt, and so of pit_ticks
+#define PIT_FREQUENCY 1000
 #define PIT_CMD_PORT 0x43
 #define PIT_CHANNEL0_DATA_PORT 0x40
 #define PIT_CHANNEL2_DATA_PORT 0x42
@@ -9,9 +11,15 @@
 
 extern volatile uint64_t pit_ticks;
 extern bool pit_initialised;
+// Set once pit_stop() has silenced channel 0
+extern bool pit_stopped;
 
 void pit_init();
 
+// Stops the channel 0 interrupt for good, once the LAPIC timers drive
+// scheduling and the clock no longer counts PIT ticks
+void pit_stop();
+
 // PIT interrupt handler
 uint64_t pit_handler(uint64_t rsp);
 
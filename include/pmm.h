@@ -3,6 +3,26 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Largest buddy block is 2^PMM_MAX_ORDER pages (4 MiB)
+#define PMM_MAX_ORDER 10
+
+// Number of pre-zeroed frames kept for pmm_alloc_zeroed_page() (1 MiB)
+#define PMM_ZERO_POOL_SIZE 256
+
+typedef struct {
+    uint64_t total_pages;
+    uint64_t free_pages;
+    // Neither free nor in the zero pool. A batch the zeroing thread is
+    // still clearing counts as used
+    uint64_t used_pages;
+    // Longest run of physically contiguous free pages
+    uint64_t largest_free_run;
+    // Number of free buddy blocks of each order
+    uint64_t free_blocks[PMM_MAX_ORDER + 1];
+    // Pages sitting in the zero pool, ready to hand out
+    uint64_t zeroed_pages;
+} pmm_stats_t;
+
 /**
  * @brief Allocates a single physical page of memory.
  *
@@ -11,6 +31,18 @@
  */
 void *pmm_alloc_page();
 
+/**
+ * @brief Allocates a single physical page that is filled with zeroes.
+ *
+ * Pages come from a pool cleared ahead of time by a background thread, so
+ * the caller doesn't pay for the clearing. Falls back to clearing a fresh
+ * page when the pool is empty.
+ *
+ * @return The physical address of the page, or NULL if no pages are
+ * available.
+ */
+void *pmm_alloc_zeroed_page();
+
 /**
  * @brief Frees a previously allocated physical page.
  *
@@ -18,7 +50,43 @@ void *pmm_alloc_page();
  */
 void pmm_free_page(void *page_addr);
 
+/**
+ * @brief Allocates 2^order physically contiguous pages.
+ *
+ * The returned block is naturally aligned to its own size.
+ *
+ * @param order The base-2 logarithm of the number of pages to allocate.
+ * @return The physical address of the first page, or NULL if no block of that
+ * size is available.
+ */
+void *pmm_alloc_pages(uint8_t order);
+
+/**
+ * @brief Frees a block previously returned by pmm_alloc_pages().
+ *
+ * @param page_addr The physical address of the first page of the block.
+ * @param order The order the block was allocated with.
+ */
+void pmm_free_pages(void *page_addr, uint8_t order);
+
+/**
+ * @brief Returns the smallest order whose block can hold size bytes.
+ */
+uint8_t pmm_order_for_size(size_t size);
+
+/**
+ * @brief Takes a consistent snapshot of physical memory usage.
+ *
+ * @param stats Filled with the current page counts.
+ */
+void pmm_stats(pmm_stats_t *stats);
+
 /**
  * @brief Initializes the physical memory manager using the memory map.
  */
-void pmm_init();
\ No newline at end of file
+void pmm_init();
+
+/**
+ * @brief Starts the background thread that keeps the zero pool filled.
+ */
+void pmm_zero_thread_start();
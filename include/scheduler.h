@@ -1,7 +1,21 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include <timer.h>
+#include <waitqueue.h>
+
+struct cpu;
+
+// Priority levels, 0 being the most urgent. Threads start at their base
+// priority, sink one level each time they use up a whole time slice, and
+// return to it when they wake up or at the periodic boost.
+#define SCHED_PRIORITIES 8
+#define SCHED_PRIORITY_HIGHEST 0
+#define SCHED_PRIORITY_DEFAULT 2
+#define SCHED_PRIORITY_LOWEST (SCHED_PRIORITIES - 1)
+
 typedef enum {
     THREAD_STATE_READY,
     THREAD_STATE_RUNNING,
@@ -11,18 +25,137 @@ typedef enum {
 
 typedef struct thread {
     uint64_t rsp; // Stack pointer - MUST be first
+    // Whether rsp points at a context_switch() frame, left by blocking or
+    // yielding, rather than an interrupt frame
+    bool voluntary;
     uint64_t id;
     thread_state_t state;
     void *stack_base;
+    // XSAVE area, loaded the first time the thread uses the FPU after a
+    // switch
+    void *fpu_state;
+    // CPU whose run queue the thread belongs to
+    uint32_t cpu;
+    // Pinned threads are never stolen by another CPU
+    bool pinned;
+    // get_ts() when the thread last stopped running, for cache affinity
+    uint64_t last_run;
+    // Base priority, and the level the thread currently runs at
+    uint8_t priority;
+    uint8_t level;
+    // Running time in ns left before the thread drops a level
+    uint64_t slice;
+    // Links in that CPU's run queue while the thread is ready, and in the
+    // reaper's list or the free pool once it has exited
     struct thread *next;
+    struct thread *prev;
+    // Link in its bucket of the thread table, used for lookups by ID
+    struct thread *hash_next;
+    // Wakes the thread from thread_sleep_ns()
+    timer_event_t sleep_timer;
+    // Links the thread into the wait queue it sleeps on
+    wq_node_t wait_node;
+    // Woken when the thread exits
+    waitqueue_t exit_wq;
 } thread_t;
 
 void scheduler_init();
+
+/**
+ * @brief Creates a thread and queues it on the least loaded CPU.
+ *
+ * Threads are reclaimed some time after they exit, so callers should keep
+ * the thread's ID rather than the pointer.
+ */
 thread_t *thread_create(void (*entry)(void *), void *arg);
+
+/**
+ * @brief Creates a thread pinned to a specific CPU.
+ *
+ * @param cpu Logical CPU index. If it is not online the thread goes to the
+ * least loaded CPU and is not pinned.
+ */
+thread_t *thread_create_on_cpu(void (*entry)(void *), void *arg,
+                               uint32_t cpu);
+
+/**
+ * @brief Like thread_create(), but stores the new thread's ID in id before
+ * the thread can run, for threads that may exit at any time.
+ *
+ * @return false if the thread couldn't be allocated.
+ */
+bool thread_spawn(void (*entry)(void *), void *arg, uint64_t *id);
+
+/**
+ * @brief Gives up the CPU to the next ready thread. A thread that has marked
+ * itself blocked stays off the run queues until it is unblocked.
+ *
+ * Only callee-saved registers are saved, so this is much cheaper than being
+ * preempted. Does nothing before the scheduler is started.
+ */
 void scheduler_yield();
+
+// Timer interrupt: charges the running thread and switches when its slice is
+// used up or a more urgent thread is ready
 uint64_t scheduler_schedule(uint64_t current_rsp);
+
+// Reschedule IPI, sent when a thread is queued on a CPU that is idle or
+// running something less urgent
+uint64_t scheduler_reschedule_handler(uint64_t current_rsp);
 void scheduler_start();
 void thread_cancel(uint64_t id);
+thread_t *scheduler_get_current(void);
 uint64_t scheduler_get_current_id(void);
 void scheduler_block_current(void);
 void scheduler_unblock(uint64_t id);
+
+/**
+ * @brief Makes a blocked thread ready again. Unlike scheduler_unblock() there
+ * is no lookup, so the caller must know the thread can't be reclaimed, for
+ * instance by holding the lock of the wait queue it sleeps on.
+ */
+void scheduler_wake(thread_t *thread);
+
+/**
+ * @brief Blocks until the thread with the given ID has exited. Returns at
+ * once if there is no such thread.
+ */
+void wait_for_thread(uint64_t id);
+
+/**
+ * @brief Whether the caller is a thread that may block: the scheduler is
+ * running, interrupts are enabled and this isn't an idle loop.
+ */
+bool thread_can_sleep();
+
+/**
+ * @brief Blocks the calling thread for at least `ns` nanoseconds, leaving the
+ * CPU to other threads. Falls back to spinning when the caller can't sleep.
+ */
+void thread_sleep_ns(uint64_t ns);
+
+/**
+ * @brief Reprograms the calling CPU's timer after its earliest timer event
+ * changed.
+ */
+void scheduler_rearm_timer();
+
+/**
+ * @brief Sets a thread's base priority and moves it to that level right away.
+ *
+ * @param priority SCHED_PRIORITY_HIGHEST to SCHED_PRIORITY_LOWEST.
+ * @return false if the thread doesn't exist or the priority is out of range.
+ */
+bool thread_set_priority(uint64_t id, uint8_t priority);
+
+/**
+ * @brief Gives an application processor its idle thread. The idle thread
+ * runs on the stack the CPU was started with.
+ */
+void scheduler_init_ap(struct cpu *cpu);
+
+/**
+ * @brief Turns the caller into the CPU's idle loop. Called at the end of
+ * application processor start-up.
+ */
+__attribute__((noreturn)) void scheduler_idle();
@@ -24,6 +24,10 @@ void cmd_history(int argc, char **argv);
 void cmd_sysinfo(int argc, char **argv);
 void cmd_susinfo(int argc, char **argv);
 void cmd_meminfo(int argc, char **argv);
+void cmd_slabinfo(int argc, char **argv);
+void cmd_memprof(int argc, char **argv);
+void cmd_heapfrag(int argc, char **argv);
+void cmd_irqstat(int argc, char **argv);
 void cmd_fbtest(int argc, char **argv);
 void cmd_memtest(int argc, char **argv);
 void cmd_lsblk(int argc, char **argv);
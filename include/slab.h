@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lock.h>
+
+#define KMEM_MAX_CACHES 32
+#define KMEM_NAME_LEN 24
+
+// Largest slab is 2^KMEM_MAX_SLAB_ORDER pages
+#define KMEM_MAX_SLAB_ORDER 5
+
+typedef struct slab slab_t;
+
+typedef struct kmem_cache {
+    char name[KMEM_NAME_LEN];
+    bool active;
+    size_t obj_size;
+    size_t align;
+    // Distance between objects, including the free list link when a
+    // constructor is used
+    size_t stride;
+    // Offset of the free list link within a free object
+    size_t link_offset;
+    size_t first_obj_offset;
+    uint8_t slab_order;
+    uint32_t objs_per_slab;
+    void (*ctor)(void *obj);
+
+    slab_t *partial;
+    slab_t *full;
+    slab_t *empty;
+    spinlock_t lock;
+
+    uint64_t slab_count;
+    uint64_t objs_in_use;
+    uint64_t total_allocs;
+    uint64_t total_frees;
+} kmem_cache_t;
+
+/**
+ * @brief Creates a cache of fixed-size objects backed by PMM pages.
+ *
+ * @param name Name shown in statistics.
+ * @param size Size of each object in bytes.
+ * @param align Required alignment of each object, or 0 for pointer alignment.
+ * @param ctor Optional constructor, run once for each object when its slab is
+ * created. Objects must be returned to the cache in their constructed state.
+ * @return The new cache, or NULL if the cache table is full or the object is
+ * too large for a slab.
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *obj));
+
+/**
+ * @brief Destroys a cache and returns all of its slabs to the PMM.
+ *
+ * Every object must have been freed back to the cache first.
+ */
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+/**
+ * @brief Allocates one object from the cache.
+ *
+ * @return The object, or NULL if no memory is available.
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+/**
+ * @brief Returns an object to the cache it was allocated from.
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/**
+ * @brief Gets a cache by its index in the cache table, for statistics.
+ *
+ * @return The cache, or NULL if the slot is unused.
+ */
+kmem_cache_t *kmem_cache_get(int index);
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gdt.h>
+#include <irqstat.h>
+#include <lock.h>
+#include <scheduler.h>
+#include <timer.h>
+
+#define MAX_CPUS 64
+
+struct thread;
+
+// Per-CPU area. GS points at the running CPU's entry, so it can always find
+// its own data without knowing its index.
+typedef struct cpu {
+    struct cpu *self; // Must be first, read through %gs:0
+    uint32_t id;
+    uint32_t lapic_id;
+    volatile bool online;
+
+    gdt_entry_t gdt[GDT_ENTRIES];
+    gdtr_t gdtr;
+    tss_t tss;
+    void *ist_stacks[IST_COUNT];
+
+    // Scheduler state, owned by kernel/scheduler.c
+    struct thread *current;
+    struct thread *idle;
+    struct thread *run_head[SCHED_PRIORITIES];
+    struct thread *run_tail[SCHED_PRIORITIES];
+    // Bit n is set while level n has ready threads
+    uint32_t run_bitmap;
+    uint32_t run_count;
+    // get_ts() at the last priority boost, and when the running thread was
+    // last charged for its time slice
+    uint64_t last_boost;
+    uint64_t slice_start;
+    spinlock_t run_lock;
+    // Pending timer events, a min-heap on the deadline owned by sys/timer.c
+    struct timer_event *timers[TIMER_MAX_PENDING];
+    uint32_t timer_count;
+    spinlock_t timer_lock;
+
+    // Thread this CPU last switched away from, whose stack it may still be
+    // using until it schedules again
+    struct thread *switched_from;
+
+    // Thread whose FPU state the registers hold, owned by x86/fpu.c
+    struct thread *fpu_owner;
+    // Depth of interrupt and exception handlers running on this CPU
+    uint32_t irq_nesting;
+
+    // Bit n is set while softirq n is pending, owned by kernel/softirq.c
+    uint32_t softirq_pending;
+    struct thread *ksoftirqd;
+
+    // Handler and interrupts-off timing, owned by x86/irqstat.c
+    uint64_t irqstat_start[IRQSTAT_MAX_NESTING];
+    uint32_t irqstat_epoch[IRQSTAT_MAX_NESTING];
+    uint8_t irqstat_vector[IRQSTAT_MAX_NESTING];
+    uint64_t irqoff_start;
+    uintptr_t irqoff_caller;
+    uint32_t irqoff_epoch;
+} cpu_t;
+
+// Set while another CPU is waiting for TLB flushes to be acknowledged
+extern volatile uint64_t smp_tlb_pending;
+
+static inline cpu_t *this_cpu()
+{
+    cpu_t *cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+/**
+ * @brief Gets the per-CPU area of the boot processor, which is usable before
+ * the other CPUs are started.
+ */
+cpu_t *smp_bsp();
+
+/**
+ * @brief Gets a CPU by its logical index.
+ *
+ * @return The CPU, or NULL if the index is out of range or the CPU is not
+ * online.
+ */
+cpu_t *smp_get_cpu(uint32_t id);
+
+/**
+ * @brief Gets the number of CPU indices handed out, including the boot
+ * processor. Indices of CPUs that failed to start are skipped by
+ * smp_get_cpu().
+ */
+uint32_t smp_cpu_count();
+
+/**
+ * @brief Starts every application processor Limine reports.
+ *
+ * Each one gets its own GDT, TSS, LAPIC setup, idle thread and run queue,
+ * then starts taking threads from the scheduler.
+ */
+void smp_init();
+
+/**
+ * @brief Invalidates a range of kernel addresses on every other CPU and waits
+ * until all of them have done so.
+ *
+ * The caller must already have flushed its own TLB, and must not hold a lock
+ * that the other CPUs may be spinning on with interrupts disabled.
+ */
+void smp_tlb_shootdown(uintptr_t virt, size_t num_pages);
+
+/**
+ * @brief Handles a TLB flush request addressed to this CPU, if there is one.
+ * Called from spin loops so CPUs waiting with interrupts disabled still
+ * answer.
+ */
+void smp_tlb_poll();
+
+/**
+ * @brief Halts every other CPU, for use when the system is going down.
+ */
+void smp_stop_others();
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+struct cpu;
+
+// Bottom halves, run in this order when several are pending
+enum softirq_type {
+    SOFTIRQ_INPUT = 0,
+    SOFTIRQ_COUNT
+};
+
+/**
+ * @brief Sets the function run for a softirq. Handlers run in the
+ * ksoftirqd thread of the CPU that raised them, with interrupts enabled, or
+ * straight from the interrupt exit path before those threads exist.
+ */
+void softirq_register(enum softirq_type type, void (*handler)());
+
+/**
+ * @brief Marks a softirq pending on the calling CPU. Safe from interrupt
+ * handlers, which is where it is normally raised.
+ */
+void softirq_raise(enum softirq_type type);
+
+/**
+ * @brief Hands pending softirqs to the CPU's ksoftirqd thread. Called by
+ * irq_exit() on the way out of the outermost handler.
+ */
+void softirq_irq_exit(struct cpu *cpu);
+
+/**
+ * @brief Starts a ksoftirqd thread pinned to each online CPU.
+ */
+void softirq_start();
@@ -9,5 +9,6 @@ void *calloc(size_t nmemb, size_t size);
 
 void heap_init();
 size_t heap_get_used_memory();
+size_t heap_get_total_memory();
 
 void __attribute__((noreturn)) abort(void);
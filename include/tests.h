@@ -18,6 +18,9 @@ void invalid_opcode_test();
 void list_acpi_devices();
 void popup_test();
 void apic_test();
+void pmm_buddy_test();
+void slab_cache_test();
+void demand_paging_test();
 
 static const menu_t tests[] = {
     {"Thread test", &thread_test},
@@ -36,4 +39,7 @@ static const menu_t tests[] = {
     {"List all ACPI devices", &list_acpi_devices},
     {"Popup test", &popup_test},
     {"APIC test", &apic_test},
+    {"PMM buddy test", &pmm_buddy_test},
+    {"Slab cache test", &slab_cache_test},
+    {"Demand paging test", &demand_paging_test},
 };
\ No newline at end of file
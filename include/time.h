@@ -14,6 +14,10 @@ typedef struct datetime {
 
 datetime_t get_datetime();
 
+// Converts between a UTC datetime and seconds since the Unix epoch
+uint64_t datetime_to_unix(const datetime_t *dt);
+datetime_t unix_to_datetime(uint64_t seconds);
+
 void set_timezone(int offset_hours);
 int get_timezone();
 void set_daylight_savings(bool enabled);
@@ -1,5 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+// Pending events each CPU can hold
+#define TIMER_MAX_PENDING 128
+
+// A one-shot callback run from the timer interrupt of the CPU it was added
+// on. The caller owns the memory, which must stay valid while it is pending.
+typedef struct timer_event {
+    uint64_t deadline; // get_ts() value to fire at
+    void (*callback)(void *arg);
+    void *arg;
+    uint32_t cpu;
+    int32_t index; // Slot in the CPU's heap, -1 while not pending
+} timer_event_t;
+
+void timer_event_init(timer_event_t *event, void (*callback)(void *),
+                      void *arg);
+
+/**
+ * @brief Queues an event on the calling CPU.
+ *
+ * @param deadline get_ts() value after which the callback runs, with
+ * interrupts disabled.
+ * @return false if the CPU's event heap is full.
+ */
+bool timer_event_add(timer_event_t *event, uint64_t deadline);
+
+/**
+ * @brief Removes a pending event.
+ *
+ * @return false if the event already fired or was never added.
+ */
+bool timer_event_cancel(timer_event_t *event);
+
+/**
+ * @brief Runs the calling CPU's expired events. Called from the timer
+ * interrupt.
+ */
+void timer_run_expired();
+
+/**
+ * @brief Gets the deadline of the calling CPU's earliest event, or
+ * UINT64_MAX if it has none.
+ */
+uint64_t timer_next_deadline();
 
+// Waits that last longer than a few microseconds block the calling thread
+// when it can sleep, and fall back to polling in early boot, interrupt
+// handlers and with interrupts disabled
 void wait_ms(uint64_t ms);
 void wait_us(uint64_t us);
-void wait_ns(uint64_t ns);
\ No newline at end of file
+void wait_ns(uint64_t ns);
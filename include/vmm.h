@@ -1,11 +1,16 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 // Common page size for x86 architectures
 #define PAGE_SIZE 4096
 
+// Large page sizes, used automatically for suitably aligned mappings
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+
 // --- Page Table / Page Directory Entry Flags ---
 // These correspond to the bits in a page table entry.
 
@@ -16,6 +21,12 @@
 // Set if the page is accessible from user mode
 #define VMM_USER (1 << 2)
 
+// Cache types, selected through the PAT entries programmed by pat_init().
+// Without any of these the page is write-back.
+#define VMM_WT (1 << 3)               // Write-through (PWT)
+#define VMM_UC ((1 << 3) | (1 << 4))  // Uncached (PWT | PCD)
+#define VMM_WC ((1 << 3) | (1 << 7))  // Write-combining (PWT | PAT)
+
 #define KERNEL_DYNAMIC_START 0xFFFF900000000000
 #define KERNEL_DYNAMIC_END 0xFFFFBFFFFFFFFFFF
 
@@ -46,4 +57,53 @@ void *virt_to_phys(void *virt_addr);
 
 // Helper to convert virtual address to physical by walking the page tables
 void *vmm_get_phys(void *virt_addr);
-void *find_free_virt_pages(size_t num_pages);
\ No newline at end of file
+
+/**
+ * @brief Reserves a range of virtual pages in the kernel dynamic window.
+ *
+ * @param num_pages The number of pages to reserve.
+ * @return The start of the range, or NULL if no free range is large enough.
+ */
+void *vmm_alloc_range(size_t num_pages);
+
+/**
+ * @brief Like vmm_alloc_range(), but the start is a multiple of `align`, a
+ * power of two no smaller than PAGE_SIZE. mmap_physical() uses this so large
+ * physical regions can be mapped with 2 MiB or 1 GiB pages.
+ */
+void *vmm_alloc_range_aligned(size_t num_pages, uint64_t align);
+
+/**
+ * @brief Unmaps a range from the dynamic window and makes it available to
+ * vmm_alloc_range() again.
+ */
+void vmm_free_range(void *virt_addr, size_t num_pages);
+
+/**
+ * @brief Maps physically contiguous pages to a virtual range.
+ *
+ * @return true on success. On failure nothing in the range is left mapped.
+ */
+bool vmm_map_range(void *virt_addr, void *phys_addr, size_t num_pages,
+                   uint32_t flags);
+
+/**
+ * @brief Changes the flags of every mapped page in a range, splitting large
+ * pages that are only partly covered.
+ *
+ * @return false if a page table for a split could not be allocated.
+ */
+bool vmm_protect_range(void *virt_addr, size_t num_pages, uint32_t flags);
+
+/**
+ * @brief Unmaps a virtual range, flushing the TLB for each page and freeing
+ * page tables that no longer map anything. The frames themselves are not
+ * freed.
+ */
+void vmm_unmap_range(void *virt_addr, size_t num_pages);
+
+/**
+ * @brief Like vmm_unmap_range(), but also returns the frames that were mapped
+ * to the PMM. Only for memory the caller allocated from the PMM itself.
+ */
+void vmm_release_range(void *virt_addr, size_t num_pages);
\ No newline at end of file
@@ -2,16 +2,47 @@
 
 #include <stdint.h>
 
+#include <lock.h>
+
+struct thread;
+struct waitqueue;
+
+// Wait node embedded in every thread. A thread sleeps on at most one queue
+// at a time, so nothing is allocated to wait.
 typedef struct wq_node {
-    uint64_t thread_id;
+    struct thread *thread;
     struct wq_node *next;
+    struct wq_node *prev;
+    // Queue the node is linked into, NULL while the thread isn't waiting
+    struct waitqueue *queue;
 } wq_node_t;
 
-typedef struct {
+typedef struct waitqueue {
     wq_node_t *head;
+    wq_node_t *tail;
+    spinlock_t lock;
 } waitqueue_t;
 
 void waitqueue_init(waitqueue_t *wq);
 void waitqueue_sleep(waitqueue_t *wq);
+
+/**
+ * @brief Sleeps on a queue whose lock the caller already holds, so a
+ * condition checked under the lock can't change before the thread is queued.
+ *
+ * @param flags Returned by spinlock_acquire_irqsave() for the queue's lock,
+ * which is released before this returns.
+ */
+void waitqueue_sleep_locked(waitqueue_t *wq, uint64_t flags);
 void waitqueue_wake_one(waitqueue_t *wq);
 void waitqueue_wake_all(waitqueue_t *wq);
+
+// Wakeups for callers that already hold the queue's lock
+void waitqueue_wake_one_locked(waitqueue_t *wq);
+void waitqueue_wake_all_locked(waitqueue_t *wq);
+
+/**
+ * @brief Takes a node off whatever queue it is on, for a thread that stopped
+ * waiting without being woken through the queue.
+ */
+void waitqueue_cancel(wq_node_t *node);
@@ -20,6 +20,8 @@ typedef struct {
     char path[64];
 } fd_setup_entry_t;
 
+// Sets up what spawning needs, before any process can be spawned
+void wasm_runner_init(void);
 int wasm_run_file(const char *path, int argc, char **argv);
 int32_t wasm_spawn(const char *path, int argc, char **argv, int32_t parent_pid);
 int32_t wasm_spawn_redirected(const char *path, int argc, char **argv,
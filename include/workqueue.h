@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <timer.h>
+#include <waitqueue.h>
+
+// Workers of a queue started with this may run on any CPU
+#define WORKQUEUE_ANY_CPU UINT32_MAX
+
+// A function to run later in a worker thread. The caller owns the memory,
+// which must stay valid until the function has started.
+typedef struct work {
+    void (*func)(void *arg);
+    void *arg;
+    struct work *next;
+    bool pending;
+} work_t;
+
+// Work queued once a timer expires
+typedef struct delayed_work {
+    work_t work;
+    timer_event_t timer;
+    struct workqueue *wq;
+} delayed_work_t;
+
+struct worker;
+
+typedef struct workqueue {
+    const char *name;
+    work_t *head;
+    work_t *tail;
+    // Idle workers sleep here. Its lock also protects everything below.
+    waitqueue_t idle;
+    // Items ever queued and ever taken by a worker. Items are taken in
+    // order, so the one taken n-th was the n-th queued.
+    uint64_t queued;
+    uint64_t started;
+    struct worker *workers;
+    waitqueue_t flushers;
+} workqueue_t;
+
+// Shared queue with one worker per CPU, for work that doesn't need its own
+extern workqueue_t system_wq;
+
+/**
+ * @brief Sets up an empty queue. Work can be queued right away and runs once
+ * workers are started.
+ */
+void workqueue_init(workqueue_t *wq, const char *name);
+
+/**
+ * @brief Starts worker threads for a queue. Needs the scheduler.
+ *
+ * @param cpu CPU to pin every worker to, or WORKQUEUE_ANY_CPU.
+ * @return false if not every worker could be created.
+ */
+bool workqueue_start(workqueue_t *wq, uint32_t workers, uint32_t cpu);
+
+/**
+ * @brief Starts system_wq with one worker pinned to each CPU.
+ */
+void workqueue_start_system();
+
+void work_init(work_t *work, void (*func)(void *), void *arg);
+
+/**
+ * @brief Queues work to run in one of the queue's workers. Safe to call from
+ * interrupt handlers.
+ *
+ * @return false if the work was already queued and hasn't started yet.
+ */
+bool queue_work(workqueue_t *wq, work_t *work);
+
+/**
+ * @brief Waits until everything queued before the call has finished. Work
+ * queued later, including delayed work whose timer is still pending, isn't
+ * waited for.
+ */
+void workqueue_flush(workqueue_t *wq);
+
+void delayed_work_init(delayed_work_t *dwork, void (*func)(void *),
+                       void *arg);
+
+/**
+ * @brief Queues work once `delay_ns` has passed. The timer runs on the
+ * calling CPU.
+ *
+ * @return false if the work is already waiting on its timer or queued, or
+ * the CPU has no free timer slot.
+ */
+bool queue_delayed_work(workqueue_t *wq, delayed_work_t *dwork,
+                        uint64_t delay_ns);
+
+/**
+ * @brief Stops delayed work whose timer hasn't expired yet.
+ *
+ * @return true if the timer was pending.
+ */
+bool cancel_delayed_work(delayed_work_t *dwork);
@@ -1,15 +1,47 @@
 #include <cpu.h>
+#include <irqstat.h>
 #include <lock.h>
 #include <prediction.h>
+#include <smp.h>
 
 void spinlock_acquire(spinlock_t *lp)
 {
     while (unlikely(__atomic_test_and_set(&lp->lock, __ATOMIC_ACQUIRE))) {
+        // The holder may be waiting on us to flush our TLB, with interrupts
+        // disabled on our side
+        if (unlikely(smp_tlb_pending)) {
+            smp_tlb_poll();
+        }
         cpu_pause();
     }
 }
 
+bool spinlock_try_acquire(spinlock_t *lp)
+{
+    return !__atomic_test_and_set(&lp->lock, __ATOMIC_ACQUIRE);
+}
+
 void spinlock_release(spinlock_t *lp)
 {
     __atomic_clear(&lp->lock, __ATOMIC_RELEASE);
-}
\ No newline at end of file
+}
+
+uint64_t spinlock_acquire_irqsave(spinlock_t *lp)
+{
+    uint64_t flags = get_rflags().raw;
+    __asm__ volatile("cli" ::: "memory");
+    if (flags & (1 << 9)) {
+        irqstat_irqoff_begin((uintptr_t)__builtin_return_address(0));
+    }
+    spinlock_acquire(lp);
+    return flags;
+}
+
+void spinlock_release_irqrestore(spinlock_t *lp, uint64_t flags)
+{
+    spinlock_release(lp);
+    if (flags & (1 << 9)) {
+        irqstat_irqoff_end();
+        __asm__ volatile("sti" ::: "memory");
+    }
+}
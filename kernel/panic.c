@@ -5,10 +5,12 @@
 #include <keyboard.h>
 #include <panic.h>
 #include <power.h>
+#include <smp.h>
 #include <stdio.h>
 
 __attribute__((noreturn)) void panic(const char *reason)
 {
+    smp_stop_others();
     log_err("PANIC: %s", reason);
 
 #if CLEAR_ON_PANIC
@@ -57,7 +57,8 @@ void proc_mark_exited(int32_t pid, int32_t exit_code)
     if (pid < 1 || pid > PROC_MAX)
         return;
     proc_entry_t *e = &proc_table[pid - 1];
-    e->state = PROC_EXITED;
+    // Waiters read the code as soon as they see the state change
     e->exit_code = exit_code;
+    __atomic_store_n(&e->state, PROC_EXITED, __ATOMIC_RELEASE);
     waitqueue_wake_all(&e->exit_wq);
 }
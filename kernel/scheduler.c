@@ -1,30 +1,585 @@
+#include <apic.h>
+#include <cpu.h>
 #include <debug.h>
-#include <heap.h>
+#include <fpu.h>
+#include <idt.h>
 #include <interrupts.h>
+#include <irqstat.h>
+#include <panic.h>
 #include <scheduler.h>
+#include <slab.h>
+#include <smp.h>
 #include <string.h>
+#include <timer.h>
 
 #define THREAD_STACK_SIZE 16384 // 16 KB
 
-static thread_t *current_thread = NULL;
-static thread_t *ready_list = NULL;
+// A thread that ran this recently (in ns) still has a warm cache on its CPU,
+// so idle CPUs leave it alone unless nothing else can be stolen
+#define CACHE_HOT_NS 5000000ULL
+
+// Time slice at the top level in ns, growing by this much with every level
+// down
+#define SCHED_QUANTUM_NS 5000000ULL
+
+// A slice with less than this left counts as used up, so a timer that fires
+// a little early doesn't cause a second interrupt right after
+#define SCHED_MIN_SLICE_NS 50000ULL
+
+// How often every thread is lifted back to its base priority, so CPU-bound
+// threads at the bottom can't be starved forever
+#define SCHED_BOOST_NS 1000000000ULL
+
+// Buckets in the thread table. IDs are handed out in sequence, so they spread
+// evenly over the buckets.
+#define THREAD_TABLE_SIZE 64
+
+// Threads allocated with their stacks at boot, and the most kept for reuse
+#define THREAD_POOL_INITIAL 8
+#define THREAD_POOL_MAX 32
+
+// How long the reaper waits after being woken, giving exiting threads time
+// to switch off their stacks
+#define THREAD_REAP_DELAY_NS 10000000ULL
+
+// Every thread except the idle threads, hashed by ID
+static thread_t *thread_table[THREAD_TABLE_SIZE];
+static spinlock_t threads_lock = {0, "threads"};
+
+// Exited threads waiting for the reaper thread to reclaim them
+static thread_t *zombies = NULL;
+static spinlock_t zombies_lock = {0, "zombies"};
+static uint64_t reaper_id = 0;
+static bool reap_requested = false;
+
+// Reclaimed threads that still own a stack, so creating a thread is usually
+// just a pop
+static thread_t *thread_pool = NULL;
+static uint32_t thread_pool_count = 0;
+static spinlock_t thread_pool_lock = {0, "thread_pool"};
+
 static uint64_t next_thread_id = 0;
 static bool scheduler_running = false;
 
-void scheduler_init()
+static kmem_cache_t *thread_cache;
+static kmem_cache_t *stack_cache;
+static kmem_cache_t *fpu_cache;
+
+// Each CPU owns one deque of ready threads per priority level, plus a bitmap
+// of the non-empty levels so picking the next thread is O(1). The owner
+// queues and takes threads at its own end in FIFO order, while idle CPUs
+// steal from the tail. A thread is on a run queue exactly when it is READY.
+// Callers hold the queue's run_lock.
+static void run_queue_push(cpu_t *cpu, thread_t *thread)
 {
-    log_info("Initializing scheduler");
+    uint8_t level = thread->level;
 
-    // Create the "initial" thread which represents the current execution flow
-    // (kernel main)
-    thread_t *initial_thread = malloc(sizeof(thread_t));
-    initial_thread->id = next_thread_id++;
-    initial_thread->state = THREAD_STATE_RUNNING;
-    initial_thread->stack_base = NULL;
-    initial_thread->next = initial_thread; // Circular list
+    thread->next = NULL;
+    thread->prev = cpu->run_tail[level];
+    if (cpu->run_tail[level]) {
+        cpu->run_tail[level]->next = thread;
+    } else {
+        cpu->run_head[level] = thread;
+        cpu->run_bitmap |= 1U << level;
+    }
+    cpu->run_tail[level] = thread;
+    cpu->run_count++;
+}
+
+static void run_queue_remove(cpu_t *cpu, thread_t *thread)
+{
+    uint8_t level = thread->level;
 
-    current_thread = initial_thread;
-    ready_list = initial_thread;
+    if (thread->prev) {
+        thread->prev->next = thread->next;
+    } else {
+        cpu->run_head[level] = thread->next;
+    }
+    if (thread->next) {
+        thread->next->prev = thread->prev;
+    } else {
+        cpu->run_tail[level] = thread->prev;
+    }
+    if (!cpu->run_head[level]) {
+        cpu->run_bitmap &= ~(1U << level);
+    }
+    thread->next = NULL;
+    thread->prev = NULL;
+    cpu->run_count--;
+}
+
+static thread_t *run_queue_pop(cpu_t *cpu)
+{
+    if (!cpu->run_bitmap) {
+        return NULL;
+    }
+    thread_t *thread = cpu->run_head[__builtin_ctz(cpu->run_bitmap)];
+    run_queue_remove(cpu, thread);
+    return thread;
+}
+
+// Whether a queued thread should preempt one running at `level`
+static bool run_queue_has_higher(cpu_t *cpu, uint8_t level)
+{
+    return cpu->run_bitmap & ((1U << level) - 1);
+}
+
+static uint64_t time_slice(uint8_t level)
+{
+    return (level + 1) * SCHED_QUANTUM_NS;
+}
+
+// Threads queued or running on a CPU, used to place new threads
+static uint32_t cpu_load(cpu_t *cpu)
+{
+    return cpu->run_count + (cpu->current != cpu->idle);
+}
+
+/**
+ * @brief Locks the run queue a thread belongs to.
+ *
+ * The thread can be stolen by another CPU until the lock is held, so the
+ * owner is checked again afterwards.
+ */
+static cpu_t *lock_thread_cpu(thread_t *thread)
+{
+    while (true) {
+        cpu_t *cpu = smp_get_cpu(thread->cpu);
+        spinlock_acquire(&cpu->run_lock);
+        if (cpu->id == thread->cpu) {
+            return cpu;
+        }
+        spinlock_release(&cpu->run_lock);
+    }
+}
+
+// Finds a thread in the victim's queues that can move, taking the most
+// urgent level first and the tail of each level, which would otherwise wait
+// the longest. The victim's run_lock is held.
+static thread_t *find_stealable_at(cpu_t *victim, int level, bool allow_hot)
+{
+    for (thread_t *thread = victim->run_tail[level]; thread;
+         thread = thread->prev) {
+        // A thread woken before it yielded is queued while still running,
+        // and the victim may still be on the stack of the last one it left.
+        // The victim's registers may also hold a newer FPU state than the
+        // thread's save area.
+        if (thread->pinned || thread == victim->current ||
+            thread == victim->switched_from || thread == victim->fpu_owner) {
+            continue;
+        }
+        if (!allow_hot && get_ts() - thread->last_run < CACHE_HOT_NS) {
+            continue;
+        }
+        return thread;
+    }
+    return NULL;
+}
+
+static thread_t *find_stealable(cpu_t *victim, bool allow_hot)
+{
+    for (int level = 0; level < SCHED_PRIORITIES; level++) {
+        thread_t *thread = find_stealable_at(victim, level, allow_hot);
+        if (thread) {
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Takes a ready thread from the busiest other CPU.
+ *
+ * The caller holds its own run_lock, so victims are only try-locked: two
+ * idle CPUs stealing from each other would otherwise deadlock.
+ */
+static thread_t *steal_thread(cpu_t *self)
+{
+    cpu_t *victim = NULL;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+        if (cpu && cpu != self && cpu->run_count > 0 &&
+            (!victim || cpu->run_count > victim->run_count)) {
+            victim = cpu;
+        }
+    }
+    if (!victim || !spinlock_try_acquire(&victim->run_lock)) {
+        return NULL;
+    }
+
+    // Moving a warm thread is only worth it if it would wait behind another
+    thread_t *thread = find_stealable(victim, false);
+    if (!thread && victim->run_count > 1) {
+        thread = find_stealable(victim, true);
+    }
+    if (thread) {
+        run_queue_remove(victim, thread);
+        thread->cpu = self->id;
+    }
+
+    spinlock_release(&victim->run_lock);
+    return thread;
+}
+
+/**
+ * @brief Makes a CPU look at its run queue after a thread at `level` was put
+ * on it.
+ *
+ * The CPU is interrupted if it is idle or running something less urgent. If
+ * the thread has to wait there instead, an idle CPU is woken to steal it.
+ */
+static void kick_cpu(cpu_t *cpu, uint8_t level)
+{
+    if (!scheduler_running || !is_apic_in_use()) {
+        return;
+    }
+
+    thread_t *current = cpu->current;
+    if (current == cpu->idle || level < current->level) {
+        lapic_send_ipi(cpu->lapic_id, VECTOR_RESCHEDULE);
+        return;
+    }
+
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        cpu_t *other = smp_get_cpu(i);
+        if (other && other != cpu && other->current == other->idle) {
+            lapic_send_ipi(other->lapic_id, VECTOR_RESCHEDULE);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Locks the run queue of the CPU the caller is running on.
+ *
+ * Interrupts go off before the CPU is looked up, so the caller can't be
+ * preempted and resumed on another CPU in between.
+ */
+static cpu_t *lock_this_cpu(uint64_t *flags)
+{
+    __asm__ volatile("pushfq\n\t"
+                     "pop %0\n\t"
+                     "cli"
+                     : "=r"(*flags)
+                     :
+                     : "memory");
+    cpu_t *cpu = this_cpu();
+    spinlock_acquire(&cpu->run_lock);
+    return cpu;
+}
+
+/**
+ * @brief Saves the callee-saved registers on the current stack, stores the
+ * stack pointer in `*prev_rsp` and resumes the thread saved at `next_rsp`.
+ *
+ * Returns once the calling thread is switched back to. Interrupts must be
+ * off; they stay off until the resumed thread turns them back on.
+ *
+ * @param irq_frame Whether `next_rsp` points at an interrupt frame, which is
+ * returned from with iretq, rather than a frame left by this function.
+ */
+__attribute__((naked)) static void
+context_switch(__attribute__((unused)) uint64_t *prev_rsp,
+               __attribute__((unused)) uint64_t next_rsp,
+               __attribute__((unused)) bool irq_frame)
+{
+    __asm__ volatile("push %rbp\n"
+                     "push %rbx\n"
+                     "push %r12\n"
+                     "push %r13\n"
+                     "push %r14\n"
+                     "push %r15\n"
+                     "mov %rsp, (%rdi)\n"
+                     "mov %rsi, %rsp\n"
+                     "test %dl, %dl\n"
+                     "jnz 1f\n"
+                     "pop %r15\n"
+                     "pop %r14\n"
+                     "pop %r13\n"
+                     "pop %r12\n"
+                     "pop %rbx\n"
+                     "pop %rbp\n"
+                     "ret\n"
+                     "1:\n"
+                     "pop %r15\n"
+                     "pop %r14\n"
+                     "pop %r13\n"
+                     "pop %r12\n"
+                     "pop %r11\n"
+                     "pop %r10\n"
+                     "pop %r9\n"
+                     "pop %r8\n"
+                     "pop %rbp\n"
+                     "pop %rax\n"
+                     "pop %rbx\n"
+                     "pop %rcx\n"
+                     "pop %rdx\n"
+                     "pop %rsi\n"
+                     "pop %rdi\n"
+                     "iretq\n");
+}
+
+// Second half of context_switch(), for resuming a thread from an interrupt
+__attribute__((naked)) static void context_resume()
+{
+    __asm__ volatile("pop %r15\n"
+                     "pop %r14\n"
+                     "pop %r13\n"
+                     "pop %r12\n"
+                     "pop %rbx\n"
+                     "pop %rbp\n"
+                     "ret\n");
+}
+
+/**
+ * @brief Gets a stack pointer an interrupt handler can return to for a
+ * thread that was switched away from by context_switch().
+ *
+ * An interrupt frame that returns into context_resume() is built below the
+ * thread's saved frame. Interrupts stay off, as context_switch() expects.
+ */
+static uint64_t interrupt_return_rsp(thread_t *thread)
+{
+    // Handlers call into C after switching to this stack, so it has to be
+    // 16-byte aligned like the one the CPU pushes an interrupt frame on
+    uint64_t *stack = (uint64_t *)(thread->rsp & ~0xFULL);
+
+    *(--stack) = 0x10;                     // SS
+    *(--stack) = thread->rsp;              // RSP
+    *(--stack) = 0x02;                     // RFLAGS (IF disabled)
+    *(--stack) = 0x08;                     // CS
+    *(--stack) = (uint64_t)context_resume; // RIP
+
+    // The 15 registers popped by IRQ_HANDLER, all scratch at this point
+    for (int i = 0; i < 15; i++) {
+        *(--stack) = 0;
+    }
+    return (uint64_t)stack;
+}
+
+static thread_t *current_thread()
+{
+    uint64_t flags;
+    cpu_t *cpu = lock_this_cpu(&flags);
+    thread_t *current = cpu->current;
+    spinlock_release_irqrestore(&cpu->run_lock, flags);
+    return current;
+}
+
+static uint64_t alloc_thread_id()
+{
+    return __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED);
+}
+
+static void thread_table_add(thread_t *thread)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&threads_lock);
+    thread_t **bucket = &thread_table[thread->id % THREAD_TABLE_SIZE];
+    thread->hash_next = *bucket;
+    *bucket = thread;
+    spinlock_release_irqrestore(&threads_lock, flags);
+}
+
+// Callers hold threads_lock
+static void thread_table_remove(thread_t *thread)
+{
+    thread_t **link = &thread_table[thread->id % THREAD_TABLE_SIZE];
+    while (*link != thread) {
+        link = &(*link)->hash_next;
+    }
+    *link = thread->hash_next;
+}
+
+// Callers hold threads_lock
+static thread_t *find_thread(uint64_t id)
+{
+    for (thread_t *thread = thread_table[id % THREAD_TABLE_SIZE]; thread;
+         thread = thread->hash_next) {
+        if (thread->id == id) {
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+// Takes a thread with a stack from the pool, or allocates a new one
+static thread_t *thread_get_free()
+{
+    uint64_t flags = spinlock_acquire_irqsave(&thread_pool_lock);
+    thread_t *thread = thread_pool;
+    if (thread) {
+        thread_pool = thread->next;
+        thread_pool_count--;
+    }
+    spinlock_release_irqrestore(&thread_pool_lock, flags);
+    if (thread) {
+        return thread;
+    }
+
+    thread = kmem_cache_alloc(thread_cache);
+    if (!thread) {
+        return NULL;
+    }
+    thread->stack_base = kmem_cache_alloc(stack_cache);
+    thread->fpu_state = kmem_cache_alloc(fpu_cache);
+    if (!thread->stack_base || !thread->fpu_state) {
+        if (thread->stack_base) {
+            kmem_cache_free(stack_cache, thread->stack_base);
+        }
+        if (thread->fpu_state) {
+            kmem_cache_free(fpu_cache, thread->fpu_state);
+        }
+        kmem_cache_free(thread_cache, thread);
+        return NULL;
+    }
+    return thread;
+}
+
+// Returns a thread and its stack to the pool, or frees them if it is full.
+// The FPU save area goes with them.
+static void thread_put_free(thread_t *thread)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&thread_pool_lock);
+    if (thread_pool_count < THREAD_POOL_MAX) {
+        thread->next = thread_pool;
+        thread_pool = thread;
+        thread_pool_count++;
+        thread = NULL;
+    }
+    spinlock_release_irqrestore(&thread_pool_lock, flags);
+
+    if (thread) {
+        kmem_cache_free(fpu_cache, thread->fpu_state);
+        kmem_cache_free(stack_cache, thread->stack_base);
+        kmem_cache_free(thread_cache, thread);
+    }
+}
+
+/**
+ * @brief Marks a thread as exited.
+ *
+ * The caller holds the run_lock of the thread's CPU, and calls
+ * thread_exited() once it has released it. A thread that is still running is
+ * left to stop the next time its CPU schedules.
+ */
+static void thread_terminate(cpu_t *cpu, thread_t *thread)
+{
+    if (thread->state == THREAD_STATE_READY) {
+        run_queue_remove(cpu, thread);
+    }
+    thread->state = THREAD_STATE_TERMINATED;
+}
+
+// Wakes the threads waiting for a terminated thread, then hands it to the
+// reaper. Until it is on the reaper's list nothing can free it.
+static void thread_exited(thread_t *thread)
+{
+    waitqueue_wake_all(&thread->exit_wq);
+
+    uint64_t flags = spinlock_acquire_irqsave(&zombies_lock);
+    thread->next = zombies;
+    zombies = thread;
+    spinlock_release_irqrestore(&zombies_lock, flags);
+
+    __atomic_store_n(&reap_requested, true, __ATOMIC_RELEASE);
+    scheduler_unblock(reaper_id);
+}
+
+// Whether a CPU may still be running on the thread's stack, or saving FPU
+// state into it
+static bool thread_in_use(thread_t *thread)
+{
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+        if (!cpu) {
+            continue;
+        }
+        uint64_t flags = spinlock_acquire_irqsave(&cpu->run_lock);
+        bool in_use = cpu->current == thread ||
+                      cpu->switched_from == thread ||
+                      cpu->fpu_owner == thread;
+        spinlock_release_irqrestore(&cpu->run_lock, flags);
+        if (in_use) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void thread_free(thread_t *thread)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&threads_lock);
+    thread_table_remove(thread);
+    spinlock_release_irqrestore(&threads_lock, flags);
+
+    // wait_for_thread() may have found the thread just before it left the
+    // table, and holds the exit queue's lock until it has seen it exited
+    flags = spinlock_acquire_irqsave(&thread->exit_wq.lock);
+    spinlock_release_irqrestore(&thread->exit_wq.lock, flags);
+
+    // A thread cancelled while sleeping is still on a wait queue, or has its
+    // wakeup queued
+    waitqueue_cancel(&thread->wait_node);
+    timer_event_cancel(&thread->sleep_timer);
+    thread_put_free(thread);
+}
+
+/**
+ * @brief Reclaims every exited thread that no CPU is still using.
+ *
+ * @return false if some had to be left for a later pass.
+ */
+static bool reap_zombies()
+{
+    uint64_t flags = spinlock_acquire_irqsave(&zombies_lock);
+    thread_t *list = zombies;
+    zombies = NULL;
+    spinlock_release_irqrestore(&zombies_lock, flags);
+
+    bool done = true;
+    while (list) {
+        thread_t *thread = list;
+        list = thread->next;
+        if (!thread_in_use(thread)) {
+            thread_free(thread);
+            continue;
+        }
+
+        flags = spinlock_acquire_irqsave(&zombies_lock);
+        thread->next = zombies;
+        zombies = thread;
+        spinlock_release_irqrestore(&zombies_lock, flags);
+        done = false;
+    }
+    return done;
+}
+
+static void reaper(void *arg)
+{
+    (void)arg;
+    while (true) {
+        // A request made once the reaper is marked blocked unblocks it again,
+        // so none is lost in between
+        scheduler_block_current();
+        if (__atomic_exchange_n(&reap_requested, false, __ATOMIC_ACQ_REL)) {
+            scheduler_unblock(reaper_id);
+        }
+        scheduler_yield();
+
+        thread_sleep_ns(THREAD_REAP_DELAY_NS);
+        if (!reap_zombies()) {
+            __atomic_store_n(&reap_requested, true, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void idle_loop(void *arg)
+{
+    (void)arg;
+    while (true) {
+        enable_interrupts();
+        __asm__ volatile("hlt");
+    }
 }
 
 static void thread_wrapper(void (*entry)(void *), void *arg)
@@ -32,8 +587,14 @@ static void thread_wrapper(void (*entry)(void *), void *arg)
     enable_interrupts(); // Threads should start with interrupts enabled
     entry(arg);
 
-    disable_interrupts();
-    current_thread->state = THREAD_STATE_TERMINATED;
+    // The thread may have been cancelled on its way out
+    uint64_t flags;
+    cpu_t *cpu = lock_this_cpu(&flags);
+    if (cpu->current->state != THREAD_STATE_TERMINATED) {
+        thread_terminate(cpu, cpu->current);
+    }
+    spinlock_release(&cpu->run_lock);
+    thread_exited(cpu->current);
     scheduler_yield();
 
     while (1) {
@@ -41,12 +602,43 @@ static void thread_wrapper(void (*entry)(void *), void *arg)
     }
 }
 
-thread_t *thread_create(void (*entry)(void *), void *arg)
+static void thread_init(thread_t *thread, thread_state_t state, uint32_t cpu)
+{
+    thread->id = alloc_thread_id();
+    thread->voluntary = false;
+    thread->state = state;
+    thread->stack_base = NULL;
+    thread->fpu_state = NULL;
+    thread->cpu = cpu;
+    thread->pinned = false;
+    thread->last_run = 0;
+    thread->priority = SCHED_PRIORITY_DEFAULT;
+    thread->level = SCHED_PRIORITY_DEFAULT;
+    thread->slice = time_slice(SCHED_PRIORITY_DEFAULT);
+    thread->next = NULL;
+    thread->prev = NULL;
+    thread->hash_next = NULL;
+    timer_event_init(&thread->sleep_timer, NULL, NULL);
+    thread->wait_node = (wq_node_t){thread, NULL, NULL, NULL};
+    waitqueue_init(&thread->exit_wq);
+}
+
+/**
+ * @brief Allocates a thread and a stack set up to enter `entry` the first
+ * time the scheduler switches to it.
+ */
+static thread_t *thread_alloc(void (*entry)(void *), void *arg)
 {
-    thread_t *thread = malloc(sizeof(thread_t));
-    thread->id = next_thread_id++;
-    thread->state = THREAD_STATE_READY;
-    thread->stack_base = malloc(THREAD_STACK_SIZE);
+    thread_t *thread = thread_get_free();
+    if (!thread) {
+        return NULL;
+    }
+    void *stack_base = thread->stack_base;
+    void *fpu_state = thread->fpu_state;
+    thread_init(thread, THREAD_STATE_READY, 0);
+    thread->stack_base = stack_base;
+    thread->fpu_state = fpu_state;
+    fpu_state_init(fpu_state);
 
     // Set up the initial stack
     uint64_t *stack =
@@ -80,68 +672,470 @@ thread_t *thread_create(void (*entry)(void *), void *arg)
     *(--stack) = 0;               // R15
 
     thread->rsp = (uint64_t)stack;
+    return thread;
+}
 
-    // Add to circular ready list
-    disable_interrupts();
-    thread->next = ready_list->next;
-    ready_list->next = thread;
-    enable_interrupts();
+void scheduler_init()
+{
+    log_info("Initializing scheduler");
+
+    thread_cache = kmem_cache_create("thread", sizeof(thread_t), 0, NULL);
+    stack_cache =
+        kmem_cache_create("thread_stack", THREAD_STACK_SIZE, 16, NULL);
+    fpu_cache = kmem_cache_create("fpu_state", fpu_state_size(), 64, NULL);
+    if (!thread_cache || !stack_cache || !fpu_cache) {
+        panic("Failed to create scheduler caches");
+    }
+
+    cpu_t *cpu = smp_bsp();
+
+    // Create the "initial" thread which represents the current execution flow
+    // (kernel main)
+    thread_t *initial_thread = kmem_cache_alloc(thread_cache);
+    thread_init(initial_thread, THREAD_STATE_RUNNING, cpu->id);
+    initial_thread->fpu_state = kmem_cache_alloc(fpu_cache);
+    if (!initial_thread->fpu_state) {
+        panic("Failed to create initial thread");
+    }
+    thread_table_add(initial_thread);
+
+    // The boot CPU's own flow is a real thread, so its idle thread needs a
+    // stack of its own
+    cpu->idle = thread_alloc(idle_loop, NULL);
+    if (!cpu->idle) {
+        panic("Failed to create idle thread");
+    }
+    cpu->idle->cpu = cpu->id;
+    cpu->idle->pinned = true;
+    cpu->current = initial_thread;
+    // The registers hold whatever boot code left in them
+    cpu->fpu_owner = initial_thread;
+    cpu->last_boost = get_ts();
+    cpu->slice_start = cpu->last_boost;
+
+    for (int i = 0; i < THREAD_POOL_INITIAL; i++) {
+        thread_t *thread = thread_get_free();
+        if (!thread) {
+            break;
+        }
+        thread_put_free(thread);
+    }
+
+    thread_t *thread = thread_create(reaper, NULL);
+    if (!thread) {
+        panic("Failed to create reaper thread");
+    }
+    reaper_id = thread->id;
+}
+
+void scheduler_init_ap(cpu_t *cpu)
+{
+    thread_t *idle = kmem_cache_alloc(thread_cache);
+    if (!idle) {
+        panic("Failed to create idle thread");
+    }
+    thread_init(idle, THREAD_STATE_RUNNING, cpu->id);
+    idle->pinned = true;
+    idle->fpu_state = kmem_cache_alloc(fpu_cache);
+    if (!idle->fpu_state) {
+        panic("Failed to create idle thread");
+    }
+    fpu_state_init(idle->fpu_state);
+
+    cpu->idle = idle;
+    cpu->current = idle;
+    cpu->fpu_owner = idle;
+    cpu->last_boost = get_ts();
+    cpu->slice_start = cpu->last_boost;
+}
+
+__attribute__((noreturn)) void scheduler_idle()
+{
+    idle_loop(NULL);
+    __builtin_unreachable();
+}
+
+// Picks the online CPU with the fewest queued and running threads, so the
+// stages of a pipeline started back to back land on different CPUs
+static cpu_t *least_loaded_cpu()
+{
+    cpu_t *best = smp_bsp();
+    for (uint32_t i = 1; i < smp_cpu_count(); i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+        if (cpu && cpu_load(cpu) < cpu_load(best)) {
+            best = cpu;
+        }
+    }
+    return best;
+}
+
+// The ID is stored through id, if given, before the thread is queued: once
+// queued it may run, exit and be recycled before the caller looks at it
+static thread_t *create_on(cpu_t *cpu, void (*entry)(void *), void *arg,
+                           bool pinned, uint64_t *id)
+{
+    thread_t *thread = thread_alloc(entry, arg);
+    if (!thread) {
+        log_err("Failed to allocate thread");
+        return NULL;
+    }
+    thread_table_add(thread);
+
+    thread->cpu = cpu->id;
+    thread->pinned = pinned;
+    if (id) {
+        *id = thread->id;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&cpu->run_lock);
+    run_queue_push(cpu, thread);
+    spinlock_release_irqrestore(&cpu->run_lock, flags);
+    kick_cpu(cpu, thread->level);
 
     return thread;
 }
 
+thread_t *thread_create_on_cpu(void (*entry)(void *), void *arg,
+                               uint32_t cpu_id)
+{
+    cpu_t *cpu = smp_get_cpu(cpu_id);
+    if (!cpu) {
+        return create_on(least_loaded_cpu(), entry, arg, false, NULL);
+    }
+    return create_on(cpu, entry, arg, true, NULL);
+}
+
+thread_t *thread_create(void (*entry)(void *), void *arg)
+{
+    return create_on(least_loaded_cpu(), entry, arg, false, NULL);
+}
+
+bool thread_spawn(void (*entry)(void *), void *arg, uint64_t *id)
+{
+    return create_on(least_loaded_cpu(), entry, arg, false, id) != NULL;
+}
+
+/**
+ * @brief Lifts every thread on the CPU back to its base priority.
+ *
+ * Threads only ever move to a more urgent level, which has already been
+ * walked, so none is visited twice.
+ */
+static void boost_all(cpu_t *cpu)
+{
+    for (int level = 1; level < SCHED_PRIORITIES; level++) {
+        thread_t *thread = cpu->run_head[level];
+        while (thread) {
+            thread_t *next = thread->next;
+            if (thread->level != thread->priority) {
+                run_queue_remove(cpu, thread);
+                thread->level = thread->priority;
+                thread->slice = time_slice(thread->level);
+                run_queue_push(cpu, thread);
+            }
+            thread = next;
+        }
+    }
+
+    thread_t *current = cpu->current;
+    if (current != cpu->idle) {
+        current->level = current->priority;
+        current->slice = time_slice(current->level);
+    }
+    cpu->last_boost = get_ts();
+}
+
+// Takes the time since the running thread was last charged off its slice
+static void charge_current(cpu_t *cpu, uint64_t now)
+{
+    thread_t *current = cpu->current;
+    uint64_t ran = now - cpu->slice_start;
+    cpu->slice_start = now;
+
+    if (current == cpu->idle) {
+        return;
+    }
+    current->slice = ran < current->slice ? current->slice - ran : 0;
+    if (current->slice < SCHED_MIN_SLICE_NS) {
+        current->slice = 0;
+    }
+}
+
+// Programs the CPU's timer for whichever comes first, the end of the running
+// thread's slice or the earliest timer event. An idle CPU with no events
+// gets no timer at all and sleeps until an interrupt or IPI.
+static void arm_timer(cpu_t *cpu, uint64_t now)
+{
+    uint64_t delay = UINT64_MAX;
+
+    uint64_t deadline = timer_next_deadline();
+    if (deadline != UINT64_MAX) {
+        delay = deadline > now ? deadline - now : 0;
+    }
+
+    if (cpu->current != cpu->idle) {
+        uint64_t ran = now - cpu->slice_start;
+        uint64_t left = ran < cpu->current->slice ? cpu->current->slice - ran
+                                                  : 0;
+        if (left < delay) {
+            delay = left;
+        }
+    }
+
+    if (delay == UINT64_MAX) {
+        lapic_timer_stop();
+    } else {
+        lapic_timer_arm(delay);
+    }
+}
+
+// Makes the most urgent ready thread current and returns it, which may be
+// the running thread itself. The caller holds the CPU's run_lock and has
+// charged the running thread, and switches stacks after releasing the lock.
+static thread_t *pick_next(cpu_t *cpu, uint64_t now)
+{
+    thread_t *prev = cpu->current;
+    prev->last_run = now;
+
+    // A thread that blocked or exited is left off the queue. One that was
+    // woken before it got here is already back on it.
+    if (prev->state == THREAD_STATE_RUNNING && prev != cpu->idle) {
+        prev->state = THREAD_STATE_READY;
+        run_queue_push(cpu, prev);
+    }
+
+    thread_t *next = run_queue_pop(cpu);
+    if (!next) {
+        next = steal_thread(cpu);
+    }
+    if (!next) {
+        next = cpu->idle;
+    }
+    next->state = THREAD_STATE_RUNNING;
+    cpu->current = next;
+    arm_timer(cpu, now);
+
+    // This CPU is still on prev's stack until it has switched, so prev
+    // can't be stolen before the next time it schedules
+    cpu->switched_from = prev;
+
+    // An exited thread's FPU state is never needed again, and the reaper
+    // waits for it to be let go
+    if (cpu->fpu_owner &&
+        cpu->fpu_owner->state == THREAD_STATE_TERMINATED) {
+        cpu->fpu_owner = NULL;
+    }
+    return next;
+}
+
+// Switches from an interrupt handler to the most urgent ready thread. The
+// caller holds the CPU's run_lock, which is released here.
+static uint64_t switch_threads(cpu_t *cpu, uint64_t current_rsp, uint64_t now)
+{
+    thread_t *prev = cpu->current;
+    prev->rsp = current_rsp;
+    prev->voluntary = false;
+
+    thread_t *next = pick_next(cpu, now);
+    spinlock_release(&cpu->run_lock);
+    return next->voluntary ? interrupt_return_rsp(next) : next->rsp;
+}
+
 uint64_t scheduler_schedule(uint64_t current_rsp)
 {
-    if (!scheduler_running || !current_thread) {
+    cpu_t *cpu = this_cpu();
+    if (!scheduler_running || !cpu->current) {
         return current_rsp;
     }
 
-    current_thread->rsp = current_rsp;
+    // Interrupts are already off in the handler
+    spinlock_acquire(&cpu->run_lock);
+
+    uint64_t now = get_ts();
+    if (now - cpu->last_boost >= SCHED_BOOST_NS) {
+        boost_all(cpu);
+    }
+    charge_current(cpu, now);
+
+    thread_t *current = cpu->current;
+    if (current != cpu->idle && current->state == THREAD_STATE_RUNNING) {
+        // Keep running until the slice is used up, unless something more
+        // urgent was woken
+        if (current->slice > 0 &&
+            !run_queue_has_higher(cpu, current->level)) {
+            arm_timer(cpu, now);
+            spinlock_release(&cpu->run_lock);
+            return current_rsp;
+        }
 
-    // Pick next ready thread
-    thread_t *next = current_thread->next;
-    while (next->state != THREAD_STATE_READY &&
-           next->state != THREAD_STATE_RUNNING) {
-        next = next->next;
-        if (next == current_thread) {
-            break; // All other threads are not ready
+        // Using a whole slice marks the thread as CPU-bound
+        if (current->slice == 0) {
+            if (current->level < SCHED_PRIORITY_LOWEST) {
+                current->level++;
+            }
+            current->slice = time_slice(current->level);
         }
     }
 
-    current_thread = next;
-    current_thread->state = THREAD_STATE_RUNNING;
+    return switch_threads(cpu, current_rsp, now);
+}
+
+uint64_t scheduler_reschedule_handler(uint64_t current_rsp)
+{
+    cpu_t *cpu = this_cpu();
+    if (!scheduler_running || !cpu->current) {
+        return current_rsp;
+    }
+
+    // Interrupts are already off in the handler. Whoever sent the IPI may
+    // have been beaten to the new thread by a steal, so check again.
+    spinlock_acquire(&cpu->run_lock);
+    thread_t *current = cpu->current;
+    if (current != cpu->idle && !run_queue_has_higher(cpu, current->level)) {
+        spinlock_release(&cpu->run_lock);
+        return current_rsp;
+    }
+
+    uint64_t now = get_ts();
+    charge_current(cpu, now);
+    return switch_threads(cpu, current_rsp, now);
+}
+
+void scheduler_rearm_timer()
+{
+    uint64_t flags;
+    cpu_t *cpu = lock_this_cpu(&flags);
+    arm_timer(cpu, get_ts());
+    spinlock_release_irqrestore(&cpu->run_lock, flags);
+}
+
+static void sleep_timeout(void *arg)
+{
+    scheduler_unblock((uint64_t)(uintptr_t)arg);
+}
+
+bool thread_can_sleep()
+{
+    uint64_t flags;
+    cpu_t *cpu = lock_this_cpu(&flags);
+    bool can_sleep =
+        scheduler_running && cpu->current != cpu->idle && (flags & (1 << 9));
+    spinlock_release_irqrestore(&cpu->run_lock, flags);
+    return can_sleep;
+}
+
+void thread_sleep_ns(uint64_t ns)
+{
+    if (!thread_can_sleep()) {
+        wait_ns(ns);
+        return;
+    }
+
+    uint64_t deadline = get_ts() + ns;
+
+    // Interrupts stay off until the thread is blocked, so the event, which
+    // only fires on this CPU, can't run first and leave it asleep for good
+    uint64_t flags;
+    cpu_t *cpu = lock_this_cpu(&flags);
+    thread_t *current = cpu->current;
+    spinlock_release(&cpu->run_lock);
+
+    timer_event_t *event = &current->sleep_timer;
+    timer_event_init(event, sleep_timeout, (void *)(uintptr_t)current->id);
+    bool queued = timer_event_add(event, deadline);
+    if (queued) {
+        scheduler_block_current();
+        scheduler_yield();
+
+        // Woken by something else first
+        timer_event_cancel(event);
+    }
+    if (flags & (1 << 9)) {
+        enable_interrupts();
+    }
 
-    return current_thread->rsp;
+    // Out of timer slots, poll instead
+    while (!queued && get_ts() < deadline) {
+        scheduler_yield();
+    }
 }
 
 void scheduler_yield()
 {
-    __asm__ volatile("int $0x20"); // Trigger PIT IRQ
+    uint64_t flags;
+    cpu_t *cpu = lock_this_cpu(&flags);
+    if (!scheduler_running || !cpu->current) {
+        spinlock_release_irqrestore(&cpu->run_lock, flags);
+        return;
+    }
+
+    // A yielding thread keeps its level and what is left of its slice
+    uint64_t now = get_ts();
+    charge_current(cpu, now);
+    thread_t *prev = cpu->current;
+    thread_t *next = pick_next(cpu, now);
+    spinlock_release(&cpu->run_lock);
+
+    if (next != prev) {
+        prev->voluntary = true;
+        fpu_switch(cpu, next);
+        // The next thread may return with iretq rather than enable
+        // interrupts, so the window is charged up to the switch
+        irqstat_irqoff_end();
+        context_switch(&prev->rsp, next->rsp, !next->voluntary);
+    }
+
+    // Possibly on another CPU by now, if the thread was stolen
+    if (flags & (1 << 9)) {
+        enable_interrupts();
+    }
 }
 
 void scheduler_start()
 {
     log_info("Starting scheduler");
     scheduler_running = true;
+
+    // Threads created during boot may be waiting on CPUs that have no timer
+    // running yet
+    if (is_apic_in_use()) {
+        for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+            cpu_t *cpu = smp_get_cpu(i);
+            if (cpu) {
+                lapic_send_ipi(cpu->lapic_id, VECTOR_RESCHEDULE);
+            }
+        }
+    }
 }
 
 void thread_cancel(uint64_t id)
 {
-    disable_interrupts();
-    thread_t *thread = ready_list;
-    bool found = false;
-    if (thread != NULL) {
-        do {
-            if (thread->id == id) {
-                thread->state = THREAD_STATE_TERMINATED;
-                found = true;
-                break;
-            }
-            thread = thread->next;
-        } while (thread != ready_list);
+    // Nothing would reclaim exited threads without the reaper
+    if (id == reaper_id) {
+        log_err("The reaper thread can't be cancelled");
+        return;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&threads_lock);
+    thread_t *thread = find_thread(id);
+    if (!thread) {
+        spinlock_release_irqrestore(&threads_lock, flags);
+        return;
+    }
+
+    // Running threads are dropped when their CPU next schedules
+    cpu_t *cpu = lock_thread_cpu(thread);
+    bool cancelled = thread->state != THREAD_STATE_TERMINATED;
+    if (cancelled) {
+        thread_terminate(cpu, thread);
     }
+    spinlock_release(&cpu->run_lock);
+    spinlock_release_irqrestore(&threads_lock, flags);
 
-    if (found && current_thread->id == id) {
+    if (cancelled) {
+        thread_exited(thread);
+    }
+    if (current_thread() == thread) {
         scheduler_yield();
         // Should not reach here
         log_err("Thread %lu failed to yield after cancellation", id);
@@ -149,87 +1143,148 @@ void thread_cancel(uint64_t id)
             __asm__ volatile("hlt");
         }
     }
-    enable_interrupts();
+}
+
+thread_t *scheduler_get_current(void)
+{
+    return current_thread();
 }
 
 uint64_t scheduler_get_current_id(void)
 {
-    return current_thread ? current_thread->id : 0;
+    thread_t *current = current_thread();
+    return current ? current->id : 0;
 }
 
 void scheduler_block_current(void)
 {
-    if (current_thread)
-        current_thread->state = THREAD_STATE_BLOCKED;
+    uint64_t flags;
+    cpu_t *cpu = lock_this_cpu(&flags);
+    if (cpu->current) {
+        cpu->current->state = THREAD_STATE_BLOCKED;
+    }
+    spinlock_release_irqrestore(&cpu->run_lock, flags);
+}
+
+void scheduler_wake(thread_t *thread)
+{
+    cpu_t *kick = NULL;
+    uint8_t level = 0;
+
+    uint64_t flags = get_rflags().raw;
+    disable_interrupts();
+    cpu_t *cpu = lock_thread_cpu(thread);
+    if (thread->state == THREAD_STATE_BLOCKED) {
+        // Threads that sleep before their slice runs out are interactive, so
+        // they come back at their base priority
+        thread->level = thread->priority;
+        thread->slice = time_slice(thread->level);
+        thread->state = THREAD_STATE_READY;
+        run_queue_push(cpu, thread);
+
+        // A thread woken before it yielded is still running
+        if (thread != cpu->current) {
+            kick = cpu;
+            level = thread->level;
+        }
+    }
+    spinlock_release(&cpu->run_lock);
+
+    if (kick) {
+        kick_cpu(kick, level);
+    }
+    if (flags & (1 << 9)) {
+        enable_interrupts();
+    }
 }
 
 void scheduler_unblock(uint64_t id)
 {
-    disable_interrupts();
-    thread_t *thread = ready_list;
+    uint64_t flags = spinlock_acquire_irqsave(&threads_lock);
+    thread_t *thread = find_thread(id);
     if (thread) {
-        do {
-            if (thread->id == id && thread->state == THREAD_STATE_BLOCKED) {
-                thread->state = THREAD_STATE_READY;
-                break;
-            }
-            thread = thread->next;
-        } while (thread != ready_list);
+        scheduler_wake(thread);
     }
-    enable_interrupts();
+    spinlock_release_irqrestore(&threads_lock, flags);
 }
 
-void wait_for_thread(uint64_t id)
+bool thread_set_priority(uint64_t id, uint8_t priority)
 {
-    while (true) {
-        disable_interrupts();
-        thread_t *thread = ready_list;
-        bool still_exists = false;
+    if (priority >= SCHED_PRIORITIES) {
+        log_err("Invalid thread priority %d", priority);
+        return false;
+    }
 
-        if (thread != NULL) {
-            do {
-                if (thread->id == id &&
-                    thread->state != THREAD_STATE_TERMINATED) {
-                    still_exists = true;
-                    break;
-                }
-                thread = thread->next;
-            } while (thread != ready_list);
-        }
+    uint64_t flags = spinlock_acquire_irqsave(&threads_lock);
+    thread_t *thread = find_thread(id);
+    if (!thread) {
+        spinlock_release_irqrestore(&threads_lock, flags);
+        return false;
+    }
 
-        enable_interrupts();
+    cpu_t *cpu = lock_thread_cpu(thread);
+    bool queued = thread->state == THREAD_STATE_READY;
+    if (queued) {
+        run_queue_remove(cpu, thread);
+    }
+    thread->priority = priority;
+    thread->level = priority;
+    thread->slice = time_slice(priority);
+    if (queued) {
+        run_queue_push(cpu, thread);
+    }
+    spinlock_release(&cpu->run_lock);
+    spinlock_release_irqrestore(&threads_lock, flags);
+    return true;
+}
 
-        if (!still_exists) {
-            break;
-        }
+void wait_for_thread(uint64_t id)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&threads_lock);
+    thread_t *thread = find_thread(id);
+    if (!thread) {
+        spinlock_release_irqrestore(&threads_lock, flags);
+        return;
+    }
 
-        scheduler_yield();
+    // The exit queue's lock keeps the thread from being reclaimed once it
+    // is out of the table. Its state is set before the queue is woken, so
+    // checking it under the lock can't miss the exit.
+    spinlock_acquire(&thread->exit_wq.lock);
+    spinlock_release(&threads_lock);
+    if (thread->state == THREAD_STATE_TERMINATED) {
+        spinlock_release_irqrestore(&thread->exit_wq.lock, flags);
+        return;
     }
+    waitqueue_sleep_locked(&thread->exit_wq, flags);
 }
 
 void wait_for_all_threads()
 {
-    disable_interrupts();
-    thread_t *start_node = ready_list;
-    thread_t *current = start_node;
+    uint64_t self = scheduler_get_current_id();
 
-    if (current == NULL) {
-        enable_interrupts();
-        return;
-    }
+    while (true) {
+        // Don't wait for the current execution flow (kernel main/initial
+        // thread), the reaper or ourselves
+        uint64_t flags = spinlock_acquire_irqsave(&threads_lock);
+        bool any_running = false;
+        for (int i = 0; i < THREAD_TABLE_SIZE && !any_running; i++) {
+            for (thread_t *thread = thread_table[i]; thread;
+                 thread = thread->hash_next) {
+                if (thread->id != 0 && thread->id != self &&
+                    thread->id != reaper_id &&
+                    thread->state != THREAD_STATE_TERMINATED) {
+                    any_running = true;
+                    break;
+                }
+            }
+        }
+        spinlock_release_irqrestore(&threads_lock, flags);
 
-    // Collect IDs first to avoid issues if the list structure changes
-    // during yields (though in this simple scheduler it's circular)
-    do {
-        uint64_t id = current->id;
-        // Don't wait for the current execution flow (kernel main/initial thread)
-        if (id != 0) {
-            enable_interrupts();
-            wait_for_thread(id);
-            disable_interrupts();
+        if (!any_running) {
+            break;
         }
-        current = current->next;
-    } while (current != start_node);
 
-    enable_interrupts();
-}
\ No newline at end of file
+        scheduler_yield();
+    }
+}
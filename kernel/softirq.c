@@ -0,0 +1,96 @@
+#include <cpu.h>
+#include <debug.h>
+#include <interrupts.h>
+#include <scheduler.h>
+#include <smp.h>
+#include <softirq.h>
+
+static void (*softirq_handlers[SOFTIRQ_COUNT])();
+
+void softirq_register(enum softirq_type type, void (*handler)())
+{
+    if (type < SOFTIRQ_COUNT) {
+        softirq_handlers[type] = handler;
+    }
+}
+
+void softirq_raise(enum softirq_type type)
+{
+    uint64_t flags = get_rflags().raw;
+    disable_interrupts();
+    cpu_t *cpu = this_cpu();
+    __atomic_or_fetch(&cpu->softirq_pending, 1U << type, __ATOMIC_RELEASE);
+
+    // Raised from a thread, there is no interrupt exit to pass it on
+    if (cpu->irq_nesting == 0 && cpu->ksoftirqd) {
+        scheduler_wake(cpu->ksoftirqd);
+    }
+    if (flags & (1 << 9)) {
+        enable_interrupts();
+    }
+}
+
+static void softirq_run(cpu_t *cpu)
+{
+    uint32_t pending =
+        __atomic_exchange_n(&cpu->softirq_pending, 0, __ATOMIC_ACQUIRE);
+    while (pending) {
+        int type = __builtin_ctz(pending);
+        pending &= pending - 1;
+        if (softirq_handlers[type]) {
+            softirq_handlers[type]();
+        }
+    }
+}
+
+void softirq_irq_exit(cpu_t *cpu)
+{
+    if (!cpu->softirq_pending) {
+        return;
+    }
+
+    // Until the threads exist the work runs here, as it did in the handler
+    if (cpu->ksoftirqd) {
+        scheduler_wake(cpu->ksoftirqd);
+    } else {
+        softirq_run(cpu);
+    }
+}
+
+static void ksoftirqd(void *arg)
+{
+    cpu_t *cpu = arg;
+
+    while (true) {
+        // The thread is pinned, and with interrupts off nothing on this CPU
+        // can raise a softirq between the check and the block
+        disable_interrupts();
+        if (!cpu->softirq_pending) {
+            scheduler_block_current();
+            scheduler_yield();
+            enable_interrupts();
+            continue;
+        }
+        enable_interrupts();
+        softirq_run(cpu);
+    }
+}
+
+void softirq_start()
+{
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        cpu_t *cpu = smp_get_cpu(i);
+        if (!cpu) {
+            continue;
+        }
+
+        thread_t *thread = thread_create_on_cpu(ksoftirqd, cpu, i);
+        if (!thread) {
+            log_err("Failed to start ksoftirqd on CPU %d", i);
+            continue;
+        }
+        // Bottom halves shouldn't wait behind the threads they interrupted
+        thread_set_priority(thread->id, SCHED_PRIORITY_HIGHEST);
+        cpu->ksoftirqd = thread;
+    }
+}
@@ -1,7 +1,9 @@
 #include <stddef.h>
 
 #include <acpi.h>
+#include <anon.h>
 #include <apic.h>
+#include <clocksource.h>
 #include <cpu.h>
 #include <debug.h>
 #include <framebuffer.h>
@@ -13,27 +15,45 @@
 #include <math.h>
 #include <menu.h>
 #include <pit.h>
+#include <pmm.h>
 #include <resource.h>
 #include <scheduler.h>
+#include <slab.h>
 #include <sound.h>
 #include <stdio.h>
 #include <string.h>
 #include <tests.h>
 #include <timer.h>
+#include <vmm.h>
 
-thread_t *thread1;
-thread_t *thread2;
+static uint64_t thread1_id;
+static uint64_t thread2_id;
+static bool thread1_running;
+static bool thread2_running;
 
 void thread_test()
 {
-    thread1 = thread_create(test_thread1, NULL);
-    thread2 = thread_create(test_thread2, NULL);
+    if (!thread1_running) {
+        thread1_running = thread_spawn(test_thread1, NULL, &thread1_id);
+    }
+    if (!thread2_running) {
+        thread2_running = thread_spawn(test_thread2, NULL, &thread2_id);
+    }
+    if (!thread1_running || !thread2_running) {
+        log_err("Failed to create test threads");
+    }
 }
 
 void cancel_test_threads()
 {
-    thread_cancel(thread1->id);
-    thread_cancel(thread2->id);
+    if (thread1_running) {
+        thread_cancel(thread1_id);
+        thread1_running = false;
+    }
+    if (thread2_running) {
+        thread_cancel(thread2_id);
+        thread2_running = false;
+    }
 }
 
 void test_thread1(void *arg)
@@ -186,12 +206,12 @@ void sin_test()
 
 void pit_test()
 {
-    uint64_t last_check_ticks = pit_ticks;
+    uint64_t last_check_ns = clock_monotonic_ns();
     uint64_t seconds = 0;
     while (true) {
-        if (pit_ticks >= last_check_ticks + 1000) {
+        if (clock_monotonic_ns() >= last_check_ns + NSEC_PER_SEC) {
             seconds++;
-            last_check_ticks = pit_ticks;
+            last_check_ns += NSEC_PER_SEC;
             printf("%lu\r", seconds);
         }
         if (kbd_get_key(false).scancode == KEY_ESC) {
@@ -269,6 +289,12 @@ void apic_test()
     printf("LAPIC ID: 0x%08x\n", id);
     printf("LAPIC Version: 0x%08x\n", ver);
 
+    if (pit_stopped) {
+        printf("PIT stopped, the LAPIC timers drive scheduling\n");
+        kbd_wait_for_esc();
+        return;
+    }
+
     printf("Verifying PIT interrupts through APIC...\n");
     uint64_t start_ticks = pit_ticks;
     wait_ms(100);
@@ -282,4 +308,152 @@ void apic_test()
     }
 
     kbd_wait_for_esc();
-}
\ No newline at end of file
+}
+
+void pmm_buddy_test()
+{
+    printf("Running PMM buddy test...\n");
+
+    void *blocks[PMM_MAX_ORDER + 1];
+    bool aligned_ok = true;
+    bool write_ok = true;
+
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        blocks[order] = pmm_alloc_pages(order);
+        if (!blocks[order]) {
+            printf("Allocation of order %d failed\n", order);
+            continue;
+        }
+
+        uint64_t block_size = (uint64_t)PAGE_SIZE << order;
+        if ((uint64_t)blocks[order] % block_size != 0) {
+            aligned_ok = false;
+        }
+
+        // Touch the first and last byte to check the whole block is usable
+        uint8_t *virt = phys_to_virt(blocks[order]);
+        virt[0] = order;
+        virt[block_size - 1] = order;
+        if (virt[0] != order || virt[block_size - 1] != order) {
+            write_ok = false;
+        }
+    }
+
+    printf("alignment: %s\n", aligned_ok ? "PASS" : "FAIL");
+    printf("write: %s\n", write_ok ? "PASS" : "FAIL");
+
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        if (blocks[order]) {
+            pmm_free_pages(blocks[order], order);
+        }
+    }
+
+    // The largest order should still be available after everything is freed
+    void *big = pmm_alloc_pages(PMM_MAX_ORDER);
+    printf("max order realloc: %s\n", big ? "PASS" : "FAIL");
+    if (big) {
+        pmm_free_pages(big, PMM_MAX_ORDER);
+    }
+
+    kbd_wait_for_esc();
+}
+
+static void slab_test_ctor(void *obj)
+{
+    memset(obj, 0x5A, 48);
+}
+
+void slab_cache_test()
+{
+    printf("Running slab cache test...\n");
+
+    kmem_cache_t *cache =
+        kmem_cache_create("slab_test", 48, 64, slab_test_ctor);
+    if (!cache) {
+        printf("create: FAIL\n");
+        kbd_wait_for_esc();
+        return;
+    }
+
+    // Enough objects to span several slabs
+    void *objs[200];
+    bool aligned_ok = true;
+    bool ctor_ok = true;
+    for (int i = 0; i < 200; i++) {
+        objs[i] = kmem_cache_alloc(cache);
+        if (!objs[i] || (uint64_t)objs[i] % 64 != 0) {
+            aligned_ok = false;
+            continue;
+        }
+        uint8_t *bytes = objs[i];
+        if (bytes[0] != 0x5A || bytes[47] != 0x5A) {
+            ctor_ok = false;
+        }
+    }
+    printf("alignment: %s\n", aligned_ok ? "PASS" : "FAIL");
+    printf("constructor: %s\n", ctor_ok ? "PASS" : "FAIL");
+    printf("in use: %s\n", cache->objs_in_use == 200 ? "PASS" : "FAIL");
+
+    for (int i = 0; i < 200; i++) {
+        kmem_cache_free(cache, objs[i]);
+    }
+
+    // Only the single cached empty slab should be left
+    printf("release: %s\n", cache->objs_in_use == 0 && cache->slab_count == 1
+                                ? "PASS"
+                                : "FAIL");
+
+    kmem_cache_destroy(cache);
+    kbd_wait_for_esc();
+}
+
+void demand_paging_test()
+{
+    printf("Running demand paging test...\n");
+
+    pmm_stats_t before;
+    pmm_stats(&before);
+
+    anon_region_t *region =
+        anon_create(64 * PAGE_SIZE, VMM_PRESENT | VMM_WRITE);
+    if (!region) {
+        printf("create: FAIL\n");
+        kbd_wait_for_esc();
+        return;
+    }
+
+    // Touch three scattered pages; each should fault in already zeroed
+    uint8_t *base = (uint8_t *)region->start;
+    bool zero_ok = true;
+    for (int i = 0; i < 64; i += 30) {
+        uint8_t *page = base + i * PAGE_SIZE;
+        if (page[0] != 0 || page[PAGE_SIZE - 1] != 0) {
+            zero_ok = false;
+        }
+        memset(page, 0xA5, PAGE_SIZE);
+    }
+    printf("zero fill: %s\n", zero_ok ? "PASS" : "FAIL");
+
+    pmm_stats_t touched;
+    pmm_stats(&touched);
+    // The zero pool counts as free here, since the zeroing thread may be
+    // refilling it while the test runs
+    uint64_t before_free = before.free_pages + before.zeroed_pages;
+    uint64_t touched_free = touched.free_pages + touched.zeroed_pages;
+    // Fewer than 16 pages gone, without wrapping if the pool grew meanwhile
+    printf("commit on touch: %s\n",
+           touched_free + 16 > before_free ? "PASS" : "FAIL");
+
+    anon_discard(region, base, PAGE_SIZE);
+    printf("discard: %s\n", base[0] == 0 && base[30 * PAGE_SIZE] == 0xA5
+                                 ? "PASS"
+                                 : "FAIL");
+
+    anon_destroy(region);
+    pmm_stats_t after;
+    pmm_stats(&after);
+    uint64_t after_free = after.free_pages + after.zeroed_pages;
+    printf("release: %s\n", after_free >= touched_free + 3 ? "PASS" : "FAIL");
+
+    kbd_wait_for_esc();
+}
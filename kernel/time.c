@@ -1,5 +1,6 @@
 #include <stdbool.h>
 
+#include <clocksource.h>
 #include <cmos.h>
 #include <debug.h>
 #include <stdio.h>
@@ -66,8 +67,50 @@ static uint8_t days_in_month(uint8_t month, uint16_t year)
     }
 }
 
+uint64_t datetime_to_unix(const datetime_t *dt)
+{
+    uint64_t days = 0;
+    for (uint16_t year = 1970; year < dt->year; year++) {
+        days += is_leap_year(year) ? 366 : 365;
+    }
+    for (uint8_t month = 1; month < dt->month; month++) {
+        days += days_in_month(month, dt->year);
+    }
+    days += dt->day - 1;
+    return ((days * 24 + dt->hour) * 60 + dt->minute) * 60 + dt->second;
+}
+
+datetime_t unix_to_datetime(uint64_t seconds)
+{
+    datetime_t dt;
+    uint64_t days = seconds / 86400;
+    uint32_t rest = seconds % 86400;
+    dt.hour = rest / 3600;
+    dt.minute = rest / 60 % 60;
+    dt.second = rest % 60;
+
+    dt.year = 1970;
+    while (days >= (is_leap_year(dt.year) ? 366u : 365u)) {
+        days -= is_leap_year(dt.year) ? 366 : 365;
+        dt.year++;
+    }
+    dt.month = 1;
+    while (days >= days_in_month(dt.month, dt.year)) {
+        days -= days_in_month(dt.month, dt.year);
+        dt.month++;
+    }
+    dt.day = days + 1;
+    return dt;
+}
+
 datetime_t get_datetime()
 {
+    // The CMOS clock is slow to read, so it's only read again if the
+    // clocksource hasn't anchored the real time yet
+    uint64_t ns = clock_realtime_ns();
+    if (ns != 0) {
+        return unix_to_datetime(ns / NSEC_PER_SEC);
+    }
     datetime_t dt;
     cmos_get_datetime(&dt);
     return dt;
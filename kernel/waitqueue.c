@@ -1,55 +1,105 @@
-#include <heap.h>
-#include <interrupts.h>
 #include <scheduler.h>
 #include <waitqueue.h>
 
 void waitqueue_init(waitqueue_t *wq)
 {
     wq->head = NULL;
+    wq->tail = NULL;
+    wq->lock = (spinlock_t){0, "waitqueue"};
 }
 
-void waitqueue_sleep(waitqueue_t *wq)
+// Callers hold the queue's lock
+static void waitqueue_unlink(waitqueue_t *wq, wq_node_t *node)
 {
-    disable_interrupts();
-
-    wq_node_t *node = malloc(sizeof(wq_node_t));
-    node->thread_id = scheduler_get_current_id();
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        wq->head = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    } else {
+        wq->tail = node->prev;
+    }
     node->next = NULL;
+    node->prev = NULL;
+    __atomic_store_n(&node->queue, NULL, __ATOMIC_RELEASE);
+}
 
-    if (!wq->head) {
-        wq->head = node;
+void waitqueue_sleep_locked(waitqueue_t *wq, uint64_t flags)
+{
+    wq_node_t *node = &scheduler_get_current()->wait_node;
+
+    node->next = NULL;
+    node->prev = wq->tail;
+    if (wq->tail) {
+        wq->tail->next = node;
     } else {
-        wq_node_t *tail = wq->head;
-        while (tail->next)
-            tail = tail->next;
-        tail->next = node;
+        wq->head = node;
     }
+    wq->tail = node;
+    node->queue = wq;
 
+    // A wakeup between here and the yield finds the thread already blocked
+    // and puts it straight back on its run queue
     scheduler_block_current();
-    enable_interrupts();
+    spinlock_release_irqrestore(&wq->lock, flags);
     scheduler_yield();
+
+    // Unblocked by something other than this queue
+    waitqueue_cancel(node);
 }
 
-void waitqueue_wake_one(waitqueue_t *wq)
+void waitqueue_sleep(waitqueue_t *wq)
 {
-    disable_interrupts();
-    if (wq->head) {
-        wq_node_t *node = wq->head;
-        wq->head = node->next;
-        scheduler_unblock(node->thread_id);
-        free(node);
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+    waitqueue_sleep_locked(wq, flags);
+}
+
+// The waker holds the queue's lock until the thread is made ready, so a
+// thread that exits in between isn't reclaimed under it
+void waitqueue_wake_one_locked(waitqueue_t *wq)
+{
+    wq_node_t *node = wq->head;
+    if (node) {
+        waitqueue_unlink(wq, node);
+        scheduler_wake(node->thread);
     }
-    enable_interrupts();
 }
 
-void waitqueue_wake_all(waitqueue_t *wq)
+void waitqueue_wake_all_locked(waitqueue_t *wq)
 {
-    disable_interrupts();
     while (wq->head) {
         wq_node_t *node = wq->head;
-        wq->head = node->next;
-        scheduler_unblock(node->thread_id);
-        free(node);
+        waitqueue_unlink(wq, node);
+        scheduler_wake(node->thread);
+    }
+}
+
+void waitqueue_wake_one(waitqueue_t *wq)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+    waitqueue_wake_one_locked(wq);
+    spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+void waitqueue_wake_all(waitqueue_t *wq)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+    waitqueue_wake_all_locked(wq);
+    spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+void waitqueue_cancel(wq_node_t *node)
+{
+    waitqueue_t *wq = __atomic_load_n(&node->queue, __ATOMIC_ACQUIRE);
+    if (!wq) {
+        return;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+    if (node->queue == wq) {
+        waitqueue_unlink(wq, node);
     }
-    enable_interrupts();
+    spinlock_release_irqrestore(&wq->lock, flags);
 }
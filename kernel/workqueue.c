@@ -0,0 +1,197 @@
+#include <cpu.h>
+#include <debug.h>
+#include <scheduler.h>
+#include <smp.h>
+#include <workqueue.h>
+
+// Each worker thread's state, on its own stack
+typedef struct worker {
+    // Position of the item being run in the queue's order
+    uint64_t seq;
+    bool busy;
+    struct worker *next;
+} worker_t;
+
+workqueue_t system_wq = {
+    .name = "system",
+    .idle = {NULL, NULL, {0, "workqueue"}},
+    .flushers = {NULL, NULL, {0, "workqueue_flush"}},
+};
+
+void workqueue_init(workqueue_t *wq, const char *name)
+{
+    wq->name = name;
+    wq->head = NULL;
+    wq->tail = NULL;
+    waitqueue_init(&wq->idle);
+    wq->idle.lock.name = "workqueue";
+    wq->queued = 0;
+    wq->started = 0;
+    wq->workers = NULL;
+    waitqueue_init(&wq->flushers);
+    wq->flushers.lock.name = "workqueue_flush";
+}
+
+void work_init(work_t *work, void (*func)(void *), void *arg)
+{
+    work->func = func;
+    work->arg = arg;
+    work->next = NULL;
+    work->pending = false;
+}
+
+static void worker(void *arg)
+{
+    workqueue_t *wq = arg;
+    worker_t self = {0, false, NULL};
+
+    uint64_t flags = spinlock_acquire_irqsave(&wq->idle.lock);
+    self.next = wq->workers;
+    wq->workers = &self;
+    while (true) {
+        while (!wq->head) {
+            waitqueue_sleep_locked(&wq->idle, flags);
+            flags = spinlock_acquire_irqsave(&wq->idle.lock);
+        }
+
+        work_t *work = wq->head;
+        wq->head = work->next;
+        if (!wq->head) {
+            wq->tail = NULL;
+        }
+        work->next = NULL;
+        work->pending = false;
+        self.seq = wq->started++;
+        self.busy = true;
+        spinlock_release_irqrestore(&wq->idle.lock, flags);
+
+        // The item may be freed or queued again by its own function, so it
+        // isn't touched afterwards
+        work->func(work->arg);
+
+        flags = spinlock_acquire_irqsave(&wq->idle.lock);
+        self.busy = false;
+        spinlock_release_irqrestore(&wq->idle.lock, flags);
+        waitqueue_wake_all(&wq->flushers);
+
+        flags = spinlock_acquire_irqsave(&wq->idle.lock);
+    }
+}
+
+bool workqueue_start(workqueue_t *wq, uint32_t workers, uint32_t cpu)
+{
+    for (uint32_t i = 0; i < workers; i++) {
+        thread_t *thread = cpu == WORKQUEUE_ANY_CPU
+                               ? thread_create(worker, wq)
+                               : thread_create_on_cpu(worker, wq, cpu);
+        if (!thread) {
+            log_err("Workqueue %s: Failed to start worker %d", wq->name, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+void workqueue_start_system()
+{
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        if (smp_get_cpu(i)) {
+            workqueue_start(&system_wq, 1, i);
+        }
+    }
+}
+
+bool queue_work(workqueue_t *wq, work_t *work)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&wq->idle.lock);
+    if (work->pending) {
+        spinlock_release_irqrestore(&wq->idle.lock, flags);
+        return false;
+    }
+
+    work->pending = true;
+    work->next = NULL;
+    if (wq->tail) {
+        wq->tail->next = work;
+    } else {
+        wq->head = work;
+    }
+    wq->tail = work;
+    wq->queued++;
+
+    waitqueue_wake_one_locked(&wq->idle);
+    spinlock_release_irqrestore(&wq->idle.lock, flags);
+    return true;
+}
+
+// Whether the first `target` items queued have all finished. Items finish
+// out of order with several workers, so a plain count of finished ones
+// isn't enough. Callers hold the idle lock.
+static bool flushed(workqueue_t *wq, uint64_t target)
+{
+    if (wq->started < target) {
+        return false;
+    }
+    for (worker_t *w = wq->workers; w; w = w->next) {
+        if (w->busy && w->seq < target) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void workqueue_flush(workqueue_t *wq)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&wq->idle.lock);
+    uint64_t target = wq->queued;
+    spinlock_release_irqrestore(&wq->idle.lock, flags);
+
+    // Workers update their state before waking the flushers, so one
+    // finishing between the check and the sleep still finds this thread
+    // queued
+    flags = spinlock_acquire_irqsave(&wq->flushers.lock);
+    while (true) {
+        spinlock_acquire(&wq->idle.lock);
+        bool done = flushed(wq, target);
+        spinlock_release(&wq->idle.lock);
+        if (done) {
+            break;
+        }
+        waitqueue_sleep_locked(&wq->flushers, flags);
+        flags = spinlock_acquire_irqsave(&wq->flushers.lock);
+    }
+    spinlock_release_irqrestore(&wq->flushers.lock, flags);
+}
+
+static void delayed_work_timer(void *arg)
+{
+    delayed_work_t *dwork = arg;
+    queue_work(dwork->wq, &dwork->work);
+}
+
+void delayed_work_init(delayed_work_t *dwork, void (*func)(void *),
+                       void *arg)
+{
+    work_init(&dwork->work, func, arg);
+    timer_event_init(&dwork->timer, delayed_work_timer, dwork);
+    dwork->wq = NULL;
+}
+
+bool queue_delayed_work(workqueue_t *wq, delayed_work_t *dwork,
+                        uint64_t delay_ns)
+{
+    if (dwork->timer.index >= 0 || dwork->work.pending) {
+        return false;
+    }
+
+    dwork->wq = wq;
+    if (delay_ns == 0) {
+        return queue_work(wq, &dwork->work);
+    }
+    return timer_event_add(&dwork->timer, get_ts() + delay_ns);
+}
+
+bool cancel_delayed_work(delayed_work_t *dwork)
+{
+    return timer_event_cancel(&dwork->timer);
+}
@@ -1,95 +1,477 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <anon.h>
+#include <debug.h>
 #include <heap.h>
+#include <lock.h>
 #include <panic.h>
 #include <stddef.h>
 #include <string.h>
+#include <vmm.h>
 
-static uint8_t heap[HEAP_SIZE];
+// Blocks carry their size in a header and a footer (boundary tags), so both
+// neighbours can be found when coalescing. Sizes are multiples of 16, which
+// leaves the low bits of each tag free for the allocated flag.
+#define HEAP_ALIGN 16
+#define TAG_SIZE sizeof(size_t)
+#define TAG_ALLOC 1
+#define MIN_BLOCK 32
 
-typedef struct block {
-    size_t size;
-    bool free;
-    struct block *next;
-} block_t;
+// Free blocks keep their list links right after the header
+typedef struct free_block {
+    size_t header;
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
 
-static block_t *heap_start = (void *)heap;
+static uint8_t heap[HEAP_SIZE] __attribute__((aligned(HEAP_ALIGN)));
 
-void heap_init()
+static free_block_t *free_lists[HEAP_CLASSES];
+static uint32_t class_mask;
+static uintptr_t grow_end = HEAP_GROW_START;
+static anon_region_t *grow_region;
+static size_t heap_used;
+static size_t heap_total;
+static spinlock_t heap_lock = {0, "heap"};
+
+// Allocation profiler state. Live blocks are found by address in an open
+// addressing table so frees can be charged back to the site that allocated
+// them.
+typedef struct {
+    uintptr_t block;
+    int site;
+} prof_live_t;
+
+static bool prof_enabled;
+static heap_site_t prof_sites[HEAP_PROF_MAX_SITES];
+static prof_live_t prof_live[HEAP_PROF_MAX_LIVE];
+static size_t prof_live_count;
+static uint64_t prof_dropped;
+
+static size_t align_up(size_t value, size_t align)
 {
-    heap_start->size = HEAP_SIZE - sizeof(block_t);
-    heap_start->free = true;
-    heap_start->next = NULL;
+    return (value + align - 1) & ~(align - 1);
 }
 
-void *malloc(size_t size)
+static size_t tag_size(size_t tag)
 {
-    block_t *curr = heap_start;
+    return tag & ~(size_t)(HEAP_ALIGN - 1);
+}
 
-    while (curr) {
-        if (curr->free && curr->size >= size) {
-            if (curr->size > size + sizeof(block_t)) {
-                block_t *new_block =
-                    (block_t *)((uint8_t *)curr + sizeof(block_t) + size);
+static size_t block_size(uint8_t *block)
+{
+    return tag_size(*(size_t *)block);
+}
 
-                new_block->size = curr->size - size - sizeof(block_t);
-                new_block->free = true;
-                new_block->next = curr->next;
-                curr->next = new_block;
-                curr->size = size;
-            }
+static bool block_allocated(uint8_t *block)
+{
+    return *(size_t *)block & TAG_ALLOC;
+}
 
-            curr->free = false;
-            return (void *)((uint8_t *)curr + sizeof(block_t));
+static void set_tags(uint8_t *block, size_t size, bool allocated)
+{
+    size_t tag = size | (allocated ? TAG_ALLOC : 0);
+    *(size_t *)block = tag;
+    *(size_t *)(block + size - TAG_SIZE) = tag;
+}
+
+static int size_class(size_t size)
+{
+    int cls = 63 - __builtin_clzll(size) - HEAP_MIN_CLASS_SHIFT;
+    return cls < HEAP_CLASSES ? cls : HEAP_CLASSES - 1;
+}
+
+static void list_insert(uint8_t *block)
+{
+    free_block_t *node = (free_block_t *)block;
+    int cls = size_class(block_size(block));
+
+    node->prev = NULL;
+    node->next = free_lists[cls];
+    if (free_lists[cls]) {
+        free_lists[cls]->prev = node;
+    }
+    free_lists[cls] = node;
+    class_mask |= 1U << cls;
+}
+
+static void list_remove(uint8_t *block)
+{
+    free_block_t *node = (free_block_t *)block;
+    int cls = size_class(block_size(block));
+
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        free_lists[cls] = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+    if (!free_lists[cls]) {
+        class_mask &= ~(1U << cls);
+    }
+}
+
+/**
+ * @brief Marks a block free, merges it with any free neighbours and puts the
+ * result on its free list.
+ */
+static void release_block(uint8_t *block, size_t size)
+{
+    uint8_t *next = block + size;
+    if (!block_allocated(next)) {
+        list_remove(next);
+        size += block_size(next);
+    }
+
+    size_t prev_tag = *(size_t *)(block - TAG_SIZE);
+    if (!(prev_tag & TAG_ALLOC)) {
+        block -= tag_size(prev_tag);
+        list_remove(block);
+        size += tag_size(prev_tag);
+    }
+
+    set_tags(block, size, false);
+    list_insert(block);
+}
+
+/**
+ * @brief Sets up a region as an arena: an allocated prologue block, one free
+ * block covering the rest, and a zero-sized allocated epilogue header.
+ */
+static void arena_init(uint8_t *base, size_t bytes)
+{
+    // The prologue starts one tag in so payloads land on 16-byte boundaries
+    uint8_t *prologue = base + TAG_SIZE;
+    set_tags(prologue, HEAP_ALIGN, true);
+
+    uint8_t *first = prologue + HEAP_ALIGN;
+    size_t size = bytes - 2 * HEAP_ALIGN;
+    *(size_t *)(first + size) = TAG_ALLOC;
+    set_tags(first, size, false);
+    list_insert(first);
+
+    heap_total += bytes;
+}
+
+/**
+ * @brief Extends the heap by at least `bytes` into the growth window. Nothing
+ * is mapped here; the pages are faulted in as the heap first touches them.
+ */
+static bool heap_grow(size_t bytes)
+{
+    bytes = align_up(bytes + 2 * HEAP_ALIGN, HEAP_GROW_MIN);
+    if (grow_end + bytes - 1 > HEAP_GROW_END) {
+        log_err("heap: Growth window exhausted");
+        return false;
+    }
+
+    if (!grow_region) {
+        grow_region = anon_create_at((void *)HEAP_GROW_START,
+                                     HEAP_GROW_END - HEAP_GROW_START + 1,
+                                     VMM_PRESENT | VMM_WRITE);
+        if (!grow_region) {
+            log_err("heap: Failed to reserve the growth window");
+            return false;
         }
-        curr = curr->next;
     }
 
+    if (grow_end == HEAP_GROW_START) {
+        arena_init((uint8_t *)grow_end, bytes);
+    } else {
+        // The old epilogue header becomes the header of the new block
+        uint8_t *block = (uint8_t *)grow_end - TAG_SIZE;
+        *(size_t *)(block + bytes) = TAG_ALLOC;
+        release_block(block, bytes);
+        heap_total += bytes;
+    }
+    grow_end += bytes;
+    return true;
+}
+
+static uint8_t *find_fit(size_t size)
+{
+    int cls = size_class(size);
+
+    // Blocks in the request's own class may still be too small
+    for (free_block_t *node = free_lists[cls]; node; node = node->next) {
+        if (tag_size(node->header) >= size) {
+            return (uint8_t *)node;
+        }
+    }
+
+    // Any block in a larger class is big enough
+    uint32_t larger = cls + 1 < HEAP_CLASSES ? class_mask >> (cls + 1) : 0;
+    if (larger) {
+        return (uint8_t *)free_lists[cls + 1 + __builtin_ctz(larger)];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Marks the first `size` bytes of a block allocated and returns any
+ * large enough remainder to the free lists.
+ */
+static void place(uint8_t *block, size_t block_sz, size_t size)
+{
+    if (block_sz - size >= MIN_BLOCK) {
+        set_tags(block, size, true);
+        release_block(block + size, block_sz - size);
+    } else {
+        set_tags(block, block_sz, true);
+    }
+}
+
+// Returns the block size needed for a request, or 0 if it can never fit
+static size_t request_size(size_t size)
+{
+    if (size > HEAP_GROW_END - HEAP_GROW_START) {
+        return 0;
+    }
+    size = align_up(size + 2 * TAG_SIZE, HEAP_ALIGN);
+    return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
+// Fibonacci hashing. The top bits of the product depend on every bit of the
+// key, so return addresses, which have no particular alignment, hash as well
+// as block addresses do
+static size_t prof_hash(uintptr_t key, size_t slots)
+{
+    uint64_t hash = key * 0x9E3779B97F4A7C15ULL;
+    return hash >> (64 - __builtin_ctzll(slots));
+}
+
+static int prof_site_index(uintptr_t caller)
+{
+    size_t i = prof_hash(caller, HEAP_PROF_MAX_SITES);
+    for (int probe = 0; probe < HEAP_PROF_MAX_SITES; probe++) {
+        heap_site_t *site = &prof_sites[i];
+        if (site->caller == caller) {
+            return i;
+        }
+        if (site->caller == 0) {
+            site->caller = caller;
+            return i;
+        }
+        i = (i + 1) % HEAP_PROF_MAX_SITES;
+    }
+    return -1;
+}
+
+static prof_live_t *prof_live_find(uintptr_t block)
+{
+    size_t i = prof_hash(block, HEAP_PROF_MAX_LIVE);
+    while (prof_live[i].block) {
+        if (prof_live[i].block == block) {
+            return &prof_live[i];
+        }
+        i = (i + 1) % HEAP_PROF_MAX_LIVE;
+    }
     return NULL;
 }
 
+/**
+ * @brief Removes a live entry, shifting later entries of the same probe run
+ * back so lookups never need tombstones.
+ */
+static void prof_live_remove(prof_live_t *entry)
+{
+    size_t hole = entry - prof_live;
+    size_t i = hole;
+    while (true) {
+        i = (i + 1) % HEAP_PROF_MAX_LIVE;
+        if (!prof_live[i].block) {
+            break;
+        }
+        // Move the entry back unless its home slot lies after the hole
+        size_t home = prof_hash(prof_live[i].block, HEAP_PROF_MAX_LIVE);
+        if ((i - home) % HEAP_PROF_MAX_LIVE >=
+            (i - hole) % HEAP_PROF_MAX_LIVE) {
+            prof_live[hole] = prof_live[i];
+            hole = i;
+        }
+    }
+    prof_live[hole].block = 0;
+    prof_live_count--;
+}
+
+static void prof_site_grow(heap_site_t *site, int64_t bytes)
+{
+    site->live_bytes += bytes;
+    if (site->live_bytes > site->peak_bytes) {
+        site->peak_bytes = site->live_bytes;
+    }
+}
+
+static void prof_alloc(uint8_t *block, uintptr_t caller, uint64_t cycles)
+{
+    int index = prof_site_index(caller);
+    if (index < 0) {
+        prof_dropped++;
+        return;
+    }
+
+    heap_site_t *site = &prof_sites[index];
+    site->allocs++;
+    site->bytes += block_size(block);
+    site->cycles += cycles;
+
+    // Keep the table at most three quarters full so probe runs stay short
+    if (prof_live_count >= HEAP_PROF_MAX_LIVE / 4 * 3) {
+        prof_dropped++;
+        return;
+    }
+    size_t i = prof_hash((uintptr_t)block, HEAP_PROF_MAX_LIVE);
+    while (prof_live[i].block) {
+        i = (i + 1) % HEAP_PROF_MAX_LIVE;
+    }
+    prof_live[i].block = (uintptr_t)block;
+    prof_live[i].site = index;
+    prof_live_count++;
+    prof_site_grow(site, block_size(block));
+}
+
+static void prof_free(uint8_t *block)
+{
+    prof_live_t *entry = prof_live_find((uintptr_t)block);
+    if (!entry) {
+        return;
+    }
+
+    heap_site_t *site = &prof_sites[entry->site];
+    site->frees++;
+    site->live_bytes -= block_size(block);
+    prof_live_remove(entry);
+}
+
+static void prof_resize(uint8_t *block, size_t old_size)
+{
+    prof_live_t *entry = prof_live_find((uintptr_t)block);
+    if (entry) {
+        prof_site_grow(&prof_sites[entry->site],
+                       (int64_t)block_size(block) - (int64_t)old_size);
+    }
+}
+
+void heap_init()
+{
+    arena_init(heap, HEAP_SIZE);
+}
+
+static void *heap_alloc(size_t size, uintptr_t caller)
+{
+    size_t asize = request_size(size);
+    if (asize == 0) {
+        return NULL;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&heap_lock);
+    uint64_t start = prof_enabled ? __builtin_ia32_rdtsc() : 0;
+
+    uint8_t *block = find_fit(asize);
+    if (!block && heap_grow(asize)) {
+        block = find_fit(asize);
+    }
+    if (!block) {
+        spinlock_release_irqrestore(&heap_lock, flags);
+        return NULL;
+    }
+
+    list_remove(block);
+    place(block, block_size(block), asize);
+    heap_used += block_size(block);
+
+    if (prof_enabled) {
+        prof_alloc(block, caller, __builtin_ia32_rdtsc() - start);
+    }
+
+    spinlock_release_irqrestore(&heap_lock, flags);
+    return block + TAG_SIZE;
+}
+
+void *malloc(size_t size)
+{
+    return heap_alloc(size, (uintptr_t)__builtin_return_address(0));
+}
+
 void free(void *ptr)
 {
     if (!ptr) {
         return;
     }
 
-    block_t *block_to_free = (block_t *)((uint8_t *)ptr - sizeof(block_t));
+    uint8_t *block = (uint8_t *)ptr - TAG_SIZE;
+    uint64_t flags = spinlock_acquire_irqsave(&heap_lock);
 
-    block_to_free->free = true;
-
-    if (block_to_free->next && block_to_free->next->free) {
-        block_to_free->size += sizeof(block_t) + block_to_free->next->size;
+    if (!block_allocated(block)) {
+        spinlock_release_irqrestore(&heap_lock, flags);
+        log_err("heap: Double free of 0x%lx", ptr);
+        return;
+    }
 
-        block_to_free->next = block_to_free->next->next;
+    if (prof_enabled) {
+        prof_free(block);
     }
+
+    size_t size = block_size(block);
+    heap_used -= size;
+    release_block(block, size);
+
+    spinlock_release_irqrestore(&heap_lock, flags);
 }
 
 void *realloc(void *ptr, size_t size)
 {
+    uintptr_t caller = (uintptr_t)__builtin_return_address(0);
+
     if (!ptr) {
-        return malloc(size);
+        return heap_alloc(size, caller);
     }
 
-    block_t *block = (block_t *)((uint8_t *)ptr - sizeof(block_t));
-
     if (size == 0) {
         free(ptr);
         return NULL;
     }
 
-    if (block->size >= size) {
-        // enough space is available, can return original pointer
+    uint8_t *block = (uint8_t *)ptr - TAG_SIZE;
+    size_t asize = request_size(size);
+    if (asize == 0) {
+        return NULL;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&heap_lock);
+
+    size_t current = block_size(block);
+    uint8_t *next = block + current;
+    size_t available = current;
+    if (!block_allocated(next)) {
+        available += block_size(next);
+    }
+
+    if (available >= asize) {
+        // Shrink, or grow into the free block that follows
+        if (available > current) {
+            list_remove(next);
+        }
+        place(block, available, asize);
+        heap_used += block_size(block) - current;
+        if (prof_enabled) {
+            prof_resize(block, current);
+        }
+        spinlock_release_irqrestore(&heap_lock, flags);
         return ptr;
     }
 
-    void *new_ptr = malloc(size);
+    spinlock_release_irqrestore(&heap_lock, flags);
+
+    void *new_ptr = heap_alloc(size, caller);
     if (!new_ptr) {
         return NULL;
     }
 
-    memcpy(new_ptr, ptr, block->size);
+    memcpy(new_ptr, ptr, current - 2 * TAG_SIZE);
     free(ptr);
     return new_ptr;
 }
@@ -97,10 +479,28 @@ void *realloc(void *ptr, size_t size)
 void *calloc(size_t nmemb, size_t size)
 {
     size_t total = nmemb * size;
-    void *ptr = malloc(total);
-    if (ptr) {
+    void *ptr = heap_alloc(total, (uintptr_t)__builtin_return_address(0));
+    if (!ptr) {
+        return NULL;
+    }
+
+    // The seed region lives in the kernel image and is always mapped
+    if (total < HEAP_CALLOC_DISCARD || !grow_region ||
+        !anon_contains(grow_region, ptr)) {
         memset(ptr, 0, total);
+        return ptr;
     }
+
+    uintptr_t start = (uintptr_t)ptr;
+
+    // Only the partial pages at either end need clearing; the whole pages in
+    // between are dropped and read as zero when next touched
+    uintptr_t end = start + total;
+    uintptr_t first_page = align_up(start, PAGE_SIZE);
+    uintptr_t last_page = end & ~(uintptr_t)(PAGE_SIZE - 1);
+    memset(ptr, 0, first_page - start);
+    memset((void *)last_page, 0, end - last_page);
+    anon_discard(grow_region, (void *)first_page, last_page - first_page);
     return ptr;
 }
 
@@ -111,13 +511,66 @@ void abort(void)
 
 size_t heap_get_used_memory()
 {
-    size_t used_memory = 0;
-    block_t *curr = heap_start;
-    while (curr) {
-        if (!curr->free) {
-            used_memory += curr->size + sizeof(block_t);
+    return heap_used;
+}
+
+size_t heap_get_total_memory()
+{
+    return heap_total;
+}
+
+void heap_profile_enable(bool enable)
+{
+    prof_enabled = enable;
+}
+
+bool heap_profile_enabled()
+{
+    return prof_enabled;
+}
+
+void heap_profile_reset()
+{
+    uint64_t flags = spinlock_acquire_irqsave(&heap_lock);
+    memset(prof_sites, 0, sizeof(prof_sites));
+    memset(prof_live, 0, sizeof(prof_live));
+    prof_live_count = 0;
+    prof_dropped = 0;
+    spinlock_release_irqrestore(&heap_lock, flags);
+}
+
+bool heap_profile_site(int index, heap_site_t *site)
+{
+    if (index < 0 || index >= HEAP_PROF_MAX_SITES) {
+        return false;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&heap_lock);
+    *site = prof_sites[index];
+    spinlock_release_irqrestore(&heap_lock, flags);
+    return site->caller != 0;
+}
+
+uint64_t heap_profile_dropped()
+{
+    return prof_dropped;
+}
+
+void heap_frag_stats(heap_frag_t *stats)
+{
+    memset(stats, 0, sizeof(heap_frag_t));
+
+    uint64_t flags = spinlock_acquire_irqsave(&heap_lock);
+    for (int cls = 0; cls < HEAP_CLASSES; cls++) {
+        for (free_block_t *node = free_lists[cls]; node; node = node->next) {
+            size_t size = tag_size(node->header);
+            stats->free_blocks[cls]++;
+            stats->free_bytes[cls] += size;
+            stats->total_free += size;
+            if (size > stats->largest_free) {
+                stats->largest_free = size;
+            }
         }
-        curr = curr->next;
     }
-    return used_memory;
-}
\ No newline at end of file
+    spinlock_release_irqrestore(&heap_lock, flags);
+}
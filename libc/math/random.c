@@ -1,6 +1,6 @@
+#include <clocksource.h>
 #include <debug.h>
 #include <math.h>
-#include <pit.h>
 #include <stdint.h>
 
 static unsigned long int next = 1;
@@ -19,7 +19,7 @@ size_t rand(void)
 size_t random_range(size_t min, size_t max)
 {
     if (next == 1) {
-        srand(pit_ticks);
+        srand(clock_monotonic_ns());
     }
     if (min > max) {
         log_err("random_range: min cannot be greater than max");
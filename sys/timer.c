@@ -1,26 +1,213 @@
 #include <stddef.h>
 
+#include <clocksource.h>
 #include <cpu.h>
 #include <interrupts.h>
 #include <pit.h>
+#include <scheduler.h>
+#include <smp.h>
 #include <timer.h>
 
-static uint64_t tsc_freq_hz = 0;
-static uint64_t tsc_at_boot = 0;
+// Shorter waits aren't worth a trip through the scheduler
+#define WAIT_SLEEP_MIN_NS 20000
 
-void wait_ms(uint64_t ms)
+// Each CPU keeps its pending events in a binary min-heap on the deadline, so
+// adding and cancelling are O(log n) and the next deadline is always at the
+// root. Callers hold the CPU's timer_lock.
+static void heap_set(cpu_t *cpu, uint32_t index, timer_event_t *event)
 {
-    if (!pit_initialised) {
+    cpu->timers[index] = event;
+    event->index = index;
+}
+
+static void heap_sift_up(cpu_t *cpu, uint32_t index)
+{
+    timer_event_t *event = cpu->timers[index];
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (cpu->timers[parent]->deadline <= event->deadline) {
+            break;
+        }
+        heap_set(cpu, index, cpu->timers[parent]);
+        index = parent;
+    }
+    heap_set(cpu, index, event);
+}
+
+static void heap_sift_down(cpu_t *cpu, uint32_t index)
+{
+    timer_event_t *event = cpu->timers[index];
+    while (true) {
+        uint32_t child = index * 2 + 1;
+        if (child >= cpu->timer_count) {
+            break;
+        }
+        if (child + 1 < cpu->timer_count &&
+            cpu->timers[child + 1]->deadline < cpu->timers[child]->deadline) {
+            child++;
+        }
+        if (event->deadline <= cpu->timers[child]->deadline) {
+            break;
+        }
+        heap_set(cpu, index, cpu->timers[child]);
+        index = child;
+    }
+    heap_set(cpu, index, event);
+}
+
+static void heap_remove(cpu_t *cpu, timer_event_t *event)
+{
+    uint32_t index = event->index;
+    timer_event_t *last = cpu->timers[--cpu->timer_count];
+    event->index = -1;
+
+    if (last == event) {
         return;
     }
-    size_t eticks = pit_ticks + ms;
-    while (pit_ticks < eticks) {
+    heap_set(cpu, index, last);
+    if (index > 0 &&
+        cpu->timers[(index - 1) / 2]->deadline > last->deadline) {
+        heap_sift_up(cpu, index);
+    } else {
+        heap_sift_down(cpu, index);
+    }
+}
+
+void timer_event_init(timer_event_t *event, void (*callback)(void *),
+                      void *arg)
+{
+    event->deadline = 0;
+    event->callback = callback;
+    event->arg = arg;
+    event->cpu = 0;
+    event->index = -1;
+}
+
+bool timer_event_add(timer_event_t *event, uint64_t deadline)
+{
+    uint64_t flags = get_rflags().raw;
+    disable_interrupts();
+    cpu_t *cpu = this_cpu();
+    spinlock_acquire(&cpu->timer_lock);
+
+    if (cpu->timer_count >= TIMER_MAX_PENDING) {
+        spinlock_release_irqrestore(&cpu->timer_lock, flags);
+        return false;
+    }
+
+    event->deadline = deadline;
+    __atomic_store_n(&event->cpu, cpu->id, __ATOMIC_RELEASE);
+    cpu->timers[cpu->timer_count] = event;
+    heap_sift_up(cpu, cpu->timer_count++);
+    bool earliest = event->index == 0;
+
+    spinlock_release(&cpu->timer_lock);
+
+    // The timer may be armed for later than this
+    if (earliest) {
+        scheduler_rearm_timer();
+    }
+    if (flags & (1 << 9)) {
+        enable_interrupts();
+    }
+    return true;
+}
+
+bool timer_event_cancel(timer_event_t *event)
+{
+    if (event->index < 0) {
+        return false;
+    }
+
+    // The event can fire and be added again on another CPU before the lock
+    // is taken, so the CPU is checked again under it
+    cpu_t *cpu;
+    uint64_t flags;
+    while (true) {
+        uint32_t id = __atomic_load_n(&event->cpu, __ATOMIC_ACQUIRE);
+        cpu = smp_get_cpu(id);
+        flags = spinlock_acquire_irqsave(&cpu->timer_lock);
+        if (event->cpu == id) {
+            break;
+        }
+        spinlock_release_irqrestore(&cpu->timer_lock, flags);
+    }
+
+    bool pending = event->index >= 0;
+    if (pending) {
+        heap_remove(cpu, event);
+    }
+    spinlock_release_irqrestore(&cpu->timer_lock, flags);
+    return pending;
+}
+
+void timer_run_expired()
+{
+    cpu_t *cpu = this_cpu();
+    uint64_t now = get_ts();
+
+    while (true) {
+        spinlock_acquire(&cpu->timer_lock);
+        if (cpu->timer_count == 0 || cpu->timers[0]->deadline > now) {
+            spinlock_release(&cpu->timer_lock);
+            break;
+        }
+
+        // The event may be freed by whoever its callback wakes, so copy the
+        // callback out before dropping the lock
+        timer_event_t *event = cpu->timers[0];
+        void (*callback)(void *) = event->callback;
+        void *arg = event->arg;
+        heap_remove(cpu, event);
+        spinlock_release(&cpu->timer_lock);
+
+        callback(arg);
+    }
+}
+
+uint64_t timer_next_deadline()
+{
+    cpu_t *cpu = this_cpu();
+    spinlock_acquire(&cpu->timer_lock);
+    uint64_t deadline =
+        cpu->timer_count ? cpu->timers[0]->deadline : UINT64_MAX;
+    spinlock_release(&cpu->timer_lock);
+    return deadline;
+}
+
+// Polls the clock until it reaches end. Until a hardware counter is picked the
+// clock only moves with the PIT interrupt, so wait for it halted
+static void wait_until(uint64_t end)
+{
+    const clocksource_t *cs = clocksource_current();
+    bool enabled = are_interrupts_enabled();
+    while (clock_monotonic_ns() < end) {
+        if (cs->ticks) {
+            enable_interrupts();
+            __asm__ volatile("hlt");
+            disable_interrupts();
+        } else {
+            cpu_pause();
+        }
+    }
+    if (enabled) {
         enable_interrupts();
-        __asm__ volatile("hlt");
-        disable_interrupts();
     }
 }
 
+void wait_ms(uint64_t ms)
+{
+    if (thread_can_sleep()) {
+        thread_sleep_ns(ms * 1000000);
+        return;
+    }
+
+    if (!pit_initialised) {
+        return;
+    }
+    wait_until(clock_monotonic_ns() + ms * 1000000);
+}
+
 void wait_us(uint64_t us)
 {
     wait_ns(us * 1000);
@@ -28,12 +215,13 @@ void wait_us(uint64_t us)
 
 void wait_ns(uint64_t ns)
 {
-    if (!pit_initialised) {
+    if (ns >= WAIT_SLEEP_MIN_NS && thread_can_sleep()) {
+        thread_sleep_ns(ns);
         return;
     }
-    uint64_t start = get_ts();
-    uint64_t end = start + ns;
-    while (get_ts() < end) {
-        cpu_pause();
+
+    if (!pit_initialised) {
+        return;
     }
-}
\ No newline at end of file
+    wait_until(clock_monotonic_ns() + ns);
+}
@@ -17,6 +17,7 @@
 extern void print(const char *ptr, int len) WASM_IMPORT(print);
 extern void putchar(int c) WASM_IMPORT(putchar);
 extern unsigned long long get_ticks(void) WASM_IMPORT(get_ticks);
+extern unsigned long long get_time_ns(void) WASM_IMPORT(get_time_ns);
 extern void exit(int code) WASM_IMPORT(exit);
 extern int getchar(void) WASM_IMPORT(getchar);
 extern int read_line(char *buf, int max_len) WASM_IMPORT(read_line);
@@ -41,6 +42,8 @@ extern int spawn(const char *path, int path_len, const char *args,
 extern int waitpid(int pid) WASM_IMPORT(waitpid);
 extern int kill(int pid) WASM_IMPORT(kill);
 extern int getpid(void) WASM_IMPORT(getpid);
+/* pid 0 is the caller; priority runs from 2 (default) to 7 (lowest) */
+extern int set_priority(int pid, int priority) WASM_IMPORT(set_priority);
 
 /* TTY */
 extern int tty_set_mode(int mode) WASM_IMPORT(tty_set_mode);
@@ -9,9 +9,39 @@
 #include <string.h>
 #include <interrupts.h>
 #include <cpu.h>
+#include <idt.h>
+#include <pit.h>
+#include <scheduler.h>
+#include <smp.h>
+#include <timer.h>
 
 static uintptr_t lapic_ptr = 0;
-static uintptr_t ioapic_ptr = 0;
+
+// Every I/O APIC in the MADT, each serving gsi_count GSIs from gsi_base
+struct ioapic {
+    uintptr_t phys;
+    uintptr_t base;
+    uint32_t gsi_base;
+    uint32_t gsi_count;
+    uint8_t id;
+    // IOREGSEL and IOWIN are a pair, so each access holds this
+    spinlock_t lock;
+};
+
+static struct ioapic ioapics[IOAPIC_MAX];
+static int num_ioapics = 0;
+
+// GSIs routed to a dynamic vector by irq_install_gsi_handler()
+struct gsi_vector {
+    uint32_t gsi;
+    uint8_t vector;
+    // The pin is unmasked while this is non-zero
+    uint32_t handlers;
+};
+
+static struct gsi_vector gsi_vectors[IOAPIC_MAX_GSI_VECTORS];
+static int num_gsi_vectors = 0;
+static spinlock_t gsi_lock = {0, "ioapic_gsi"};
 
 struct interrupt_override {
     uint8_t bus;
@@ -23,6 +53,15 @@ struct interrupt_override {
 static struct interrupt_override overrides[16];
 static int num_overrides = 0;
 
+// LAPIC timer ticks per millisecond at a divide of 16, the same on every CPU
+static uint32_t lapic_timer_ticks_per_ms = 0;
+static bool lapic_timer_started = false;
+// Arm the timer with a TSC value instead of a count when the CPU allows it
+static bool lapic_timer_deadline = false;
+
+#define LVT_TIMER_MASKED (1 << 16)
+#define LVT_TIMER_TSC_DEADLINE (2 << 17)
+
 uint32_t lapic_read(uint32_t reg) {
     if (!lapic_ptr) return 0;
     return *(volatile uint32_t*)(lapic_ptr + reg);
@@ -37,32 +76,296 @@ void lapic_eoi() {
     lapic_write(LAPIC_EOI, 0);
 }
 
-void ioapic_write(uintptr_t base, uint8_t reg, uint32_t data) {
-    if (!base) return;
-    *(volatile uint32_t*)(base) = reg;
-    *(volatile uint32_t*)(base + 0x10) = data;
+uint32_t lapic_get_id() {
+    return (lapic_read(LAPIC_ID) >> 24) & 0xFF;
+}
+
+void lapic_init_cpu() {
+    uint64_t apic_base_msr = rdmsr(0x1B);
+    wrmsr(0x1B, apic_base_msr | (1 << 11));
+
+    // Accept every priority, then software-enable with the spurious vector
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SIV, (lapic_read(LAPIC_SIV) & ~0xFF) | 0x100 | VECTOR_SPURIOUS);
+}
+
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+    // Wait for any previous IPI to leave the ICR
+    while (lapic_read(LAPIC_ICRL) & (1 << 12)) {
+        cpu_pause();
+    }
+    lapic_write(LAPIC_ICRH, lapic_id << 24);
+    lapic_write(LAPIC_ICRL, vector | (1 << 14)); // Fixed, assert
+}
+
+void lapic_timer_calibrate() {
+    uint64_t tsc_hz = get_tsc_freq();
+
+    lapic_write(LAPIC_TMRDIV, 0x3); // Divide by 16
+    lapic_write(LAPIC_LVT_TMR, LVT_TIMER_MASKED); // One-shot
+    lapic_write(LAPIC_TMRINIT, 0xFFFFFFFF);
+    if (tsc_hz) {
+        // Busy-wait 10 ms on the TSC, which is finer than a PIT tick
+        uint64_t start = __builtin_ia32_rdtsc();
+        while (__builtin_ia32_rdtsc() - start < tsc_hz / 100) {
+            cpu_pause();
+        }
+    } else {
+        wait_ms(10);
+    }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TMRCURR);
+    lapic_write(LAPIC_TMRINIT, 0);
+
+    lapic_timer_ticks_per_ms = elapsed / 10;
+    lapic_timer_deadline = tsc_hz && is_tsc_deadline_supported();
+    log_info("APIC: Timer runs at %d ticks per ms%s", lapic_timer_ticks_per_ms,
+             lapic_timer_deadline ? ", using TSC-deadline mode" : "");
+}
+
+void lapic_timer_start() {
+    if (!lapic_timer_ticks_per_ms) {
+        return;
+    }
+    lapic_write(LAPIC_TMRDIV, 0x3);
+    if (lapic_timer_deadline) {
+        lapic_write(LAPIC_LVT_TMR, VECTOR_LAPIC_TIMER | LVT_TIMER_TSC_DEADLINE);
+        // The SDM asks for a fence here: the LAPIC write is to memory, and the
+        // first deadline WRMSR could otherwise reach the timer before the
+        // switch to TSC-deadline mode, and be dropped
+        __asm__ volatile("mfence" ::: "memory");
+    } else {
+        lapic_write(LAPIC_LVT_TMR, VECTOR_LAPIC_TIMER); // One-shot
+    }
+    lapic_timer_started = true;
+
+    // A first short shot hands the CPU to the scheduler, which arms the timer
+    // from then on
+    lapic_timer_arm(1000000);
+}
+
+void lapic_timer_arm(uint64_t ns) {
+    if (!lapic_timer_started) {
+        return;
+    }
+
+    if (lapic_timer_deadline) {
+        // Split off whole seconds so the multiplication can't overflow
+        uint64_t tsc_hz = get_tsc_freq();
+        uint64_t delta = (ns / 1000000000) * tsc_hz + (ns % 1000000000) * tsc_hz / 1000000000;
+        wrmsr(MSR_TSC_DEADLINE, __builtin_ia32_rdtsc() + (delta ? delta : 1));
+        return;
+    }
+
+    uint64_t count = ns * lapic_timer_ticks_per_ms / 1000000;
+    if (count == 0) {
+        count = 1;
+    } else if (count > 0xFFFFFFFF) {
+        count = 0xFFFFFFFF; // Fires early, and the scheduler just arms it again
+    }
+    lapic_write(LAPIC_TMRINIT, (uint32_t)count);
+}
+
+void lapic_timer_stop() {
+    if (!lapic_timer_started) {
+        return;
+    }
+    if (lapic_timer_deadline) {
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    } else {
+        lapic_write(LAPIC_TMRINIT, 0);
+    }
+}
+
+bool lapic_timer_active() {
+    return lapic_timer_started;
+}
+
+uint64_t lapic_timer_handler(uint64_t rsp) {
+    timer_run_expired();
+    return scheduler_schedule(rsp);
 }
 
-uint32_t ioapic_read(uintptr_t base, uint8_t reg) {
-    if (!base) return 0;
-    *(volatile uint32_t*)(base) = reg;
-    return *(volatile uint32_t*)(base + 0x10);
+// Callers hold ioapic->lock
+static void ioapic_write(struct ioapic *ioapic, uint8_t reg, uint32_t data) {
+    *(volatile uint32_t*)(ioapic->base) = reg;
+    *(volatile uint32_t*)(ioapic->base + 0x10) = data;
+}
+
+static uint32_t ioapic_read(struct ioapic *ioapic, uint8_t reg) {
+    *(volatile uint32_t*)(ioapic->base) = reg;
+    return *(volatile uint32_t*)(ioapic->base + 0x10);
+}
+
+static struct ioapic *ioapic_for_gsi(uint32_t gsi) {
+    for (int i = 0; i < num_ioapics; i++) {
+        if (ioapics[i].base && gsi >= ioapics[i].gsi_base &&
+            gsi < ioapics[i].gsi_base + ioapics[i].gsi_count) {
+            return &ioapics[i];
+        }
+    }
+    return NULL;
 }
 
-void ioapic_set_gsi(uint32_t gsi, uint64_t apic_id, uint8_t vector, uint16_t flags) {
+bool ioapic_set_gsi(uint32_t gsi, uint32_t apic_id, uint8_t vector, uint16_t flags) {
+    struct ioapic *ioapic = ioapic_for_gsi(gsi);
+    if (!ioapic) {
+        log_warn("APIC: No I/O APIC serves GSI %d", gsi);
+        return false;
+    }
+
     uint32_t low = vector; // Delivery Mode: Fixed (000), Vector: vector
-    uint32_t high = (uint32_t)(apic_id << 24);
+    uint32_t high = apic_id << 24;
+
+    // Polarity and trigger mode, both two-bit fields. Conforming means the
+    // bus default, active high and edge for ISA.
+    if ((flags & ACPI_MADT_POLARITY_MASK) == ACPI_MADT_POLARITY_ACTIVE_LOW) {
+        low |= IOAPIC_ACTIVE_LOW;
+    }
+    if ((flags & ACPI_MADT_TRIGGERING_MASK) == ACPI_MADT_TRIGGERING_LEVEL) {
+        low |= IOAPIC_LEVEL;
+    }
+
+    uint8_t reg = IOREDTBL + (gsi - ioapic->gsi_base) * 2;
+    // Masked while the destination changes, then unmasked with the rest
+    uint64_t irq_flags = spinlock_acquire_irqsave(&ioapic->lock);
+    ioapic_write(ioapic, reg, low | IOAPIC_MASKED);
+    ioapic_write(ioapic, reg + 1, high);
+    ioapic_write(ioapic, reg, low);
+    spinlock_release_irqrestore(&ioapic->lock, irq_flags);
+    return true;
+}
+
+bool ioapic_mask_gsi(uint32_t gsi, bool masked) {
+    struct ioapic *ioapic = ioapic_for_gsi(gsi);
+    if (!ioapic) {
+        return false;
+    }
+
+    uint8_t reg = IOREDTBL + (gsi - ioapic->gsi_base) * 2;
+    uint64_t irq_flags = spinlock_acquire_irqsave(&ioapic->lock);
+    uint32_t low = ioapic_read(ioapic, reg);
+    low = masked ? low | IOAPIC_MASKED : low & ~IOAPIC_MASKED;
+    ioapic_write(ioapic, reg, low);
+    spinlock_release_irqrestore(&ioapic->lock, irq_flags);
+    return true;
+}
+
+uint32_t irq_to_gsi(uint8_t irq) {
+    for (int i = 0; i < num_overrides; i++) {
+        if (overrides[i].bus == 0 && overrides[i].source == irq) {
+            return overrides[i].gsi;
+        }
+    }
+    return irq;
+}
 
-    // Handle flags (polarity/trigger mode)
-    if (flags & ACPI_MADT_POLARITY_ACTIVE_LOW) {
-        low |= (1 << 13);
+bool gsi_set_affinity(uint32_t gsi, uint64_t cpu_mask) {
+    struct ioapic *ioapic = ioapic_for_gsi(gsi);
+    if (!ioapic) {
+        return false;
     }
-    if (flags & ACPI_MADT_TRIGGERING_LEVEL) {
-        low |= (1 << 15);
+
+    // Fixed delivery goes to a single CPU, the first online one in the mask
+    cpu_t *target = NULL;
+    for (uint32_t i = 0; i < smp_cpu_count() && i < 64; i++) {
+        if ((cpu_mask & (1ULL << i)) && (target = smp_get_cpu(i))) {
+            break;
+        }
+    }
+    if (!target) {
+        return false;
     }
 
-    ioapic_write(ioapic_ptr, IOREDTBL + gsi * 2, low);
-    ioapic_write(ioapic_ptr, IOREDTBL + gsi * 2 + 1, high);
+    uint8_t reg = IOREDTBL + (gsi - ioapic->gsi_base) * 2;
+    // Read and written back under the lock, so a concurrent mask or unmask
+    // of the same pin isn't undone
+    uint64_t irq_flags = spinlock_acquire_irqsave(&ioapic->lock);
+    uint32_t low = ioapic_read(ioapic, reg);
+    ioapic_write(ioapic, reg, low | IOAPIC_MASKED);
+    ioapic_write(ioapic, reg + 1, target->lapic_id << 24);
+    ioapic_write(ioapic, reg, low);
+    spinlock_release_irqrestore(&ioapic->lock, irq_flags);
+    return true;
+}
+
+bool irq_set_affinity(uint8_t irq, uint64_t cpu_mask) {
+    if (!apic_in_use || irq >= 16) {
+        return false;
+    }
+    return gsi_set_affinity(irq_to_gsi(irq), cpu_mask);
+}
+
+// Spreads device interrupts over the online CPUs as they are routed
+static uint32_t next_gsi_cpu(void) {
+    static uint32_t next = 0;
+    uint32_t count = smp_cpu_count();
+    for (uint32_t tries = 0; tries < count; tries++) {
+        uint32_t i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % count;
+        if (smp_get_cpu(i)) {
+            return smp_get_cpu(i)->lapic_id;
+        }
+    }
+    return lapic_get_id();
+}
+
+int irq_install_gsi_handler(uint32_t gsi, uint16_t flags, uint64_t (*handler)(uint64_t, void *), void *ctx) {
+    if (!apic_in_use || !ioapic_for_gsi(gsi)) {
+        return -1;
+    }
+
+    uint64_t irq_flags = spinlock_acquire_irqsave(&gsi_lock);
+    // PCI INTx lines are often shared, so a routed GSI keeps its vector, and
+    // its pin is unmasked again once it has a handler
+    for (int i = 0; i < num_gsi_vectors; i++) {
+        if (gsi_vectors[i].gsi == gsi) {
+            uint8_t vector = gsi_vectors[i].vector;
+            vector_install_handler(vector, handler, ctx);
+            if (gsi_vectors[i].handlers++ == 0) {
+                ioapic_mask_gsi(gsi, false);
+            }
+            spinlock_release_irqrestore(&gsi_lock, irq_flags);
+            return vector;
+        }
+    }
+    if (num_gsi_vectors == IOAPIC_MAX_GSI_VECTORS) {
+        spinlock_release_irqrestore(&gsi_lock, irq_flags);
+        log_err("APIC: Too many routed GSIs");
+        return -1;
+    }
+
+    int vector = irq_alloc_vector();
+    if (vector < 0) {
+        spinlock_release_irqrestore(&gsi_lock, irq_flags);
+        return -1;
+    }
+    gsi_vectors[num_gsi_vectors].gsi = gsi;
+    gsi_vectors[num_gsi_vectors].vector = vector;
+    gsi_vectors[num_gsi_vectors].handlers = 1;
+    num_gsi_vectors++;
+
+    vector_install_handler(vector, handler, ctx);
+    uint32_t apic_id = next_gsi_cpu();
+    ioapic_set_gsi(gsi, apic_id, vector, flags);
+    spinlock_release_irqrestore(&gsi_lock, irq_flags);
+
+    log_verbose("APIC: Routing GSI %d to vector 0x%x on LAPIC %d", gsi, vector, apic_id);
+    return vector;
+}
+
+void irq_uninstall_gsi_handler(uint32_t gsi, uint64_t (*handler)(uint64_t, void *), void *ctx) {
+    uint64_t irq_flags = spinlock_acquire_irqsave(&gsi_lock);
+    for (int i = 0; i < num_gsi_vectors; i++) {
+        if (gsi_vectors[i].gsi != gsi) {
+            continue;
+        }
+        if (vector_uninstall_handler(gsi_vectors[i].vector, handler, ctx) &&
+            --gsi_vectors[i].handlers == 0) {
+            // A level-triggered line nobody handles would fire forever
+            ioapic_mask_gsi(gsi, true);
+        }
+        break;
+    }
+    spinlock_release_irqrestore(&gsi_lock, irq_flags);
 }
 
 void apic_init() {
@@ -71,10 +374,6 @@ void apic_init() {
         return;
     }
 
-    // Enable APIC globally via MSR
-    uint64_t apic_base_msr = rdmsr(0x1B);
-    wrmsr(0x1B, apic_base_msr | (1 << 11));
-
     struct uacpi_table tbl;
     uacpi_status ret = uacpi_table_find_by_signature(ACPI_MADT_SIGNATURE, &tbl);
     if (uacpi_unlikely_error(ret)) {
@@ -84,7 +383,6 @@ void apic_init() {
 
     struct acpi_madt *madt = (struct acpi_madt*)tbl.ptr;
     uintptr_t lapic_phys = (uintptr_t)madt->local_interrupt_controller_address;
-    uintptr_t ioapic_phys = 0;
 
     uint8_t *ptr = (uint8_t*)(madt + 1);
     uint8_t *end = (uint8_t*)tbl.ptr + madt->hdr.length;
@@ -104,7 +402,15 @@ void apic_init() {
             case ACPI_MADT_ENTRY_TYPE_IOAPIC: {
                 struct acpi_madt_ioapic *ioapic = (struct acpi_madt_ioapic*)ptr;
                 log_verbose("APIC: Found I/O APIC: ID %d, Address %x, GSI Base %d", ioapic->id, ioapic->address, ioapic->gsi_base);
-                ioapic_phys = (uintptr_t)ioapic->address;
+                if (num_ioapics < IOAPIC_MAX) {
+                    ioapics[num_ioapics].phys = (uintptr_t)ioapic->address;
+                    ioapics[num_ioapics].gsi_base = ioapic->gsi_base;
+                    ioapics[num_ioapics].id = ioapic->id;
+                    ioapics[num_ioapics].lock.name = "ioapic";
+                    num_ioapics++;
+                } else {
+                    log_warn("APIC: Ignoring I/O APIC %d, too many", ioapic->id);
+                }
                 break;
             }
             case ACPI_MADT_ENTRY_TYPE_INTERRUPT_SOURCE_OVERRIDE: {
@@ -130,57 +436,70 @@ void apic_init() {
 
     uacpi_table_unref(&tbl);
 
-    if (!lapic_phys || !ioapic_phys) {
+    if (!lapic_phys || !num_ioapics) {
         log_err("APIC: Failed to find LAPIC or I/O APIC address");
         return;
     }
 
-    log_info("APIC: Physical addresses: LAPIC 0x%x, I/O APIC 0x%x", lapic_phys, ioapic_phys);
+    log_info("APIC: Physical addresses: LAPIC 0x%x, %d I/O APIC(s)", lapic_phys, num_ioapics);
 
     // Map the LAPIC and I/O APIC regions
-    lapic_ptr = (uintptr_t)mmap_physical(NULL, (void*)lapic_phys, PAGE_SIZE, VMM_PRESENT | VMM_WRITE);
-    ioapic_ptr = (uintptr_t)mmap_physical(NULL, (void*)ioapic_phys, PAGE_SIZE, VMM_PRESENT | VMM_WRITE);
-
-    if (!lapic_ptr || !ioapic_ptr) {
-        log_err("APIC: Failed to map LAPIC or I/O APIC");
+    lapic_ptr = (uintptr_t)mmap_physical(NULL, (void*)lapic_phys, PAGE_SIZE, VMM_PRESENT | VMM_WRITE | VMM_UC);
+    if (!lapic_ptr) {
+        log_err("APIC: Failed to map LAPIC");
         return;
     }
 
-    log_info("APIC: Initializing LAPIC at %p, I/O APIC at %p", (void*)lapic_ptr, (void*)ioapic_ptr);
+    for (int i = 0; i < num_ioapics; i++) {
+        struct ioapic *ioapic = &ioapics[i];
+        ioapic->base = (uintptr_t)mmap_physical(NULL, (void*)ioapic->phys, PAGE_SIZE, VMM_PRESENT | VMM_WRITE | VMM_UC);
+        if (!ioapic->base) {
+            log_err("APIC: Failed to map I/O APIC %d", ioapic->id);
+            continue;
+        }
+
+        // Nothing is routed until a driver asks for it
+        uint64_t irq_flags = spinlock_acquire_irqsave(&ioapic->lock);
+        ioapic->gsi_count = ((ioapic_read(ioapic, IOAPICVER) >> 16) & 0xFF) + 1;
+        for (uint32_t pin = 0; pin < ioapic->gsi_count; pin++) {
+            ioapic_write(ioapic, IOREDTBL + pin * 2, IOAPIC_MASKED);
+        }
+        spinlock_release_irqrestore(&ioapic->lock, irq_flags);
+        log_info("APIC: I/O APIC %d at %p serves GSIs %d-%d", ioapic->id, (void*)ioapic->base,
+                 ioapic->gsi_base, ioapic->gsi_base + ioapic->gsi_count - 1);
+    }
+
+    log_info("APIC: Initializing LAPIC at %p", (void*)lapic_ptr);
 
     // Disable PIC
     pic_disable();
 
     // Initialize LAPIC
-    // Set Spurious Interrupt Vector Register
-    // Vector 0xFF, Enable bit 8
-    lapic_write(LAPIC_SIV, lapic_read(LAPIC_SIV) | 0x1FF);
+    lapic_init_cpu();
 
     // Map legacy IRQs to vectors 0x20-0x2F
     uint32_t bsp_id = (lapic_read(LAPIC_ID) >> 24) & 0xFF;
-    bool gsi_programmed[24] = {0};
 
     // 1. Program overrides first
     for (int i = 0; i < num_overrides; i++) {
-        if (overrides[i].gsi < 24) {
+        if (overrides[i].source < 16) {
             log_verbose("APIC: Mapping GSI %d to IRQ %d (vector 0x%x)", overrides[i].gsi, overrides[i].source, 0x20 + overrides[i].source);
             ioapic_set_gsi(overrides[i].gsi, bsp_id, 0x20 + overrides[i].source, overrides[i].flags);
-            gsi_programmed[overrides[i].gsi] = true;
         }
     }
 
-    // 2. Map remaining legacy IRQs to default pins
+    // 2. Map remaining legacy IRQs to default pins, unless an override
+    // moved another IRQ onto that pin
     for (uint8_t i = 0; i < 16; i++) {
-        // Check if this IRQ source has an override
-        bool has_override = false;
+        bool taken = false;
         for (int j = 0; j < num_overrides; j++) {
-            if (overrides[j].source == i) {
-                has_override = true;
+            if (overrides[j].source == i || overrides[j].gsi == i) {
+                taken = true;
                 break;
             }
         }
 
-        if (!has_override && !gsi_programmed[i]) {
+        if (!taken) {
             log_verbose("APIC: Mapping GSI %d to IRQ %d (vector 0x%x) [Default]", i, i, 0x20 + i);
             ioapic_set_gsi(i, bsp_id, 0x20 + i, 0); // Polarity conforming, Trigger conforming
         }
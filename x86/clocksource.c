@@ -0,0 +1,202 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <acpi.h>
+#include <clocksource.h>
+#include <cmos.h>
+#include <cpu.h>
+#include <debug.h>
+#include <interrupts.h>
+#include <pit.h>
+#include <time.h>
+#include <uacpi/acpi.h>
+#include <uacpi/tables.h>
+#include <vmm.h>
+
+// HPET registers
+#define HPET_REG_CAP 0x00
+#define HPET_REG_CONFIG 0x10
+#define HPET_REG_COUNTER 0xF0
+
+#define HPET_CAP_COUNT_SIZE (1 << 13)
+#define HPET_CONFIG_ENABLE (1 << 0)
+#define HPET_FS_PER_SEC 1000000000000000ULL
+
+// Ratings. A TSC that stops or changes rate with the CPU's power state is
+// still finer than the HPET, but can't be trusted over it
+#define RATING_TSC_INVARIANT 300
+#define RATING_HPET 250
+#define RATING_TSC 200
+#define RATING_PIT 100
+
+// Shift used for every source's mult, see cycles_to_ns()
+#define CLOCKSOURCE_SHIFT 32
+
+static volatile uint8_t *hpet_base = NULL;
+
+static uint64_t tsc_read()
+{
+    return __builtin_ia32_rdtsc();
+}
+
+static uint64_t hpet_read()
+{
+    return *(volatile uint64_t *)(hpet_base + HPET_REG_COUNTER);
+}
+
+static uint64_t pit_read()
+{
+    return pit_ticks;
+}
+
+static clocksource_t tsc_clocksource = {.name = "tsc", .read = tsc_read};
+static clocksource_t hpet_clocksource = {.name = "hpet", .read = hpet_read};
+static clocksource_t pit_clocksource = {
+    .name = "pit",
+    .rating = RATING_PIT,
+    .read = pit_read,
+    .freq_hz = PIT_FREQUENCY,
+    .ticks = true,
+    .mult = (NSEC_PER_SEC << CLOCKSOURCE_SHIFT) / PIT_FREQUENCY,
+    .shift = CLOCKSOURCE_SHIFT,
+};
+
+static clocksource_t *sources[] = {&tsc_clocksource, &hpet_clocksource,
+                                   &pit_clocksource};
+
+// The current source, with the counter value and time it was switched to at
+static clocksource_t *current = &pit_clocksource;
+static uint64_t base_cycles = 0;
+static uint64_t base_ns = 0;
+
+// Unix time in ns at clock_monotonic_ns() == 0
+static uint64_t realtime_offset_ns = 0;
+
+// A multiply and shift rather than a division. The 128-bit product can't
+// overflow for any delta
+static inline uint64_t cycles_to_ns(const clocksource_t *cs, uint64_t cycles)
+{
+    return (uint64_t)(((unsigned __int128)cycles * cs->mult) >> cs->shift);
+}
+
+static void tsc_probe()
+{
+    uint64_t hz = get_tsc_freq();
+    if (hz == 0) {
+        return;
+    }
+    tsc_clocksource.freq_hz = hz;
+    tsc_clocksource.rating =
+        is_tsc_invariant() ? RATING_TSC_INVARIANT : RATING_TSC;
+}
+
+static void hpet_probe()
+{
+#if ACPI_ENABLED
+    struct uacpi_table tbl;
+    if (uacpi_unlikely_error(
+            uacpi_table_find_by_signature(ACPI_HPET_SIGNATURE, &tbl))) {
+        log_verbose("Clocksource: No HPET table");
+        return;
+    }
+    struct acpi_hpet *hpet = (struct acpi_hpet *)tbl.ptr;
+    uint64_t phys = hpet->address.address;
+    bool mmio = hpet->address.address_space_id ==
+                UACPI_ADDRESS_SPACE_SYSTEM_MEMORY;
+    uacpi_table_unref(&tbl);
+
+    if (!mmio) {
+        log_warn("Clocksource: HPET isn't memory mapped");
+        return;
+    }
+
+    hpet_base = mmap_physical(NULL, (void *)phys, PAGE_SIZE,
+                              VMM_PRESENT | VMM_WRITE | VMM_UC);
+    if (!hpet_base) {
+        log_err("Clocksource: Failed to map HPET at 0x%lx", phys);
+        return;
+    }
+
+    uint64_t cap = *(volatile uint64_t *)(hpet_base + HPET_REG_CAP);
+    uint32_t period_fs = cap >> 32;
+    // A 32-bit counter wraps every few minutes, and nothing reads it often
+    // enough to notice
+    if (!(cap & HPET_CAP_COUNT_SIZE) || period_fs == 0) {
+        log_warn("Clocksource: HPET counter is only 32 bits wide, not using "
+                 "it");
+        return;
+    }
+
+    volatile uint64_t *config =
+        (volatile uint64_t *)(hpet_base + HPET_REG_CONFIG);
+    if (!(*config & HPET_CONFIG_ENABLE)) {
+        *config |= HPET_CONFIG_ENABLE;
+    }
+
+    hpet_clocksource.freq_hz = HPET_FS_PER_SEC / period_fs;
+    hpet_clocksource.rating = RATING_HPET;
+#endif
+}
+
+static uint64_t read_ns(const clocksource_t *cs, uint64_t cycles_base,
+                        uint64_t ns_base)
+{
+    return ns_base + cycles_to_ns(cs, cs->read() - cycles_base);
+}
+
+void clocksource_init()
+{
+    tsc_probe();
+    hpet_probe();
+
+    clocksource_t *best = &pit_clocksource;
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        clocksource_t *cs = sources[i];
+        if (cs->rating == 0) {
+            continue;
+        }
+        cs->shift = CLOCKSOURCE_SHIFT;
+        cs->mult = (NSEC_PER_SEC << CLOCKSOURCE_SHIFT) / cs->freq_hz;
+        log_verbose("Clocksource: %s at %lu Hz, rating %d", cs->name,
+                    cs->freq_hz, cs->rating);
+        if (cs->rating > best->rating) {
+            best = cs;
+        }
+    }
+
+    // Carry on from the time the PIT reached, so the clock stays monotonic.
+    // Only the boot CPU runs yet, so with interrupts disabled nothing can
+    // read the fields half updated
+    disable_interrupts();
+    uint64_t now = read_ns(current, base_cycles, base_ns);
+    base_cycles = best->read();
+    base_ns = now;
+    current = best;
+    enable_interrupts();
+
+    log_info("Clocksource: Using %s", best->name);
+
+    datetime_t dt;
+    cmos_get_datetime(&dt);
+    realtime_offset_ns =
+        datetime_to_unix(&dt) * NSEC_PER_SEC - clock_monotonic_ns();
+}
+
+const clocksource_t *clocksource_current()
+{
+    return current;
+}
+
+uint64_t clock_monotonic_ns()
+{
+    return read_ns(current, base_cycles, base_ns);
+}
+
+uint64_t clock_realtime_ns()
+{
+    if (realtime_offset_ns == 0) {
+        return 0;
+    }
+    return realtime_offset_ns + clock_monotonic_ns();
+}
@@ -2,8 +2,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <clocksource.h>
 #include <cpu.h>
 #include <debug.h>
+#include <fpu.h>
 #include <interrupts.h>
 #include <io.h>
 #include <sound.h>
@@ -12,7 +14,6 @@
 #include <timer.h>
 
 static uint64_t tsc_freq_hz = 0;
-static uint64_t tsc_at_boot = 0;
 
 char cpu_vendor_id[12];
 char cpu_model_name[49];
@@ -28,13 +29,28 @@ void cpu_init()
 {
     log_verbose("Enabling SIMD extensions");
     sse_init();
+    fpu_init();
     enable_a20();
     enable_mce();
+    pat_init();
     set_cpu_vendor_id(cpu_vendor_id);
     set_cpu_model_name(cpu_model_name);
     log_verbose("Vendor ID: %s\nModel Name: %s", cpu_vendor_id, cpu_model_name);
 }
 
+/**
+ * @brief Enables the same CPU features on an application processor that
+ * cpu_init() enables on the boot CPU. The PAT in particular has to match
+ * everywhere, or the same mapping would have different memory types.
+ */
+void cpu_init_ap()
+{
+    sse_init();
+    fpu_init_cpu();
+    enable_mce();
+    pat_init();
+}
+
 void halt()
 {
     __asm__ volatile("hlt");
@@ -84,24 +100,48 @@ void enable_mce()
     set_cr4(cr4);
 }
 
+/**
+ * @brief Programs the PAT so the VMM cache flags select the expected types.
+ *
+ * Entries 0-3 keep their power-on values (WB, WT, UC-, UC), so PWT and PCD
+ * alone behave as they would without a PAT. The PAT bit selects entries 4-7,
+ * which become WC, WP, UC- and UC.
+ */
+void pat_init()
+{
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(CPUID_LEAF_APIC, eax, ebx, ecx, edx);
+    if (!(edx & (1 << 16))) {
+        log_warn("CPU: PAT not supported, write-combining unavailable");
+        return;
+    }
+
+    // The layout Limine sets up, which its own mappings, such as the
+    // framebuffer's WC one, rely on. It leaves entries 6 and 7 undefined, so
+    // they get their power-on defaults
+    uint64_t pat = (uint64_t)PAT_WB | ((uint64_t)PAT_WT << 8) |
+                   ((uint64_t)PAT_UC_MINUS << 16) | ((uint64_t)PAT_UC << 24) |
+                   ((uint64_t)PAT_WP << 32) | ((uint64_t)PAT_WC << 40) |
+                   ((uint64_t)PAT_UC_MINUS << 48) | ((uint64_t)PAT_UC << 56);
+
+    // Flush as the SDM asks before changing memory types, entries 6 and 7
+    // may differ from what the bootloader left
+    __asm__ volatile("wbinvd" ::: "memory");
+    wrmsr(MSR_PAT, pat);
+    set_cr3(get_cr3());
+}
+
 void tsc_init()
 {
     unsigned int eax, ebx, ecx, edx;
     __cpuid(0, eax, ebx, ecx, edx);
     unsigned int max_leaf = eax;
 
-    __cpuid(0x80000000, eax, ebx, ecx, edx);
-    if (eax >= 0x80000007) {
-        __cpuid(0x80000007, eax, ebx, ecx, edx);
-        if (edx & (1 << 8)) { // Check if Invariant TSC is supported
-            log_info("TSC: Invariant TSC is supported.");
-        } else {
-            log_warn("TSC: Invariant TSC is NOT supported. TSC may be "
-                     "unreliable.");
-        }
+    if (is_tsc_invariant()) {
+        log_info("TSC: Invariant TSC is supported.");
     } else {
-        log_warn("TSC: Extended CPUID leaf 0x80000007 not available. Cannot "
-                 "determine Invariant TSC support.");
+        log_warn("TSC: Invariant TSC is NOT supported. TSC may be "
+                 "unreliable.");
     }
 
     // Get TSC frequency from CPUID if available
@@ -128,7 +168,7 @@ void tsc_init()
             tsc_freq_hz = (crystal_hz * ebx) / eax;
             log_verbose("TSC: Frequency %lu Hz (Calculated via Leaf 0x15)",
                         tsc_freq_hz);
-            goto tsc_init_done;
+            return;
         }
     }
 
@@ -138,7 +178,7 @@ void tsc_init()
             tsc_freq_hz = (uint64_t)ebx * 1000000;
             log_verbose("TSC: Frequency is %lu Hz (from CPUID 0x16).",
                         tsc_freq_hz);
-            goto tsc_init_done;
+            return;
         }
     }
 
@@ -159,20 +199,18 @@ void tsc_init()
     uint64_t tsc_delta = end_tsc_calib - start_tsc_calib;
     tsc_freq_hz = tsc_delta * 20; // 50ms is 1/20th of a second
     log_info("TSC: Calibrated frequency to be ~%lu Hz.", tsc_freq_hz);
-
-tsc_init_done:
-    tsc_at_boot = rdtsc();
 }
 
-// read nanoseconds since boot using the TSC
+// Nanoseconds since boot. The same clock as clock_monotonic_ns(), so timer
+// deadlines and timestamps agree whichever source it runs on
 uint64_t get_ts()
 {
-    if (tsc_freq_hz == 0) {
-        return 0;
-    }
-    uint64_t current_tsc = rdtsc();
-    uint64_t tsc_delta = current_tsc - tsc_at_boot;
-    return (tsc_delta * 1000000000) / tsc_freq_hz;
+    return clock_monotonic_ns();
+}
+
+uint64_t get_tsc_freq()
+{
+    return tsc_freq_hz;
 }
 
 void enable_a20()
@@ -258,6 +296,35 @@ bool is_apic_enabled()
     return (edx & (1 << 9));
 }
 
+bool is_1g_pages_supported()
+{
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(0x80000000, eax, ebx, ecx, edx);
+    if (eax < 0x80000001) {
+        return false;
+    }
+    __cpuid(0x80000001, eax, ebx, ecx, edx);
+    return (edx & (1 << 26));
+}
+
+bool is_tsc_deadline_supported()
+{
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(1, eax, ebx, ecx, edx);
+    return (ecx & (1 << 24));
+}
+
+bool is_tsc_invariant()
+{
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(0x80000000, eax, ebx, ecx, edx);
+    if (eax < 0x80000007) {
+        return false;
+    }
+    __cpuid(0x80000007, eax, ebx, ecx, edx);
+    return (edx & (1 << 8));
+}
+
 static void set_cpu_vendor_id(char *buffer)
 {
     uint32_t eax, ebx, ecx, edx;
@@ -0,0 +1,208 @@
+#include <cpuid.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cpu.h>
+#include <debug.h>
+#include <fpu.h>
+#include <smp.h>
+#include <string.h>
+
+// Size of the FXSAVE area, used when XSAVE isn't available
+#define FXSAVE_SIZE 512
+
+// Offsets of the x87 control word and MXCSR in either save area
+#define FPU_FCW_OFFSET 0
+#define FPU_MXCSR_OFFSET 24
+
+// Power-on values: every exception masked, round to nearest
+#define FPU_FCW_DEFAULT 0x037F
+#define FPU_MXCSR_DEFAULT 0x1F80
+
+static bool use_xsave = false;
+static uint64_t xcr0 = 0;
+static size_t state_size = FXSAVE_SIZE;
+
+// The lazy switching scheme: each CPU remembers the thread whose state its
+// registers hold, fpu_owner, and runs every other thread with CR0.TS set.
+// A thread's first FPU instruction after a switch raises #NM, which saves
+// the owner's registers and loads the thread's own. Handlers run with TS set
+// too, so one that touches the FPU saves the owner's state first and leaves
+// the registers owned by nobody.
+
+static bool ts_set()
+{
+    return get_cr0().bit_list.ts;
+}
+
+static void set_ts()
+{
+    cr0_t cr0 = get_cr0();
+    cr0.bit_list.ts = 1;
+    set_cr0(cr0);
+}
+
+static inline void clts()
+{
+    __asm__ volatile("clts" ::: "memory");
+}
+
+static void fpu_save(void *state)
+{
+    if (use_xsave) {
+        __asm__ volatile("xsave64 (%0)"
+                         :
+                         : "r"(state), "a"((uint32_t)xcr0),
+                           "d"((uint32_t)(xcr0 >> 32))
+                         : "memory");
+    } else {
+        __asm__ volatile("fxsave64 (%0)" : : "r"(state) : "memory");
+    }
+}
+
+static void fpu_restore(void *state)
+{
+    if (use_xsave) {
+        __asm__ volatile("xrstor64 (%0)"
+                         :
+                         : "r"(state), "a"((uint32_t)xcr0),
+                           "d"((uint32_t)(xcr0 >> 32))
+                         : "memory");
+    } else {
+        __asm__ volatile("fxrstor64 (%0)" : : "r"(state) : "memory");
+    }
+}
+
+void fpu_init_cpu()
+{
+    if (!use_xsave) {
+        return;
+    }
+
+    cr4_t cr4 = get_cr4();
+    cr4.bit_list.osxsave = 1;
+    set_cr4(cr4);
+
+    __asm__ volatile("xsetbv"
+                     :
+                     : "c"(0), "a"((uint32_t)xcr0),
+                       "d"((uint32_t)(xcr0 >> 32)));
+}
+
+void fpu_init()
+{
+    unsigned int eax, ebx, ecx, edx;
+    __cpuid(CPUID_LEAF_APIC, eax, ebx, ecx, edx);
+    bool has_avx = ecx & (1 << 28);
+    if (!(ecx & (1 << 26))) {
+        log_warn("FPU: XSAVE not supported, saving SSE state only");
+        return;
+    }
+
+    __cpuid_count(0, 0, eax, ebx, ecx, edx);
+    unsigned int max_leaf = eax;
+    bool has_avx512 = false;
+    if (max_leaf >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        has_avx512 = ebx & (1 << 16);
+    }
+
+    // Components the CPU can save
+    __cpuid_count(0xD, 0, eax, ebx, ecx, edx);
+    uint64_t supported = ((uint64_t)edx << 32) | eax;
+
+    xcr0 = XCR0_X87 | XCR0_SSE;
+    if (has_avx && (supported & XCR0_AVX)) {
+        xcr0 |= XCR0_AVX;
+    }
+    if (has_avx512 && (xcr0 & XCR0_AVX) &&
+        (supported & XCR0_AVX512) == XCR0_AVX512) {
+        xcr0 |= XCR0_AVX512;
+    }
+
+    use_xsave = true;
+    fpu_init_cpu();
+
+    // EBX now covers exactly the enabled components
+    __cpuid_count(0xD, 0, eax, ebx, ecx, edx);
+    state_size = ebx;
+
+    log_verbose("FPU: XSAVE enabled, XCR0 0x%lx, %d byte save area", xcr0,
+                (int)state_size);
+}
+
+size_t fpu_state_size()
+{
+    return state_size;
+}
+
+void fpu_state_init(void *state)
+{
+    // With an empty XSAVE header every component is loaded in its initial
+    // configuration, except MXCSR, which always comes from memory.
+    // FXRSTOR takes everything from memory.
+    memset(state, 0, state_size);
+    *(uint16_t *)((uint8_t *)state + FPU_FCW_OFFSET) = FPU_FCW_DEFAULT;
+    *(uint32_t *)((uint8_t *)state + FPU_MXCSR_OFFSET) = FPU_MXCSR_DEFAULT;
+}
+
+// Must not use SIMD registers itself, they are what it is switching
+__attribute__((target("general-regs-only"))) void
+fpu_nm_handler(interrupt_frame_t *frame)
+{
+    (void)frame;
+    clts();
+
+    cpu_t *cpu = this_cpu();
+    thread_t *owner = cpu->fpu_owner;
+    thread_t *current = cpu->current;
+
+    // A handler gets the registers to itself, the interrupted thread loads
+    // its state again once it needs it
+    if (cpu->irq_nesting > 0) {
+        if (owner) {
+            fpu_save(owner->fpu_state);
+            cpu->fpu_owner = NULL;
+        }
+        return;
+    }
+
+    if (!current || owner == current) {
+        return;
+    }
+    // An exited thread's registers are never needed again
+    if (owner && owner->state != THREAD_STATE_TERMINATED) {
+        fpu_save(owner->fpu_state);
+    }
+    fpu_restore(current->fpu_state);
+    cpu->fpu_owner = current;
+}
+
+void fpu_irq_enter(cpu_t *cpu)
+{
+    // Before the scheduler starts there is no thread to save for
+    if (cpu->fpu_owner && !ts_set()) {
+        set_ts();
+    }
+}
+
+void fpu_irq_exit(cpu_t *cpu)
+{
+    // If the registers still hold the thread's state TS is left set anyway,
+    // and its next FPU instruction only costs a clts
+    if (cpu->fpu_owner != cpu->current && !ts_set()) {
+        set_ts();
+    }
+}
+
+void fpu_switch(cpu_t *cpu, thread_t *next)
+{
+    bool ts = ts_set();
+    if (cpu->fpu_owner == next) {
+        if (ts) {
+            clts();
+        }
+    } else if (!ts) {
+        set_ts();
+    }
+}
@@ -1,14 +1,20 @@
 #include <stdint.h>
 
+#include <cpu.h>
 #include <debug.h>
 #include <gdt.h>
+#include <panic.h>
+#include <pmm.h>
+#include <smp.h>
+#include <vmm.h>
 
-gdt_entry_t gdt[GDT_ENTRIES];
-gdtr_t gdtr;
+// The boot CPU loads its GDT before the PMM is up, so its stacks are static
+static uint8_t bsp_ist_stacks[IST_COUNT][IST_STACK_SIZE]
+    __attribute__((aligned(16)));
 
-static void gdt_set_gate(int num, uint8_t access, uint8_t flags)
+static void gdt_set_gate(gdt_entry_t *gdt, int num, uint8_t access,
+                         uint8_t flags)
 {
-    log_verbose("Setting GDT entry %d", num);
     gdt[num].limit_low = 0;
     gdt[num].base_low = 0;
     gdt[num].base_mid = 0;
@@ -17,21 +23,26 @@ static void gdt_set_gate(int num, uint8_t access, uint8_t flags)
     gdt[num].base_high = 0;
 }
 
-void gdt_init()
+// A system descriptor takes two slots to hold a 64-bit base
+static void gdt_set_tss(gdt_entry_t *gdt, int num, tss_t *tss)
 {
-    log_verbose("Setting GDT descriptors");
-    gdt_set_gate(0, 0, 0);
-    gdt_set_gate(1, 0x9A, 0x20);
-    gdt_set_gate(2, 0x92, 0x00);
+    uint64_t base = (uint64_t)tss;
+    uint32_t limit = sizeof(tss_t) - 1;
+
+    gdt[num].limit_low = limit & 0xFFFF;
+    gdt[num].base_low = base & 0xFFFF;
+    gdt[num].base_mid = (base >> 16) & 0xFF;
+    gdt[num].access = 0x89; // Present, 64-bit available TSS
+    gdt[num].flags_limit_high = (limit >> 16) & 0x0F;
+    gdt[num].base_high = (base >> 24) & 0xFF;
 
-    gdtr.limit = sizeof(gdt) - 1;
-    gdtr.base = (uintptr_t)&gdt[0];
-    gdt_flush();
+    uint32_t *high = (uint32_t *)&gdt[num + 1];
+    high[0] = base >> 32;
+    high[1] = 0;
 }
 
-void gdt_flush()
+static void gdt_flush(gdtr_t *gdtr)
 {
-    log_verbose("Flushing GDT");
     __asm__ volatile("lgdt %0\n\t"
                      "push $0x08\n\t"
                      "lea 1f(%%rip), %%rax\n\t"
@@ -45,6 +56,55 @@ void gdt_flush()
                      "mov %%ax, %%gs\n\t"
                      "mov %%ax, %%ss\n\t"
                      :
-                     : "m"(gdtr)
+                     : "m"(*gdtr)
                      : "rax", "memory");
-}
\ No newline at end of file
+    __asm__ volatile("ltr %w0" : : "r"(GDT_TSS_SEGMENT) : "memory");
+}
+
+void gdt_alloc_ist_stacks(cpu_t *cpu)
+{
+    // Straight from the PMM, so the stacks are mapped through the HHDM
+    // rather than the heap, which may fault them in
+    uint8_t order = pmm_order_for_size(IST_STACK_SIZE);
+    for (int i = 0; i < IST_COUNT; i++) {
+        void *phys = pmm_alloc_pages(order);
+        if (!phys) {
+            panic("Failed to allocate interrupt stacks");
+        }
+        cpu->ist_stacks[i] = phys_to_virt(phys);
+    }
+}
+
+void gdt_load_cpu(cpu_t *cpu)
+{
+    for (int i = 0; i < IST_COUNT; i++) {
+        if (!cpu->ist_stacks[i]) {
+            panic("CPU has no interrupt stacks");
+        }
+        // Stacks grow down, so the TSS holds the top of each one
+        cpu->tss.ist[i] = (uint64_t)cpu->ist_stacks[i] + IST_STACK_SIZE;
+    }
+    cpu->tss.iomap_base = sizeof(tss_t);
+
+    gdt_set_gate(cpu->gdt, 0, 0, 0);
+    gdt_set_gate(cpu->gdt, 1, 0x9A, 0x20);
+    gdt_set_gate(cpu->gdt, 2, 0x92, 0x00);
+    gdt_set_tss(cpu->gdt, 3, &cpu->tss);
+
+    cpu->gdtr.limit = sizeof(cpu->gdt) - 1;
+    cpu->gdtr.base = (uintptr_t)&cpu->gdt[0];
+    gdt_flush(&cpu->gdtr);
+
+    // Loading a selector into GS clears its base, so this has to come last
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
+
+void gdt_init()
+{
+    log_verbose("Setting GDT descriptors");
+    cpu_t *bsp = smp_bsp();
+    for (int i = 0; i < IST_COUNT; i++) {
+        bsp->ist_stacks[i] = bsp_ist_stacks[i];
+    }
+    gdt_load_cpu(bsp);
+}
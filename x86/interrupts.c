@@ -5,18 +5,23 @@
 #include <apic.h>
 #include <cpu.h>
 #include <debug.h>
+#include <fpu.h>
 #include <gdt.h>
-#include <heap.h>
 #include <idt.h>
 #include <init.h>
 #include <interrupts.h>
 #include <io.h>
+#include <irqstat.h>
 #include <isr.h>
 #include <keyboard.h>
+#include <lock.h>
 #include <panic.h>
 #include <pic.h>
 #include <pit.h>
 #include <prediction.h>
+#include <slab.h>
+#include <smp.h>
+#include <softirq.h>
 #include <stdio.h>
 #include <string.h>
 #include <tty.h>
@@ -24,6 +29,19 @@
 #define VECTOR_TABLE_SIZE 48
 
 struct irq_handler_entry *irq_handlers[16];
+static kmem_cache_t *irq_handler_cache;
+
+// Handler chains and allocation bitmap for the dynamic vectors
+static struct irq_handler_entry *vector_handlers[VECTOR_DYNAMIC_COUNT];
+static uint64_t vector_bitmap[(VECTOR_DYNAMIC_COUNT + 63) / 64];
+
+// Handlers running on each chain. Dispatch walks a chain without a lock, so
+// a removed entry is only freed once its chain has no handler in flight.
+static uint32_t irq_running[16];
+static uint32_t vector_running[VECTOR_DYNAMIC_COUNT];
+
+// Serialises changes to every chain, legacy IRQs and dynamic vectors alike
+static spinlock_t vector_lock = {0, "irq_vector"};
 void (*exception_handlers[32])(interrupt_frame_t *);
 
 idt_entry_t idt[IDT_ENTRIES];
@@ -45,8 +63,37 @@ void interrupt_send_eoi(uint8_t irq)
     }
 }
 
+void irq_enter(uint8_t vector)
+{
+    cpu_t *cpu = this_cpu();
+    if (cpu->irq_nesting == 0) {
+        fpu_irq_enter(cpu);
+    }
+    irqstat_handler_start(cpu, cpu->irq_nesting++, vector);
+}
+
+void irq_exit()
+{
+    cpu_t *cpu = this_cpu();
+    irqstat_handler_end(cpu, cpu->irq_nesting - 1);
+    if (cpu->irq_nesting == 1) {
+        softirq_irq_exit(cpu);
+    }
+    if (--cpu->irq_nesting == 0) {
+        fpu_irq_exit(cpu);
+    }
+}
+
 uint64_t exception_dispatch(uint64_t rsp, uint8_t vector)
 {
+    // #NM loads FPU state for the thread that raised it, so it doesn't count
+    // as a handler
+    if (vector == 7) {
+        fpu_nm_handler((interrupt_frame_t *)rsp);
+        return rsp;
+    }
+
+    irq_enter(vector);
     if (vector < 32) {
         if (exception_handlers[vector]) {
             exception_handlers[vector]((interrupt_frame_t *)rsp);
@@ -59,6 +106,7 @@ uint64_t exception_dispatch(uint64_t rsp, uint8_t vector)
             }
         }
     }
+    irq_exit();
     return rsp;
 }
 
@@ -77,16 +125,91 @@ void exception_uninstall_handler(uint8_t vector)
     }
 }
 
+static uint64_t handler_chain_run(struct irq_handler_entry **chain,
+                                  uint32_t *running, uint64_t rsp)
+{
+    __atomic_fetch_add(running, 1, __ATOMIC_SEQ_CST);
+    struct irq_handler_entry *handler =
+        __atomic_load_n(chain, __ATOMIC_ACQUIRE);
+    while (handler) {
+        if (handler->handler) {
+            rsp = handler->handler(rsp, handler->ctx);
+        }
+        handler = __atomic_load_n(&handler->next, __ATOMIC_ACQUIRE);
+    }
+    __atomic_fetch_sub(running, 1, __ATOMIC_RELEASE);
+    return rsp;
+}
+
+/**
+ * @brief Frees entries unlinked from a chain once no dispatch can still be
+ * walking them. Called without vector_lock, and never from a handler on the
+ * same chain, which would wait for itself.
+ */
+static void handler_chain_free(struct irq_handler_entry *entries,
+                               uint32_t *running)
+{
+    if (!entries) {
+        return;
+    }
+    while (__atomic_load_n(running, __ATOMIC_ACQUIRE)) {
+        cpu_pause();
+    }
+    while (entries) {
+        struct irq_handler_entry *next = entries->next;
+        kmem_cache_free(irq_handler_cache, entries);
+        entries = next;
+    }
+}
+
+// New handlers go on the end, fully set up before the release store that
+// links them, so a dispatch running concurrently sees either the old chain
+// or the new one
+static void handler_chain_add(struct irq_handler_entry **chain,
+                              uint64_t (*handler)(uint64_t, void *),
+                              void *ctx)
+{
+    struct irq_handler_entry *new_handler = kmem_cache_alloc(irq_handler_cache);
+    if (!new_handler) {
+        panic("Failed to allocate memory for IRQ handler");
+    }
+
+    new_handler->handler = handler;
+    new_handler->ctx = ctx;
+    new_handler->next = NULL;
+
+    struct irq_handler_entry **link = chain;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    __atomic_store_n(link, new_handler, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Unlinks a handler from a chain, under vector_lock. The entry is
+ * returned for handler_chain_free() rather than freed here.
+ */
+static struct irq_handler_entry *
+handler_chain_remove(struct irq_handler_entry **chain,
+                     uint64_t (*handler)(uint64_t, void *), void *ctx)
+{
+    for (struct irq_handler_entry **link = chain; *link;
+         link = &(*link)->next) {
+        struct irq_handler_entry *current = *link;
+        if (current->handler == handler && current->ctx == ctx) {
+            // A dispatch already on this entry still follows its next
+            __atomic_store_n(link, current->next, __ATOMIC_RELEASE);
+            current->next = NULL;
+            return current;
+        }
+    }
+    return NULL;
+}
+
 uint64_t irq_dispatch(uint64_t rsp, uint8_t irq)
 {
     if (irq < 16) {
-        struct irq_handler_entry *handler = irq_handlers[irq];
-        while (handler) {
-            if (handler->handler) {
-                rsp = handler->handler(rsp, handler->ctx);
-            }
-            handler = handler->next;
-        }
+        rsp = handler_chain_run(&irq_handlers[irq], &irq_running[irq], rsp);
     } else {
         log_warn("irq_dispatch: Tried to call invalid IRQ: %d", irq);
     }
@@ -97,26 +220,10 @@ void irq_install_handler(uint8_t irq, uint64_t (*handler)(uint64_t, void *),
                          void *ctx)
 {
     if (irq < 16) {
-        struct irq_handler_entry *new_handler =
-            malloc(sizeof(struct irq_handler_entry));
-        if (!new_handler) {
-            panic("Failed to allocate memory for IRQ handler");
-        }
-
-        new_handler->handler = handler;
-        new_handler->ctx = ctx;
-        new_handler->next = NULL;
-
-        if (irq_handlers[irq] == NULL) {
-            irq_handlers[irq] = new_handler;
-        } else {
-            struct irq_handler_entry *current = irq_handlers[irq];
-            while (current->next) {
-                current = current->next;
-            }
-            current->next = new_handler;
-        }
+        uint64_t flags = spinlock_acquire_irqsave(&vector_lock);
+        handler_chain_add(&irq_handlers[irq], handler, ctx);
         irq_clear_mask(irq);
+        spinlock_release_irqrestore(&vector_lock, flags);
     }
 }
 
@@ -124,29 +231,101 @@ void irq_uninstall_handler(uint8_t irq, uint64_t (*handler)(uint64_t, void *),
                            void *ctx)
 {
     if (irq < 16) {
-        struct irq_handler_entry *current = irq_handlers[irq];
-        struct irq_handler_entry *prev = NULL;
-
-        while (current) {
-            if (current->handler == handler && current->ctx == ctx) {
-                if (prev) {
-                    prev->next = current->next;
-                } else {
-                    irq_handlers[irq] = current->next;
-                }
-                free(current);
-                break;
-            }
-            prev = current;
-            current = current->next;
-        }
-
+        uint64_t flags = spinlock_acquire_irqsave(&vector_lock);
+        struct irq_handler_entry *removed =
+            handler_chain_remove(&irq_handlers[irq], handler, ctx);
         if (irq_handlers[irq] == NULL) {
             irq_set_mask(irq);
         }
+        spinlock_release_irqrestore(&vector_lock, flags);
+        handler_chain_free(removed, &irq_running[irq]);
     }
 }
 
+static bool is_dynamic_vector(uint8_t vector)
+{
+    return vector >= VECTOR_DYNAMIC_START && vector <= VECTOR_DYNAMIC_END;
+}
+
+int irq_alloc_vector()
+{
+    uint64_t flags = spinlock_acquire_irqsave(&vector_lock);
+    for (int i = 0; i < VECTOR_DYNAMIC_COUNT; i++) {
+        if (!(vector_bitmap[i / 64] & (1ULL << (i % 64)))) {
+            vector_bitmap[i / 64] |= 1ULL << (i % 64);
+            spinlock_release_irqrestore(&vector_lock, flags);
+            return VECTOR_DYNAMIC_START + i;
+        }
+    }
+    spinlock_release_irqrestore(&vector_lock, flags);
+    log_err("irq_alloc_vector: No free interrupt vectors");
+    return -1;
+}
+
+void irq_free_vector(uint8_t vector)
+{
+    if (!is_dynamic_vector(vector)) {
+        return;
+    }
+
+    int i = vector - VECTOR_DYNAMIC_START;
+    uint64_t flags = spinlock_acquire_irqsave(&vector_lock);
+    struct irq_handler_entry *removed = vector_handlers[i];
+    __atomic_store_n(&vector_handlers[i], NULL, __ATOMIC_RELEASE);
+    spinlock_release_irqrestore(&vector_lock, flags);
+
+    // The vector only becomes free once its old handlers can't run
+    handler_chain_free(removed, &vector_running[i]);
+    flags = spinlock_acquire_irqsave(&vector_lock);
+    vector_bitmap[i / 64] &= ~(1ULL << (i % 64));
+    spinlock_release_irqrestore(&vector_lock, flags);
+}
+
+bool vector_install_handler(uint8_t vector,
+                            uint64_t (*handler)(uint64_t, void *), void *ctx)
+{
+    if (!is_dynamic_vector(vector)) {
+        return false;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&vector_lock);
+    handler_chain_add(&vector_handlers[vector - VECTOR_DYNAMIC_START], handler,
+                      ctx);
+    spinlock_release_irqrestore(&vector_lock, flags);
+    return true;
+}
+
+bool vector_uninstall_handler(uint8_t vector,
+                              uint64_t (*handler)(uint64_t, void *), void *ctx)
+{
+    if (!is_dynamic_vector(vector)) {
+        return false;
+    }
+
+    int i = vector - VECTOR_DYNAMIC_START;
+    uint64_t flags = spinlock_acquire_irqsave(&vector_lock);
+    struct irq_handler_entry *removed =
+        handler_chain_remove(&vector_handlers[i], handler, ctx);
+    spinlock_release_irqrestore(&vector_lock, flags);
+    handler_chain_free(removed, &vector_running[i]);
+    return removed != NULL;
+}
+
+bool vector_has_handlers(uint8_t vector)
+{
+    return is_dynamic_vector(vector) &&
+           vector_handlers[vector - VECTOR_DYNAMIC_START] != NULL;
+}
+
+uint64_t vector_dispatch(uint64_t rsp, uint8_t vector)
+{
+    if (is_dynamic_vector(vector)) {
+        int i = vector - VECTOR_DYNAMIC_START;
+        rsp = handler_chain_run(&vector_handlers[i], &vector_running[i], rsp);
+    }
+    return rsp;
+}
+
 extern void isr_div_err();
 extern void isr_debug();
 extern void isr_nmi_int();
@@ -199,12 +378,19 @@ extern void isr_irq15();
 
 void enable_interrupts()
 {
+    if (irqstat_enabled() && !are_interrupts_enabled()) {
+        irqstat_irqoff_end();
+    }
     __asm__("sti");
 }
 
 void disable_interrupts()
 {
+    bool was_enabled = are_interrupts_enabled();
     __asm__("cli");
+    if (was_enabled) {
+        irqstat_irqoff_begin((uintptr_t)__builtin_return_address(0));
+    }
 }
 
 bool are_interrupts_enabled()
@@ -230,6 +416,11 @@ void idt_set_descriptor(uint8_t vector, void *isr, uint8_t flags)
     descriptor->reserved = 0;
 }
 
+void idt_set_ist(uint8_t vector, uint8_t ist)
+{
+    idt[vector].ist = ist;
+}
+
 void idt_init()
 {
     for (int i = 0; i < 16; i++) {
@@ -310,6 +501,29 @@ void idt_init()
         io_wait(); // Prevent synchronisation issues
     }
 
+    for (int i = 0; i < VECTOR_DYNAMIC_COUNT; i++) {
+        idt_set_descriptor(VECTOR_DYNAMIC_START + i, isr_vector_stubs[i],
+                           0x8E);
+    }
+
+    idt_set_descriptor(VECTOR_LAPIC_TIMER, &isr_lapic_timer, 0x8E);
+    idt_set_descriptor(VECTOR_TLB_SHOOTDOWN, &isr_tlb_shootdown, 0x8E);
+    idt_set_descriptor(VECTOR_RESCHEDULE, &isr_reschedule, 0x8E);
+    idt_set_descriptor(VECTOR_CPU_STOP, &isr_cpu_stop, 0x8E);
+    idt_set_descriptor(VECTOR_SPURIOUS, &isr_spurious, 0x8E);
+
+    // These can arrive with the kernel stack unusable
+    idt_set_ist(8, IST_DOUBLE_FAULT);
+    idt_set_ist(2, IST_NMI);
+    idt_set_ist(18, IST_MACHINE_CHECK);
+
+    // Created up front, so installing a handler never races to create it
+    irq_handler_cache = kmem_cache_create(
+        "irq_handler", sizeof(struct irq_handler_entry), 0, NULL);
+    if (!irq_handler_cache) {
+        panic("Failed to create the IRQ handler cache");
+    }
+
     log_verbose("Loading IDT");
     idt_load();
     register_exceptions();
@@ -0,0 +1,141 @@
+#include <cpu.h>
+#include <irqstat.h>
+#include <lock.h>
+#include <smp.h>
+#include <string.h>
+
+static bool stat_enabled;
+// Bumped on every enable and reset, so windows and handlers that started
+// before are not counted
+static uint32_t stat_epoch = 1;
+
+static irqstat_vector_t vector_stats[256];
+static irqstat_irqoff_t longest_irqoff;
+static spinlock_t irqoff_lock = {0, "irqstat"};
+
+void irqstat_enable(bool enable)
+{
+    if (enable) {
+        __atomic_add_fetch(&stat_epoch, 1, __ATOMIC_RELEASE);
+    }
+    stat_enabled = enable;
+}
+
+bool irqstat_enabled()
+{
+    return stat_enabled;
+}
+
+void irqstat_reset()
+{
+    __atomic_add_fetch(&stat_epoch, 1, __ATOMIC_RELEASE);
+    memset(vector_stats, 0, sizeof(vector_stats));
+
+    uint64_t flags = spinlock_acquire_irqsave(&irqoff_lock);
+    memset(&longest_irqoff, 0, sizeof(longest_irqoff));
+    spinlock_release_irqrestore(&irqoff_lock, flags);
+}
+
+bool irqstat_vector(uint8_t vector, irqstat_vector_t *stats)
+{
+    *stats = vector_stats[vector];
+    return stats->count != 0;
+}
+
+void irqstat_irqoff(irqstat_irqoff_t *window)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&irqoff_lock);
+    *window = longest_irqoff;
+    spinlock_release_irqrestore(&irqoff_lock, flags);
+}
+
+uint64_t irqstat_cycles_to_ns(uint64_t cycles)
+{
+    uint64_t mhz = get_tsc_freq() / 1000000;
+    return mhz ? cycles * 1000 / mhz : cycles;
+}
+
+static int bucket_of(uint64_t cycles)
+{
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    return bucket < IRQSTAT_BUCKETS ? bucket : IRQSTAT_BUCKETS - 1;
+}
+
+static void record(irqstat_vector_t *stats, uint64_t cycles)
+{
+    __atomic_add_fetch(&stats->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->total_cycles, cycles, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->histogram[bucket_of(cycles)], 1,
+                       __ATOMIC_RELAXED);
+
+    // 0 means no minimum yet
+    uint64_t min = __atomic_load_n(&stats->min_cycles, __ATOMIC_RELAXED);
+    while ((min == 0 || cycles < min) &&
+           !__atomic_compare_exchange_n(&stats->min_cycles, &min, cycles, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    uint64_t max = __atomic_load_n(&stats->max_cycles, __ATOMIC_RELAXED);
+    while (cycles > max &&
+           !__atomic_compare_exchange_n(&stats->max_cycles, &max, cycles, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void irqstat_handler_start(cpu_t *cpu, uint32_t depth, uint8_t vector)
+{
+    if (!stat_enabled || depth >= IRQSTAT_MAX_NESTING) {
+        return;
+    }
+    cpu->irqstat_vector[depth] = vector;
+    cpu->irqstat_epoch[depth] = stat_epoch;
+    cpu->irqstat_start[depth] = __builtin_ia32_rdtsc();
+}
+
+void irqstat_handler_end(cpu_t *cpu, uint32_t depth)
+{
+    if (!stat_enabled || depth >= IRQSTAT_MAX_NESTING ||
+        cpu->irqstat_epoch[depth] != stat_epoch) {
+        return;
+    }
+    uint64_t cycles = __builtin_ia32_rdtsc() - cpu->irqstat_start[depth];
+    cpu->irqstat_epoch[depth] = 0;
+    record(&vector_stats[cpu->irqstat_vector[depth]], cycles);
+}
+
+void irqstat_irqoff_begin(uintptr_t caller)
+{
+    if (!stat_enabled) {
+        return;
+    }
+    cpu_t *cpu = this_cpu();
+    cpu->irqoff_caller = caller;
+    cpu->irqoff_epoch = stat_epoch;
+    cpu->irqoff_start = __builtin_ia32_rdtsc();
+}
+
+void irqstat_irqoff_end()
+{
+    if (!stat_enabled) {
+        return;
+    }
+    cpu_t *cpu = this_cpu();
+    // Windows opened by a plain cli, or before tracking was enabled, are
+    // not known
+    if (cpu->irqoff_epoch != stat_epoch) {
+        return;
+    }
+    uint64_t cycles = __builtin_ia32_rdtsc() - cpu->irqoff_start;
+    cpu->irqoff_epoch = 0;
+
+    if (cycles <= __atomic_load_n(&longest_irqoff.cycles, __ATOMIC_RELAXED)) {
+        return;
+    }
+    // Interrupts are still off here
+    spinlock_acquire(&irqoff_lock);
+    if (cycles > longest_irqoff.cycles) {
+        longest_irqoff.cycles = cycles;
+        longest_irqoff.caller = cpu->irqoff_caller;
+        longest_irqoff.cpu = cpu->id;
+    }
+    spinlock_release(&irqoff_lock);
+}
@@ -1,13 +1,18 @@
 #include <stdint.h>
 
+#include <anon.h>
+#include <apic.h>
 #include <cpu.h>
 #include <debug.h>
+#include <idt.h>
 #include <interrupts.h>
 #include <isr.h>
 #include <keyboard.h>
 #include <panic.h>
 #include <pic.h>
 #include <pit.h>
+#include <scheduler.h>
+#include <smp.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -47,12 +52,21 @@
 
 #define IRETQ() __asm__ volatile("iretq\n");
 
+// Expands a macro argument before quoting it, for vector names in asm
+#define STRINGIFY(x) #x
+#define EXPAND_STRINGIFY(x) STRINGIFY(x)
+
+// The interrupt frame, the error code and the 15 saved registers come to 21
+// words, which leaves the stack 8 bytes off the 16-byte alignment C code
+// expects. exception_dispatch() returns the frame pointer it was given, so
+// the stubs align the stack for the call and get the frame back from RAX.
 #define EXCEPTION_HANDLER(n, vector)                                           \
     __attribute__((naked)) void isr_##n()                                      \
     {                                                                          \
         __asm__ volatile("push $0\n");                                         \
         PUSH_REGS();                                                           \
         __asm__ volatile("mov %rsp, %rdi\n"                                    \
+                         "and $-16, %rsp\n"                                    \
                          "mov $" #vector ", %rsi\n"                            \
                          "call exception_dispatch\n"                           \
                          "mov %rax, %rsp\n");                                  \
@@ -66,6 +80,7 @@
     {                                                                          \
         PUSH_REGS();                                                           \
         __asm__ volatile("mov %rsp, %rdi\n"                                    \
+                         "and $-16, %rsp\n"                                    \
                          "mov $" #vector ", %rsi\n"                            \
                          "call exception_dispatch\n"                           \
                          "mov %rax, %rsp\n");                                  \
@@ -108,32 +123,56 @@ EXCEPTION_HANDLER_ERR(vmm_comm, 29)
 EXCEPTION_HANDLER_ERR(security_protection, 30)
 EXCEPTION_HANDLER(res31, 31)
 
-#define IRQ_HANDLER(n, handler, irq_num)                                       \
+#define IRQ_HANDLER(n, handler, irq_num, vector)                               \
     __attribute__((naked)) void n()                                            \
     {                                                                          \
         PUSH_REGS()                                                            \
-        __asm__ volatile("mov %rsp, %rdi\n"                                    \
+        __asm__ volatile("mov $" EXPAND_STRINGIFY(vector) ", %rdi\n"           \
+                         "call irq_enter\n"                                    \
+                         "mov %rsp, %rdi\n"                                    \
                          "call " #handler "\n"                                 \
                          "mov %rax, %rsp\n"                                    \
                          "mov $" #irq_num ", %rdi\n"                           \
-                         "call interrupt_send_eoi\n");                         \
+                         "call interrupt_send_eoi\n"                           \
+                         "call irq_exit\n");                                   \
         POP_REGS()                                                             \
         IRETQ()                                                                \
     }
 
-IRQ_HANDLER(isr_pit, pit_handler, 0)
-IRQ_HANDLER(isr_keyboard, keyboard_handler, 1)
+IRQ_HANDLER(isr_pit, pit_handler, 0, 0x20)
+IRQ_HANDLER(isr_keyboard, keyboard_handler, 1, 0x21)
+IRQ_HANDLER(isr_lapic_timer, lapic_timer_handler, 0, VECTOR_LAPIC_TIMER)
+IRQ_HANDLER(isr_tlb_shootdown, tlb_shootdown_handler, 0, VECTOR_TLB_SHOOTDOWN)
+IRQ_HANDLER(isr_reschedule, scheduler_reschedule_handler, 0,
+            VECTOR_RESCHEDULE)
 
+// Spurious LAPIC interrupts must not be acknowledged
+__attribute__((naked)) void isr_spurious()
+{
+    IRETQ()
+}
+
+__attribute__((naked)) void isr_cpu_stop()
+{
+    __asm__ volatile("cli\n"
+                     "1: hlt\n"
+                     "jmp 1b\n");
+}
+
+// Legacy IRQs sit at vectors 0x20-0x2F
 #define IRQ_HANDLER_GENERIC(n, irq_num)                                        \
     __attribute__((naked)) void n()                                            \
     {                                                                          \
         PUSH_REGS()                                                            \
-        __asm__ volatile("mov %rsp, %rdi\n"                                    \
+        __asm__ volatile("mov $(0x20 + " #irq_num "), %rdi\n"                  \
+                         "call irq_enter\n"                                    \
+                         "mov %rsp, %rdi\n"                                    \
                          "mov $" #irq_num ", %rsi\n"                           \
                          "call irq_dispatch\n"                                 \
                          "mov %rax, %rsp\n"                                    \
                          "mov $" #irq_num ", %rdi\n"                           \
-                         "call interrupt_send_eoi\n");                         \
+                         "call interrupt_send_eoi\n"                           \
+                         "call irq_exit\n");                                   \
         POP_REGS()                                                             \
         IRETQ()                                                                \
     }
@@ -155,11 +194,98 @@ IRQ_HANDLER_GENERIC(isr_irq13, 13)
 IRQ_HANDLER_GENERIC(isr_irq14, 14)
 IRQ_HANDLER_GENERIC(isr_irq15, 15)
 
+// Dynamic vectors only arrive through the LAPIC, from MSI or a remapped
+// IOAPIC pin, so they are always acknowledged there
+#define IRQ_HANDLER_VECTOR(vector)                                             \
+    __attribute__((naked)) void isr_vector_##vector()                          \
+    {                                                                          \
+        PUSH_REGS()                                                            \
+        __asm__ volatile("mov $" #vector ", %rdi\n"                            \
+                         "call irq_enter\n"                                    \
+                         "mov %rsp, %rdi\n"                                    \
+                         "mov $" #vector ", %rsi\n"                            \
+                         "call vector_dispatch\n"                              \
+                         "mov %rax, %rsp\n"                                    \
+                         "call lapic_eoi\n"                                    \
+                         "call irq_exit\n");                                   \
+        POP_REGS()                                                             \
+        IRETQ()                                                                \
+    }
+
+#define IRQ_HANDLER_VECTOR_16(high)                                            \
+    IRQ_HANDLER_VECTOR(high##0)                                                \
+    IRQ_HANDLER_VECTOR(high##1)                                                \
+    IRQ_HANDLER_VECTOR(high##2)                                                \
+    IRQ_HANDLER_VECTOR(high##3)                                                \
+    IRQ_HANDLER_VECTOR(high##4)                                                \
+    IRQ_HANDLER_VECTOR(high##5)                                                \
+    IRQ_HANDLER_VECTOR(high##6)                                                \
+    IRQ_HANDLER_VECTOR(high##7)                                                \
+    IRQ_HANDLER_VECTOR(high##8)                                                \
+    IRQ_HANDLER_VECTOR(high##9)                                                \
+    IRQ_HANDLER_VECTOR(high##A)                                                \
+    IRQ_HANDLER_VECTOR(high##B)                                                \
+    IRQ_HANDLER_VECTOR(high##C)                                                \
+    IRQ_HANDLER_VECTOR(high##D)                                                \
+    IRQ_HANDLER_VECTOR(high##E)                                                \
+    IRQ_HANDLER_VECTOR(high##F)
+
+#define VECTOR_STUBS_16(high)                                                  \
+    &isr_vector_##high##0,                                                     \
+    &isr_vector_##high##1,                                                     \
+    &isr_vector_##high##2,                                                     \
+    &isr_vector_##high##3,                                                     \
+    &isr_vector_##high##4,                                                     \
+    &isr_vector_##high##5,                                                     \
+    &isr_vector_##high##6,                                                     \
+    &isr_vector_##high##7,                                                     \
+    &isr_vector_##high##8,                                                     \
+    &isr_vector_##high##9,                                                     \
+    &isr_vector_##high##A,                                                     \
+    &isr_vector_##high##B,                                                     \
+    &isr_vector_##high##C,                                                     \
+    &isr_vector_##high##D,                                                     \
+    &isr_vector_##high##E,                                                     \
+    &isr_vector_##high##F,
+
+IRQ_HANDLER_VECTOR_16(0x3)
+IRQ_HANDLER_VECTOR_16(0x4)
+IRQ_HANDLER_VECTOR_16(0x5)
+IRQ_HANDLER_VECTOR_16(0x6)
+IRQ_HANDLER_VECTOR_16(0x7)
+IRQ_HANDLER_VECTOR_16(0x8)
+IRQ_HANDLER_VECTOR_16(0x9)
+IRQ_HANDLER_VECTOR_16(0xA)
+IRQ_HANDLER_VECTOR_16(0xB)
+IRQ_HANDLER_VECTOR_16(0xC)
+IRQ_HANDLER_VECTOR_16(0xD)
+IRQ_HANDLER_VECTOR_16(0xE)
+
+void *const isr_vector_stubs[VECTOR_DYNAMIC_COUNT] = {
+    VECTOR_STUBS_16(0x3)
+    VECTOR_STUBS_16(0x4)
+    VECTOR_STUBS_16(0x5)
+    VECTOR_STUBS_16(0x6)
+    VECTOR_STUBS_16(0x7)
+    VECTOR_STUBS_16(0x8)
+    VECTOR_STUBS_16(0x9)
+    VECTOR_STUBS_16(0xA)
+    VECTOR_STUBS_16(0xB)
+    VECTOR_STUBS_16(0xC)
+    VECTOR_STUBS_16(0xD)
+    VECTOR_STUBS_16(0xE)
+};
+
 void page_fault_handler(interrupt_frame_t *frame)
 {
     uint64_t rip = frame->rip;
     cr2_t address = get_cr2();
 
+    // Demand-zero regions commit their pages here
+    if (anon_handle_fault(address, frame->error_code)) {
+        return;
+    }
+
     char buf[128];
     snprintf(buf, sizeof(buf),
              "Page fault\nInstruction: 0x%016lx\nAddress: 0x%016lx\n", rip,
@@ -167,6 +293,12 @@ void page_fault_handler(interrupt_frame_t *frame)
     panic(buf);
 }
 
+uint64_t tlb_shootdown_handler(uint64_t rsp)
+{
+    smp_tlb_poll();
+    return rsp;
+}
+
 void double_fault_handler(interrupt_frame_t *frame)
 {
     panic("Double fault");
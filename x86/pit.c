@@ -1,19 +1,21 @@
 #include <stdbool.h>
 
+#include <apic.h>
 #include <debug.h>
 #include <interrupts.h>
 #include <io.h>
 #include <panic.h>
+#include <pic.h>
 #include <pit.h>
 #include <prediction.h>
 #include <stdio.h>
 
 #include <scheduler.h>
-
-#define PIT_FREQUENCY 1000
+#include <timer.h>
 
 volatile uint64_t pit_ticks = 0;
 bool pit_initialised = false;
+bool pit_stopped = false;
 
 void pit_init()
 {
@@ -40,11 +42,30 @@ void pit_init()
     pit_initialised = true;
 }
 
+void pit_stop()
+{
+    // Mode 0 waits for a count that is never written, so OUT stays low
+    outb(PIT_CMD_PORT, 0x30);
+    if (is_apic_in_use()) {
+        ioapic_mask_gsi(irq_to_gsi(IRQ_TYPE_PIT), true);
+    } else {
+        irq_set_mask(IRQ_TYPE_PIT);
+    }
+    pit_stopped = true;
+    log_verbose("PIT stopped, the LAPIC timers take over");
+}
+
 uint64_t pit_handler(uint64_t rsp)
 {
     unlikely_warn(++pit_ticks == UINT64_MAX,
                   "PIT tick overflow, system may be unstable");
 
+    // Once the LAPIC timers are running they drive the scheduler on every
+    // CPU, and the PIT only keeps time
+    if (lapic_timer_active()) {
+        return rsp;
+    }
+    timer_run_expired();
     return scheduler_schedule(rsp);
 }
 
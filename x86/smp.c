@@ -0,0 +1,221 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <apic.h>
+#include <clocksource.h>
+#include <cpu.h>
+#include <debug.h>
+#include <gdt.h>
+#include <idt.h>
+#include <interrupts.h>
+#include <limine.h>
+#include <pit.h>
+#include <scheduler.h>
+#include <smp.h>
+#include <vmm.h>
+
+// How long to wait for an application processor to come up
+#define AP_START_TIMEOUT_NS 100000000ULL
+
+// Past this many pages a full TLB flush is cheaper than invlpg per page
+#define TLB_FLUSH_ALL_PAGES 32
+
+static cpu_t cpus[MAX_CPUS] = {
+    [0] = {.self = &cpus[0], .id = 0, .online = true,
+           .run_lock = {0, "run_queue"}},
+};
+static uint32_t cpu_count = 1;
+
+// Address space the application processors switch to, the boot CPU's own
+static cr3_t kernel_cr3 = 0;
+
+// One shootdown at a time: the range is shared, and each CPU that still has
+// to flush it has its bit set in smp_tlb_pending
+volatile uint64_t smp_tlb_pending = 0;
+static spinlock_t tlb_lock = {0, "tlb_shootdown"};
+static volatile uintptr_t tlb_start = 0;
+static volatile size_t tlb_pages = 0;
+
+cpu_t *smp_bsp()
+{
+    return &cpus[0];
+}
+
+cpu_t *smp_get_cpu(uint32_t id)
+{
+    if (id >= MAX_CPUS || !cpus[id].online) {
+        return NULL;
+    }
+    return &cpus[id];
+}
+
+uint32_t smp_cpu_count()
+{
+    return __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+}
+
+static void flush_range(uintptr_t start, size_t num_pages)
+{
+    if (num_pages > TLB_FLUSH_ALL_PAGES) {
+        set_cr3(get_cr3());
+        return;
+    }
+    for (size_t i = 0; i < num_pages; i++) {
+        __asm__ volatile("invlpg (%0)" ::"r"(start + i * PAGE_SIZE)
+                         : "memory");
+    }
+}
+
+static void ap_entry(struct limine_mp_info *info)
+{
+    cpu_t *cpu = (cpu_t *)info->extra_argument;
+
+    // Limine starts us on its own page tables, which don't have anything the
+    // kernel mapped since boot
+    set_cr3(kernel_cr3);
+
+    // Lock spin loops look up this CPU, so GS has to be valid before anything
+    // takes a lock. gdt_load_cpu() sets it again after reloading GS.
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+
+    // Until the IDT is loaded any fault triple faults, so nothing before it
+    // may allocate. The interrupt stacks come from smp_init()
+    gdt_load_cpu(cpu);
+    idt_load();
+    cpu_init_ap();
+    lapic_init_cpu();
+    cpu->lapic_id = lapic_get_id();
+    lapic_timer_start();
+
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    scheduler_idle();
+}
+
+void smp_init()
+{
+    cpu_t *bsp = smp_bsp();
+
+    if (!is_apic_in_use()) {
+        log_warn("SMP: No APIC, running on the boot CPU only");
+        return;
+    }
+
+    bsp->lapic_id = lapic_get_id();
+    lapic_timer_calibrate();
+    lapic_timer_start();
+
+    // The idle boot CPU would still wake every millisecond for the PIT. It
+    // only has to keep ticking while the clock counts its interrupts
+    if (lapic_timer_active() && !clocksource_current()->ticks) {
+        pit_stop();
+    }
+
+    volatile struct limine_mp_response *response = mp_request.response;
+    if (!response) {
+        log_warn("SMP: No MP response from the bootloader");
+        return;
+    }
+
+    kernel_cr3 = get_cr3();
+    uint32_t online = 1;
+
+    for (uint64_t i = 0; i < response->cpu_count; i++) {
+        volatile struct limine_mp_info *info = response->cpus[i];
+        if (info->lapic_id == response->bsp_lapic_id) {
+            continue;
+        }
+
+        uint32_t id = cpu_count;
+        if (id >= MAX_CPUS) {
+            log_warn("SMP: Only %d CPUs are supported, ignoring the rest",
+                     MAX_CPUS);
+            break;
+        }
+
+        cpu_t *cpu = &cpus[id];
+        cpu->self = cpu;
+        cpu->id = id;
+        cpu->run_lock.name = "run_queue";
+        gdt_alloc_ist_stacks(cpu);
+        scheduler_init_ap(cpu);
+
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_RELEASE);
+
+        uint64_t deadline = clock_monotonic_ns() + AP_START_TIMEOUT_NS;
+        while (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+            if (clock_monotonic_ns() > deadline) {
+                break;
+            }
+            cpu_pause();
+        }
+        // The slot stays taken either way, a late CPU still jumps into it
+        __atomic_store_n(&cpu_count, id + 1, __ATOMIC_RELEASE);
+        if (!cpu->online) {
+            log_err("SMP: CPU with LAPIC ID %d did not start", info->lapic_id);
+            continue;
+        }
+        log_verbose("SMP: Started CPU %d (LAPIC ID %d)", id, cpu->lapic_id);
+        online++;
+    }
+
+    log_info("SMP: %d CPUs online", online);
+}
+
+void smp_tlb_poll()
+{
+    cpu_t *cpu = this_cpu();
+    uint64_t bit = 1ULL << cpu->id;
+
+    if (!(__atomic_load_n(&smp_tlb_pending, __ATOMIC_ACQUIRE) & bit)) {
+        return;
+    }
+    flush_range(tlb_start, tlb_pages);
+    __atomic_fetch_and(&smp_tlb_pending, ~bit, __ATOMIC_RELEASE);
+}
+
+void smp_tlb_shootdown(uintptr_t virt, size_t num_pages)
+{
+    uint32_t count = smp_cpu_count();
+    if (count <= 1 || num_pages == 0) {
+        return;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&tlb_lock);
+    uint32_t self = this_cpu()->id;
+
+    tlb_start = virt;
+    tlb_pages = num_pages;
+
+    uint64_t targets = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i != self && cpus[i].online) {
+            targets |= 1ULL << i;
+        }
+    }
+    __atomic_store_n(&smp_tlb_pending, targets, __ATOMIC_RELEASE);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (targets & (1ULL << i)) {
+            lapic_send_ipi(cpus[i].lapic_id, VECTOR_TLB_SHOOTDOWN);
+        }
+    }
+
+    while (__atomic_load_n(&smp_tlb_pending, __ATOMIC_ACQUIRE)) {
+        cpu_pause();
+    }
+
+    spinlock_release_irqrestore(&tlb_lock, flags);
+}
+
+void smp_stop_others()
+{
+    uint32_t self = lapic_get_id();
+    uint32_t count = smp_cpu_count();
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (cpus[i].online && cpus[i].lapic_id != self) {
+            lapic_send_ipi(cpus[i].lapic_id, VECTOR_CPU_STOP);
+        }
+    }
+}